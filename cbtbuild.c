@@ -22,12 +22,49 @@
 #include "access/reloptions.h"
 #include "storage/bufpage.h"
 #include "utils/elog.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "access/parallel.h"
+#include "access/xact.h"
+#include "catalog/pg_operator.h"
+#include "catalog/pg_type.h"
+#include "executor/tuptable.h"
+#include "miscadmin.h"
+#include "parser/parse_oper.h"
+#include "parser/scansup.h"
+#include "pgstat.h"
+#include "storage/buffile.h"
+#include "storage/condition_variable.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/shm_mq.h"
+#include "storage/shm_toc.h"
+#include "storage/spin.h"
+#include "utils/lsyscache.h"
+#include "utils/tuplesort.h"
+
+/* Kind of the cbtree reloptions, see cbt_init_reloptions */
+static relopt_kind cbt_relopt_kind;
+
+/* Finished pages are gathered and written out this many at a time */
+#define CBT_BUILD_BATCH_PAGES   32
+
+/*
+ * Parallel build: the keys of the shared memory table of contents, the
+ * size of the queue a worker sends the item counts of its leaves through,
+ * and the fewest heap blocks worth giving to a worker.
+ */
+#define CBT_PARALLEL_KEY_SHARED     UINT64CONST(0xC870000000000001)
+#define CBT_PARALLEL_KEY_QUEUES     UINT64CONST(0xC870000000000002)
+#define CBT_PARALLEL_QUEUE_SIZE     (16 * BLCKSZ)
+#define CBT_PARALLEL_MIN_BLOCKS     1024
 
 typedef struct CBTPageState
 {
     struct CBTPageState *cbtps_parent;
     Page                cbtps_page;
-    Size                cbtps_maxfill;
+    Size                cbtps_maxfill;  /* free space to leave on leaves */
+    int                 cbtps_maxitems; /* slots to fill on internal pages */
     BlockNumber         cbtps_blockno;
     OffsetNumber        cbtps_lastoff;
     uint32              cbtps_level;
@@ -38,24 +75,123 @@ typedef struct CBTPageState
 typedef struct
 {
     Relation        heap;
-    int             indtuples;
+    int             indtuples;      /* # leaf tuples added */
+    BlockNumber     cbtbs_nleaves;  /* # leaf pages */
     Relation	    index;
     bool		    cbtbs_use_wal;	/* dump pages to WAL? */
     BlockNumber     cbtbs_pages_alloced; /* # pages allocated */
     BlockNumber     cbtbs_pages_written; /* # pages written out */
     Page          cbtbs_zero_page;
+    char            *cbtbs_batch;   /* CBT_BUILD_BATCH_PAGES page images */
+    BlockNumber     cbtbs_batch_blknos[CBT_BUILD_BATCH_PAGES];
+    int             cbtbs_nbatch;   /* # pages in cbtbs_batch */
     CBTPageState    *leaf_pagestate;
     MemoryContext   context;
+
+    /* With build_order, the heap tuples are sorted before they are added */
+    Tuplesortstate  *cbtbs_sort;
+    TupleTableSlot  *cbtbs_slot;    /* (sort key, heap TID) */
+    AttrNumber      cbtbs_sortattr; /* heap column of the sort key */
 }CBTBuildState;
 
+/*
+ * The heap blocks one worker of a parallel build scans, and where the
+ * leaves filled from them go once they are all counted.
+ */
+typedef struct CBTParallelRange
+{
+    BlockNumber     start;
+    BlockNumber     nblocks;
+    bool            scanned;        /* all its leaves were counted */
+    BlockNumber     firstleaf;      /* number of its first leaf in the index */
+} CBTParallelRange;
+
+/* State of a parallel build in shared memory */
+typedef struct CBTParallelShared
+{
+    Oid             heaprelid;
+    Oid             indexrelid;
+    int             nranges;
+    int             maxitems;       /* downlinks the build puts on a page */
+
+    /* Broadcast once the leaves are placed and the index is extended */
+    ConditionVariable placedcv;
+
+    /* Added to by the workers as they finish scanning, under mutex */
+    slock_t         mutex;
+    bool            placed;
+    BlockNumber     nleaves;        /* leaves of the whole index, once placed */
+    double          reltuples;
+    bool            brokenhotchain;
+    CBTParallelRange ranges[FLEXIBLE_ARRAY_MEMBER];
+} CBTParallelShared;
+
+/*
+ * The leaves filled from one range of heap blocks, in order. The backend
+ * that fills them spools their images to a temporary file until they are
+ * placed, and then writes them out itself. The leader also keeps the
+ * number of items of each one, to build the upper levels from.
+ */
+typedef struct CBTLeafRun
+{
+    BufFile         *leaves;
+    BlockNumber     nleaves;
+    uint32          *counts;        /* items of each leaf, in the leader */
+    BlockNumber     maxleaves;      /* allocated length of counts */
+} CBTLeafRun;
+
+/*
+ * Fills leaves from heap tuples, in a worker or in the leader. Full leaves
+ * are spooled to run, and their number of items is sent to the leader
+ * through mqh or, in the leader, added to run.
+ */
+typedef struct CBTLeafSpool
+{
+    Page            page;
+    Size            maxfill;
+    shm_mq_handle   *mqh;
+    CBTLeafRun      *run;
+} CBTLeafSpool;
+
 static void cbtbuildCallback(Relation index, HeapTuple htup, Datum *values,
                  bool *isnull, bool tupleIsAlive, void *state);
 static void cbt_finish_upper_level(CBTBuildState *buildstate);
+static void cbt_finish_build(CBTBuildState *buildstate, BlockNumber root, uint32 level);
 static void cbt_build_add_tuple(CBTBuildState *state, CBTPageState *pagestate, CBTTuple newtuple);
 static void cbt_writepage(CBTBuildState *buildstate, Page page, BlockNumber blkno);
+static void cbt_flush_batch(CBTBuildState *buildstate);
+static int cbt_blkno_cmp(const void *a, const void *b);
 static void cbt_init_pagestate(CBTPageState *pagestate, CBTBuildState *bstate, uint32 level);
-static Page cbt_newpage(uint32 level);
-static void CBTFillMetaPage(Page metapage, BlockNumber root, uint32 level);
+static void cbt_newpage(Page page, uint32 level);
+static int cbt_parse_split_policy(const char *value);
+static void cbt_validate_split_policy(char *value);
+static bool cbt_parse_build_order(const char *value, char **colname, bool *desc);
+static void cbt_validate_build_order(char *value);
+static void cbt_begin_sort(CBTBuildState *buildstate, const char *order);
+static void cbt_load_sorted(CBTBuildState *buildstate);
+static bool cbt_leaf_full(Page page, CBTTuple newtuple, Size maxfill);
+static int cbt_parallel_workers(Relation heap, IndexInfo *indexInfo, const char *order);
+static double cbt_parallel_build(CBTBuildState *buildstate, IndexInfo *indexInfo,
+                                 int nworkers);
+static void cbt_parallel_receive(shm_mq_handle **mqh, CBTLeafRun *runs, int nqueues);
+static BlockNumber cbt_parallel_place(Relation index, CBTParallelShared *shared,
+                                      CBTLeafRun *runs);
+static double cbt_spool_range(CBTLeafSpool *spool, Relation heap, Relation index,
+                              IndexInfo *indexInfo, CBTParallelRange *range);
+static void cbt_spool_callback(Relation index, HeapTuple htup, Datum *values,
+                               bool *isnull, bool tupleIsAlive, void *state);
+static void cbt_spool_emit(CBTLeafSpool *spool);
+static void cbt_run_add_count(CBTLeafRun *run, uint32 nitems);
+static void cbt_write_run(Relation index, CBTLeafRun *run, BlockNumber firstleaf,
+                          BlockNumber nleaves, int maxitems);
+static BlockNumber cbt_build_upper_levels(CBTBuildState *buildstate, CBTLeafRun *runs,
+                                          int nruns, BlockNumber nleaves, int maxitems,
+                                          uint32 *level);
+static void cbt_build_next_page(CBTBuildState *state, CBTPageState *pagestate);
+
+extern PGDLLEXPORT void cbt_parallel_build_main(dsm_segment *seg, shm_toc *toc);
+static void CBTFillMetaPage(Page metapage, BlockNumber root, uint32 level,
+                            BlockNumber nleaves);
 
 /*
  * build a new counted btree index.
@@ -67,6 +203,8 @@ cbtbuild(Relation heap, Relation index, IndexInfo *indexInfo)
     CBTBuildState       buildstate;
     double              reltuples;
     IndexBuildResult    *result;
+    char                *order = CBTGetBuildOrder(index);
+    int                 nworkers;
 
     if (RelationGetNumberOfBlocks(index) != 0)
         elog(ERROR, "index \"%s\" already contains data",
@@ -74,6 +212,7 @@ cbtbuild(Relation heap, Relation index, IndexInfo *indexInfo)
 
     buildstate.leaf_pagestate = NULL;
     buildstate.indtuples = 0;
+    buildstate.cbtbs_nleaves = 0;
 
     /* Initialize the buildstate that is passed into IndexBuildHeapScan. */
     buildstate.cbtbs_pages_alloced = CBT_METAPAGE;
@@ -82,15 +221,33 @@ cbtbuild(Relation heap, Relation index, IndexInfo *indexInfo)
     buildstate.index = index;
     buildstate.cbtbs_use_wal = XLogIsNeeded() && RelationNeedsWAL(index);
     buildstate.cbtbs_zero_page = NULL;
+    buildstate.cbtbs_nbatch = 0;
     buildstate.context = AllocSetContextCreate(CurrentMemoryContext,
                                                 "Counted b tree build temporary context",
                                                 ALLOCSET_DEFAULT_SIZES);
+    buildstate.cbtbs_batch = MemoryContextAlloc(buildstate.context,
+                                                CBT_BUILD_BATCH_PAGES * BLCKSZ);
+    buildstate.cbtbs_sort = NULL;
 
-    /* Call the interface to loop over heap tuples. */
-    reltuples = IndexBuildHeapScan(heap, index, indexInfo, false, cbtbuildCallback, (void *) &buildstate);
+    nworkers = cbt_parallel_workers(heap, indexInfo, order);
+    if (nworkers > 0)
+        reltuples = cbt_parallel_build(&buildstate, indexInfo, nworkers);
+    else
+    {
+        if (order != NULL)
+            cbt_begin_sort(&buildstate, order);
+
+        /* Call the interface to loop over heap tuples. */
+        reltuples = IndexBuildHeapScan(heap, index, indexInfo, false, cbtbuildCallback, (void *) &buildstate);
+
+        /* Add the sorted tuples, if they were sorted */
+        if (buildstate.cbtbs_sort != NULL)
+            cbt_load_sorted(&buildstate);
+
+        /* Finish upper level and build meta page */
+        cbt_finish_upper_level(&buildstate);
+    }
 
-    /* Finish upper level and build meta page */
-    cbt_finish_upper_level(&buildstate);
     MemoryContextDelete(buildstate.context);
     result = (IndexBuildResult *) palloc(sizeof(IndexBuildResult));
     result->heap_tuples = reltuples;
@@ -102,7 +259,9 @@ cbtbuild(Relation heap, Relation index, IndexInfo *indexInfo)
 /*
  *  The call back function when iteration through tuples in heap.
  *  Construct a new cbt tuple from the current heap tuple and
- *  insert it into the counted B tree.
+ *  insert it into the counted B tree. Nothing is allocated per tuple;
+ *  the build only holds one page per level and the write batch, so its
+ *  memory doesn't grow with the table.
  */
 void
 cbtbuildCallback(Relation index,
@@ -114,15 +273,706 @@ cbtbuildCallback(Relation index,
 {
     CBTBuildState *buildstate = (CBTBuildState *) state;
     MemoryContext oldcontext;
-    CBTTuple      itup;
+    CBTTupleData  itup;
+
+    if (buildstate->cbtbs_sort != NULL)
+    {
+        TupleTableSlot *slot = buildstate->cbtbs_slot;
+
+        /* The slot is copied into the sort, the key may point into htup */
+        ExecClearTuple(slot);
+        slot->tts_values[0] = heap_getattr(htup, buildstate->cbtbs_sortattr,
+                                           RelationGetDescr(buildstate->heap),
+                                           &slot->tts_isnull[0]);
+        slot->tts_values[1] = PointerGetDatum(&htup->t_self);
+        slot->tts_isnull[1] = false;
+        ExecStoreVirtualTuple(slot);
+        tuplesort_puttupleslot(buildstate->cbtbs_sort, slot);
+        return;
+    }
 
     oldcontext = MemoryContextSwitchTo(buildstate->context);
 
-    itup = palloc(sizeof(CBTTupleData));
-    CBTFormTuple(&htup->t_self, itup, 1);
-    cbt_build_add_tuple(buildstate, buildstate->leaf_pagestate, itup);
+    CBTFormTuple(&htup->t_self, &itup, 1);
+    cbt_build_add_tuple(buildstate, buildstate->leaf_pagestate, &itup);
+
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Set up the sort for a build with build_order. Each heap tuple goes into
+ * the sort as its sort key and its TID, and the TID also breaks ties, so
+ * tuples with equal keys keep their heap order. NULL keys go last, or first
+ * in descending order, as with ORDER BY.
+ */
+static void
+cbt_begin_sort(CBTBuildState *buildstate, const char *order)
+{
+    Relation    heap = buildstate->heap;
+    char       *colname;
+    bool        desc;
+    AttrNumber  attnum;
+    Form_pg_attribute attr;
+    Oid         ltOpr;
+    Oid         gtOpr;
+    TupleDesc   tupdesc;
+    AttrNumber  attNums[2] = {1, 2};
+    Oid         sortOperators[2];
+    Oid         sortCollations[2];
+    bool        nullsFirstFlags[2];
+
+    if (!cbt_parse_build_order(order, &colname, &desc))
+        elog(ERROR, "invalid value for \"build_order\" option: \"%s\"", order);
+
+    attnum = get_attnum(RelationGetRelid(heap), colname);
+    if (attnum == InvalidAttrNumber || attnum < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_COLUMN),
+                 errmsg("column \"%s\" of relation \"%s\" does not exist",
+                        colname, RelationGetRelationName(heap)),
+                 errhint("The \"build_order\" option names a column of the indexed table.")));
+    attr = RelationGetDescr(heap)->attrs[attnum - 1];
+
+    /* Complains if the type has no ordering */
+    get_sort_group_operators(attr->atttypid, !desc, false, desc,
+                             &ltOpr, NULL, &gtOpr, NULL);
+
+    tupdesc = CreateTemplateTupleDesc(2, false);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 1, "key",
+                       attr->atttypid, attr->atttypmod, 0);
+    TupleDescInitEntryCollation(tupdesc, (AttrNumber) 1, attr->attcollation);
+    TupleDescInitEntry(tupdesc, (AttrNumber) 2, "tid", TIDOID, -1, 0);
+
+    sortOperators[0] = desc ? gtOpr : ltOpr;
+    sortCollations[0] = attr->attcollation;
+    nullsFirstFlags[0] = desc;
+    sortOperators[1] = TIDLessOperator;
+    sortCollations[1] = InvalidOid;
+    nullsFirstFlags[1] = false;
+
+    buildstate->cbtbs_sortattr = attnum;
+    buildstate->cbtbs_slot = MakeSingleTupleTableSlot(tupdesc);
+    buildstate->cbtbs_sort = tuplesort_begin_heap(tupdesc, 2, attNums,
+                                                  sortOperators, sortCollations,
+                                                  nullsFirstFlags,
+                                                  maintenance_work_mem, false);
+}
+
+/*
+ * Sort the heap tuples and add them to the tree in sorted order.
+ */
+static void
+cbt_load_sorted(CBTBuildState *buildstate)
+{
+    TupleTableSlot *slot = buildstate->cbtbs_slot;
+    MemoryContext oldcontext;
+    CBTTupleData  itup;
+
+    tuplesort_performsort(buildstate->cbtbs_sort);
+
+    oldcontext = MemoryContextSwitchTo(buildstate->context);
+    while (tuplesort_gettupleslot(buildstate->cbtbs_sort, true, false, slot, NULL))
+    {
+        bool        isnull;
+        ItemPointer tid;
+
+        CHECK_FOR_INTERRUPTS();
+
+        tid = (ItemPointer) DatumGetPointer(slot_getattr(slot, 2, &isnull));
+        CBTFormTuple(tid, &itup, 1);
+        cbt_build_add_tuple(buildstate, buildstate->leaf_pagestate, &itup);
+    }
+    MemoryContextSwitchTo(oldcontext);
+
+    tuplesort_end(buildstate->cbtbs_sort);
+    ExecDropSingleTupleTableSlot(slot);
+    buildstate->cbtbs_sort = NULL;
+}
+
+/*
+ * How many workers to build with. A build sorted by build_order, of a
+ * temporary table, or with index expressions or a predicate, which the
+ * workers would have to evaluate, is done by this backend alone, and so
+ * is one of a table too small to share out.
+ */
+static int
+cbt_parallel_workers(Relation heap, IndexInfo *indexInfo, const char *order)
+{
+    BlockNumber nblocks;
+
+    if (cbt_parallel_build_workers == 0 || order != NULL ||
+        !IsUnderPostmaster || IsInParallelMode() ||
+        RelationUsesLocalBuffers(heap) || indexInfo->ii_Concurrent ||
+        indexInfo->ii_Expressions != NIL || indexInfo->ii_Predicate != NIL)
+        return 0;
+
+    nblocks = RelationGetNumberOfBlocks(heap);
+    return (int) Min((BlockNumber) cbt_parallel_build_workers,
+                     nblocks / CBT_PARALLEL_MIN_BLOCKS);
+}
+
+/*
+ * Build the index with nworkers parallel workers. The heap is cut into as
+ * many ranges of blocks, and each worker scans one and fills leaves from
+ * it in heap order. It spools them, and sends this backend the number of
+ * items of each. A range whose worker didn't start is scanned here once
+ * the others are done.
+ *
+ * Once all leaves are counted, their blocks are known: the leaves of the
+ * ranges follow each other in range order from block 1 on, and the upper
+ * levels follow the leaves, one level after the other, each packed as a
+ * serial build packs it. This backend extends the index to its final size
+ * and lets the workers go on; each writes and WAL-logs its own leaves in
+ * place, with the sibling links and parent hints that layout gives them.
+ * Meanwhile the upper levels are built here from the counts. Returns the
+ * number of heap tuples scanned.
+ */
+static double
+cbt_parallel_build(CBTBuildState *buildstate, IndexInfo *indexInfo, int nworkers)
+{
+    Relation        heap = buildstate->heap;
+    Relation        index = buildstate->index;
+    BlockNumber     nblocks = RelationGetNumberOfBlocks(heap);
+    ParallelContext *pcxt;
+    CBTParallelShared *shared;
+    Size            sharedsize;
+    char            *queues;
+    shm_mq_handle   **mqh;
+    CBTLeafRun      *runs;
+    bool            *mine;
+    BlockNumber     nleaves;
+    int             maxitems;
+    BlockNumber     root;
+    uint32          level;
+    MemoryContext   oldcontext;
+    double          reltuples = 0;
+    int             i;
+
+    EnterParallelMode();
+    pcxt = CreateParallelContext("cbtree", "cbt_parallel_build_main", nworkers);
+
+    sharedsize = add_size(offsetof(CBTParallelShared, ranges),
+                          mul_size(nworkers, sizeof(CBTParallelRange)));
+    shm_toc_estimate_chunk(&pcxt->estimator, sharedsize);
+    shm_toc_estimate_chunk(&pcxt->estimator,
+                           mul_size(nworkers, CBT_PARALLEL_QUEUE_SIZE));
+    shm_toc_estimate_keys(&pcxt->estimator, 2);
+    InitializeParallelDSM(pcxt);
+
+    shared = (CBTParallelShared *) shm_toc_allocate(pcxt->toc, sharedsize);
+    shared->heaprelid = RelationGetRelid(heap);
+    shared->indexrelid = RelationGetRelid(index);
+    shared->nranges = nworkers;
+    maxitems = CBT_INTERNAL_CAPACITY * CBTGetNonLeafFillFactor(index) / 100;
+    shared->maxitems = maxitems;
+    ConditionVariableInit(&shared->placedcv);
+    SpinLockInit(&shared->mutex);
+    shared->placed = false;
+    shared->nleaves = 0;
+    shared->reltuples = 0;
+    shared->brokenhotchain = false;
+    for (i = 0; i < nworkers; i++)
+    {
+        BlockNumber start = (BlockNumber) ((uint64) nblocks * i / nworkers);
+        BlockNumber end = (BlockNumber) ((uint64) nblocks * (i + 1) / nworkers);
+
+        shared->ranges[i].start = start;
+        shared->ranges[i].nblocks = end - start;
+        shared->ranges[i].scanned = false;
+        shared->ranges[i].firstleaf = 0;
+    }
+    shm_toc_insert(pcxt->toc, CBT_PARALLEL_KEY_SHARED, shared);
+
+    queues = shm_toc_allocate(pcxt->toc, mul_size(nworkers, CBT_PARALLEL_QUEUE_SIZE));
+    for (i = 0; i < nworkers; i++)
+    {
+        shm_mq     *mq;
+
+        mq = shm_mq_create(queues + (Size) i * CBT_PARALLEL_QUEUE_SIZE,
+                           CBT_PARALLEL_QUEUE_SIZE);
+        shm_mq_set_receiver(mq, MyProc);
+    }
+    shm_toc_insert(pcxt->toc, CBT_PARALLEL_KEY_QUEUES, queues);
+
+    LaunchParallelWorkers(pcxt);
+
+    oldcontext = MemoryContextSwitchTo(buildstate->context);
+    runs = (CBTLeafRun *) palloc0(nworkers * sizeof(CBTLeafRun));
+    mine = (bool *) palloc0(nworkers * sizeof(bool));
+    mqh = (shm_mq_handle **) palloc0(nworkers * sizeof(shm_mq_handle *));
+    for (i = 0; i < pcxt->nworkers_launched; i++)
+        mqh[i] = shm_mq_attach((shm_mq *) (queues + (Size) i * CBT_PARALLEL_QUEUE_SIZE),
+                               pcxt->seg, pcxt->worker[i].bgwhandle);
+
+    cbt_parallel_receive(mqh, runs, pcxt->nworkers_launched);
+
+    /*
+     * Every worker that started has counted its leaves and waits for them
+     * to be placed. One that failed has reported its error by now. A worker
+     * that was launched but didn't start sent nothing, and its range is
+     * filled here.
+     */
+    for (i = 0; i < nworkers; i++)
+    {
+        CBTLeafSpool spool;
+
+        if (shared->ranges[i].scanned)
+            continue;
+        if (runs[i].nleaves > 0)
+            elog(ERROR, "parallel cbtree build worker %d exited without finishing", i);
+
+        runs[i].leaves = BufFileCreateTemp(false);
+        spool.mqh = NULL;
+        spool.run = &runs[i];
+        reltuples += cbt_spool_range(&spool, heap, index, indexInfo, &shared->ranges[i]);
+        mine[i] = true;
+    }
+
+    nleaves = cbt_parallel_place(index, shared, runs);
+    buildstate->cbtbs_pages_written = RelationGetNumberOfBlocks(index);
+
+    /* Write the leaves this backend filled, and the levels above */
+    for (i = 0; i < nworkers; i++)
+    {
+        if (mine[i])
+            cbt_write_run(index, &runs[i], shared->ranges[i].firstleaf,
+                          nleaves, maxitems);
+    }
+    root = cbt_build_upper_levels(buildstate, runs, nworkers, nleaves, maxitems,
+                                  &level);
+
+    WaitForParallelWorkersToFinish(pcxt);
+
+    reltuples += shared->reltuples;
+    if (shared->brokenhotchain)
+        indexInfo->ii_BrokenHotChain = true;
+
+    DestroyParallelContext(pcxt);
+    ExitParallelMode();
+
+    buildstate->cbtbs_nleaves = nleaves;
+    cbt_finish_build(buildstate, root, level);
 
     MemoryContextSwitchTo(oldcontext);
+
+    return reltuples;
+}
+
+/*
+ * Take the leaf counts the workers send until all of them have detached
+ * from their queues, adding each to the run of its worker.
+ */
+static void
+cbt_parallel_receive(shm_mq_handle **mqh, CBTLeafRun *runs, int nqueues)
+{
+    bool       *detached = (bool *) palloc0(Max(nqueues, 1) * sizeof(bool));
+    int         nactive = nqueues;
+
+    while (nactive > 0)
+    {
+        bool        received = false;
+        int         i;
+
+        CHECK_FOR_INTERRUPTS();
+
+        for (i = 0; i < nqueues; i++)
+        {
+            while (!detached[i])
+            {
+                shm_mq_result res;
+                Size        nbytes;
+                void       *data;
+
+                res = shm_mq_receive(mqh[i], &nbytes, &data, true);
+                if (res == SHM_MQ_WOULD_BLOCK)
+                    break;
+                if (res == SHM_MQ_DETACHED)
+                {
+                    detached[i] = true;
+                    nactive--;
+                    break;
+                }
+                if (nbytes != sizeof(uint32))
+                    elog(ERROR, "unexpected message of %zu bytes from parallel cbtree build worker",
+                         nbytes);
+
+                cbt_run_add_count(&runs[i], *(uint32 *) data);
+                received = true;
+            }
+        }
+
+        if (nactive > 0 && !received)
+        {
+            WaitLatch(MyLatch, WL_LATCH_SET | WL_POSTMASTER_DEATH, -1L,
+                      PG_WAIT_EXTENSION);
+            ResetLatch(MyLatch);
+        }
+    }
+
+    pfree(detached);
+}
+
+/*
+ * Give the leaves of every range their blocks, extend the index to hold
+ * all of its pages, and let the workers write their leaves. Leaf n of the
+ * index goes to block n + 1, after the meta page. Returns the number of
+ * leaves.
+ */
+static BlockNumber
+cbt_parallel_place(Relation index, CBTParallelShared *shared, CBTLeafRun *runs)
+{
+    BlockNumber nleaves = 0;
+    BlockNumber npages;
+    BlockNumber n;
+    int         i;
+
+    for (i = 0; i < shared->nranges; i++)
+    {
+        shared->ranges[i].firstleaf = nleaves;
+        nleaves += runs[i].nleaves;
+    }
+
+    /* The meta page, the leaves and the upper levels, see cbt_build_upper_levels */
+    npages = 1 + nleaves;
+    n = nleaves;
+    while (n > 1)
+    {
+        n = (n + shared->maxitems - 1) / shared->maxitems;
+        npages += n;
+    }
+
+    /*
+     * Only this backend extends the index, to its final size at once, so
+     * the workers just overwrite blocks that exist. The blocks in between
+     * are left as holes until they are written.
+     */
+    if (npages > 1)
+    {
+        char       *zero = (char *) palloc0(BLCKSZ);
+
+        RelationOpenSmgr(index);
+        smgrextend(index->rd_smgr, MAIN_FORKNUM, npages - 1, zero, true);
+        pfree(zero);
+    }
+
+    SpinLockAcquire(&shared->mutex);
+    shared->nleaves = nleaves;
+    shared->placed = true;
+    SpinLockRelease(&shared->mutex);
+    ConditionVariableBroadcast(&shared->placedcv);
+
+    return nleaves;
+}
+
+/*
+ * Entry point of a parallel build worker: fill leaves from its range of
+ * heap blocks and send their counts to the leader, then wait for them to
+ * be placed and write them out.
+ */
+void
+cbt_parallel_build_main(dsm_segment *seg, shm_toc *toc)
+{
+    CBTParallelShared *shared;
+    CBTParallelRange *range;
+    shm_mq     *mq;
+    Relation    heap;
+    Relation    index;
+    IndexInfo  *indexInfo;
+    CBTLeafSpool spool;
+    CBTLeafRun  run;
+    double      reltuples;
+    bool        placed;
+
+    shared = (CBTParallelShared *) shm_toc_lookup(toc, CBT_PARALLEL_KEY_SHARED, false);
+    range = &shared->ranges[ParallelWorkerNumber];
+
+    mq = (shm_mq *) ((char *) shm_toc_lookup(toc, CBT_PARALLEL_KEY_QUEUES, false) +
+                     (Size) ParallelWorkerNumber * CBT_PARALLEL_QUEUE_SIZE);
+    shm_mq_set_sender(mq, MyProc);
+
+    /* The leader's locks are shared with its workers */
+    heap = heap_open(shared->heaprelid, ShareLock);
+    index = index_open(shared->indexrelid, RowExclusiveLock);
+    indexInfo = BuildIndexInfo(index);
+
+    memset(&run, 0, sizeof(run));
+    run.leaves = BufFileCreateTemp(false);
+    spool.mqh = shm_mq_attach(mq, seg, NULL);
+    spool.run = &run;
+    reltuples = cbt_spool_range(&spool, heap, index, indexInfo, range);
+
+    SpinLockAcquire(&shared->mutex);
+    shared->reltuples += reltuples;
+    if (indexInfo->ii_BrokenHotChain)
+        shared->brokenhotchain = true;
+    range->scanned = true;
+    SpinLockRelease(&shared->mutex);
+
+    /* The leader takes the detach as the end of the counts */
+    shm_mq_detach(spool.mqh);
+
+    ConditionVariablePrepareToSleep(&shared->placedcv);
+    for (;;)
+    {
+        SpinLockAcquire(&shared->mutex);
+        placed = shared->placed;
+        SpinLockRelease(&shared->mutex);
+        if (placed)
+            break;
+        ConditionVariableSleep(&shared->placedcv, PG_WAIT_EXTENSION);
+    }
+    ConditionVariableCancelSleep();
+
+    cbt_write_run(index, &run, range->firstleaf, shared->nleaves, shared->maxitems);
+
+    index_close(index, RowExclusiveLock);
+    heap_close(heap, ShareLock);
+}
+
+/*
+ * Fill leaves from the heap blocks of range and pass them on, see
+ * cbt_spool_emit. Returns the number of heap tuples scanned.
+ */
+static double
+cbt_spool_range(CBTLeafSpool *spool, Relation heap, Relation index,
+                IndexInfo *indexInfo, CBTParallelRange *range)
+{
+    double      reltuples;
+
+    if (range->nblocks == 0)
+        return 0;
+
+    spool->page = (Page) palloc(BLCKSZ);
+    cbt_newpage(spool->page, CBT_LEAF_LEVEL);
+    spool->maxfill = (Size) CBTGetTargetPageFreeSpace(index);
+
+    reltuples = IndexBuildHeapRangeScan(heap, index, indexInfo, false, false,
+                                        range->start, range->nblocks,
+                                        cbt_spool_callback, (void *) spool);
+    cbt_spool_emit(spool);
+
+    pfree(spool->page);
+    return reltuples;
+}
+
+/*
+ * Add a heap tuple to the leaf being filled, passing the leaf on first if
+ * it is full.
+ */
+static void
+cbt_spool_callback(Relation index,
+                   HeapTuple htup,
+                   Datum *values,
+                   bool *isnull,
+                   bool tupleIsAlive,
+                   void *state)
+{
+    CBTLeafSpool *spool = (CBTLeafSpool *) state;
+    CBTTupleData itup;
+
+    CBTFormTuple(&htup->t_self, &itup, 1);
+    if (cbt_leaf_full(spool->page, &itup, spool->maxfill))
+        cbt_spool_emit(spool);
+
+    if (!cbt_page_additem(spool->page,
+                          OffsetNumberNext(CBTPageGetNItems(spool->page)), &itup))
+        elog(ERROR, "failed to add item to the index page");
+}
+
+/*
+ * Spool the leaf being filled, if it has any items, pass its count on and
+ * start a new one.
+ */
+static void
+cbt_spool_emit(CBTLeafSpool *spool)
+{
+    uint32      nitems = CBTPageGetNItems(spool->page);
+
+    if (nitems == 0)
+        return;
+
+    if (BufFileWrite(spool->run->leaves, (void *) spool->page, BLCKSZ) != BLCKSZ)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not write to temporary file: %m")));
+
+    if (spool->mqh != NULL)
+    {
+        spool->run->nleaves++;
+        if (shm_mq_send(spool->mqh, sizeof(uint32), &nitems, false) != SHM_MQ_SUCCESS)
+            ereport(ERROR,
+                    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                     errmsg("parallel cbtree build leader has exited")));
+    }
+    else
+        cbt_run_add_count(spool->run, nitems);
+
+    cbt_newpage(spool->page, CBT_LEAF_LEVEL);
+}
+
+/*
+ * Count a leaf of run, with nitems items, in the leader.
+ */
+static void
+cbt_run_add_count(CBTLeafRun *run, uint32 nitems)
+{
+    if (run->nleaves >= run->maxleaves)
+    {
+        run->maxleaves = Max(run->maxleaves * 2, 64);
+        if (run->counts == NULL)
+            run->counts = (uint32 *) palloc(run->maxleaves * sizeof(uint32));
+        else
+            run->counts = (uint32 *) repalloc(run->counts,
+                                              run->maxleaves * sizeof(uint32));
+    }
+    run->counts[run->nleaves++] = nitems;
+}
+
+/*
+ * Write out the spooled leaves of run, the first of which is leaf firstleaf
+ * of the nleaves of the index, into their blocks. The leaves follow each
+ * other, so the links of each are the blocks around it, and its parent
+ * hint names the slot of the first upper level it gets, as
+ * cbt_build_upper_levels packs maxitems downlinks a page. The blocks exist
+ * already, see cbt_parallel_place.
+ */
+static void
+cbt_write_run(Relation index, CBTLeafRun *run, BlockNumber firstleaf,
+              BlockNumber nleaves, int maxitems)
+{
+    Page        page;
+    bool        use_wal = XLogIsNeeded() && RelationNeedsWAL(index);
+    BlockNumber n;
+
+    if (run->nleaves == 0)
+        return;
+
+    if (BufFileSeek(run->leaves, 0, 0, SEEK_SET) != 0)
+        ereport(ERROR,
+                (errcode_for_file_access(),
+                 errmsg("could not rewind temporary file: %m")));
+
+    page = (Page) palloc(BLCKSZ);
+    for (n = firstleaf; n < firstleaf + run->nleaves; n++)
+    {
+        CBTPageOpaque opaque;
+        BlockNumber blkno = n + 1;
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (BufFileRead(run->leaves, page, BLCKSZ) != BLCKSZ)
+            ereport(ERROR,
+                    (errcode_for_file_access(),
+                     errmsg("could not read from temporary file: %m")));
+
+        opaque = CBTPageGetOpaque(page);
+        opaque->cbto_prev = (n > 0) ? blkno - 1 : InvalidBlockNumber;
+        opaque->cbto_next = (n + 1 < nleaves) ? blkno + 1 : InvalidBlockNumber;
+        if (nleaves == 1)
+            opaque->cbto_flags |= CBT_ROOT;
+        else
+            ItemPointerSet(&opaque->cbto_parent, nleaves + 1 + n / maxitems,
+                           (OffsetNumber) (n % maxitems + P_FIRSTOFFSET));
+
+        /* We use the heap NEWPAGE record type for this */
+        if (use_wal)
+            log_newpage(&index->rd_node, MAIN_FORKNUM, blkno, page, true);
+
+        PageSetChecksumInplace(page, blkno);
+
+        /* The leader syncs the index once all pages are written */
+        RelationOpenSmgr(index);
+        smgrwrite(index->rd_smgr, MAIN_FORKNUM, blkno, (char *) page, true);
+    }
+
+    pfree(page);
+    BufFileClose(run->leaves);
+    run->leaves = NULL;
+}
+
+/*
+ * Build the levels above the nleaves leaves of a parallel build from their
+ * counts, which the runs hold in order. Each level follows the one below:
+ * its pages take maxitems downlinks each, as in a serial build, and page j
+ * of a level has its parent at slot j % maxitems of page j / maxitems of
+ * the next level. The last level has a single page, the root. Returns the
+ * root and sets *level to its level, or returns InvalidBlockNumber with
+ * *level 0 if there are no leaves.
+ */
+static BlockNumber
+cbt_build_upper_levels(CBTBuildState *buildstate, CBTLeafRun *runs, int nruns,
+                       BlockNumber nleaves, int maxitems, uint32 *level)
+{
+    Page        page = (Page) palloc(BLCKSZ);
+    uint32     *counts;
+    BlockNumber nchildren = nleaves;
+    BlockNumber childbase = 1;
+    BlockNumber n = 0;
+    int         i;
+
+    counts = (uint32 *) palloc(Max(nleaves, 1) * sizeof(uint32));
+    for (i = 0; i < nruns; i++)
+    {
+        if (runs[i].nleaves == 0)
+            continue;
+        memcpy(counts + n, runs[i].counts, runs[i].nleaves * sizeof(uint32));
+        n += runs[i].nleaves;
+    }
+    for (n = 0; n < nleaves; n++)
+        buildstate->indtuples += counts[n];
+
+    *level = (nleaves > 0) ? CBT_LEAF_LEVEL : 0;
+    while (nchildren > 1)
+    {
+        BlockNumber npages = (nchildren + maxitems - 1) / maxitems;
+        BlockNumber base = childbase + nchildren;
+        uint32     *totals = (uint32 *) palloc0(npages * sizeof(uint32));
+        BlockNumber j;
+
+        (*level)++;
+        for (j = 0; j < npages; j++)
+        {
+            CBTPageOpaque opaque;
+            BlockNumber first = j * maxitems;
+            BlockNumber last = Min(first + maxitems, nchildren);
+
+            CHECK_FOR_INTERRUPTS();
+
+            cbt_newpage(page, *level);
+            for (n = first; n < last; n++)
+            {
+                ItemPointerData self_itemptr;
+                CBTTupleData    parenttuple;
+
+                ItemPointerSet(&self_itemptr, childbase + n, P_FIRSTOFFSET);
+                CBTFormTuple(&self_itemptr, &parenttuple, counts[n]);
+                if (!cbt_page_additem(page, (OffsetNumber) (n - first + P_FIRSTOFFSET),
+                                      &parenttuple))
+                    elog(ERROR, "failed to add item to the index page");
+                totals[j] += counts[n];
+            }
+
+            opaque = CBTPageGetOpaque(page);
+            opaque->cbto_prev = (j > 0) ? base + j - 1 : InvalidBlockNumber;
+            opaque->cbto_next = (j + 1 < npages) ? base + j + 1 : InvalidBlockNumber;
+            if (npages == 1)
+                opaque->cbto_flags |= CBT_ROOT;
+            else
+                ItemPointerSet(&opaque->cbto_parent, base + npages + j / maxitems,
+                               (OffsetNumber) (j % maxitems + P_FIRSTOFFSET));
+            cbt_writepage(buildstate, page, base + j);
+        }
+
+        pfree(counts);
+        counts = totals;
+        childbase = base;
+        nchildren = npages;
+    }
+
+    pfree(counts);
+    pfree(page);
+
+    return (nleaves > 0) ? childbase : InvalidBlockNumber;
 }
 
 /*
@@ -138,9 +988,8 @@ cbt_finish_upper_level(CBTBuildState *buildstate)
     uint32      rootblkno = InvalidBlockNumber;
     CBTPageState *pagestate;
     CBTPageState *opagestate;
-    Page        metapage;
     CBTPageOpaque rootopaque;
-    CBTTuple    parenttuple;
+    CBTTupleData parenttuple;
     ItemPointerData self_itemptr;
 
     pagestate = buildstate->leaf_pagestate;
@@ -155,28 +1004,49 @@ cbt_finish_upper_level(CBTBuildState *buildstate)
         }
         else
         {
-            parenttuple = palloc(sizeof(CBTTupleData));
             ItemPointerSet(&self_itemptr, pagestate->cbtps_blockno, P_FIRSTOFFSET);
-            CBTFormTuple(&self_itemptr, parenttuple, pagestate->total_count);
-            cbt_build_add_tuple(buildstate, pagestate->cbtps_parent, parenttuple);
+            CBTFormTuple(&self_itemptr, &parenttuple, pagestate->total_count);
+            cbt_build_add_tuple(buildstate, pagestate->cbtps_parent, &parenttuple);
+            ItemPointerSet(&CBTPageGetOpaque(pagestate->cbtps_page)->cbto_parent,
+                           pagestate->cbtps_parent->cbtps_blockno,
+                           pagestate->cbtps_parent->cbtps_lastoff);
         }
         cbt_writepage(buildstate, pagestate->cbtps_page, pagestate->cbtps_blockno);
         rootblkno = pagestate->cbtps_blockno;
         opagestate = pagestate;
         pagestate = pagestate->cbtps_parent;
+        pfree(opagestate->cbtps_page);
         pfree(opagestate);
     }
 
+    cbt_finish_build(buildstate, rootblkno, level);
+}
+
+/*
+ * Write the meta page of a new tree with its root on level, and everything
+ * still batched, and sync the index.
+ */
+static void
+cbt_finish_build(CBTBuildState *buildstate, BlockNumber root, uint32 level)
+{
+    Page        metapage;
+
 	metapage = (Page) palloc(BLCKSZ);
-    CBTFillMetaPage(metapage, rootblkno, level);
+    CBTFillMetaPage(metapage, root, level, buildstate->cbtbs_nleaves);
+    cbt_writepage(buildstate, metapage, CBT_METAPAGE);
+    pfree(metapage);
+    cbt_flush_batch(buildstate);
 
     /*
-	 * Write the page and log it.
-	 */
-    smgrwrite(buildstate->index->rd_smgr, MAIN_FORKNUM, CBT_METAPAGE,
-              (char *) metapage, true);
-    log_newpage(&(buildstate->index->rd_smgr->smgr_rnode.node), INIT_FORKNUM,
-                CBT_METAPAGE, metapage, false);
+     * The pages were written without going through shared buffers, and
+     * without asking smgr for an fsync, so sync the index before the build
+     * commits. An unlogged index is reset after a crash anyway.
+     */
+    if (RelationNeedsWAL(buildstate->index))
+    {
+        RelationOpenSmgr(buildstate->index);
+        smgrimmedsync(buildstate->index->rd_smgr, MAIN_FORKNUM);
+    }
 }
 
 /*
@@ -186,139 +1056,206 @@ void
 cbt_build_add_tuple(CBTBuildState *state, CBTPageState *pagestate, CBTTuple newtuple)
 {
     Page            page;
-    Size            tuplesz;
-    Size            pgspace;
+    bool            full;
 
     if (pagestate == NULL)
     {
         state->leaf_pagestate = palloc(sizeof(CBTPageState));
         state->leaf_pagestate->cbtps_parent = NULL;
+        state->leaf_pagestate->cbtps_page = NULL;
         cbt_init_pagestate(state->leaf_pagestate, state, CBT_LEAF_LEVEL);
         pagestate = state->leaf_pagestate;
     }
 
     page = pagestate->cbtps_page;
-    tuplesz = MAXALIGN(sizeof(CBTTupleData));
-    pgspace = PageGetFreeSpace(page);
-
-
-    if (pgspace < tuplesz || (pgspace < pagestate->cbtps_maxfill && pagestate->cbtps_lastoff > 1))
-    {
-        /*
-         * Page is already full. Write the page to disk, conenct it to
-         * its parent, and request a new page.
-         */
+    if (pagestate->cbtps_level == CBT_LEAF_LEVEL)
+        full = cbt_leaf_full(page, newtuple, pagestate->cbtps_maxfill);
+    else
+        full = (pagestate->cbtps_lastoff >= pagestate->cbtps_maxitems);
 
-        Page		    opage = page;
-        Page            npage;
-        CBTPageState    *opagestate = pagestate;
-        CBTPageOpaque   opaque = (CBTPageOpaque )PageGetSpecialPointer(page);
-        BlockNumber     oblkno = pagestate->cbtps_blockno;
-        ItemPointerData self_itemptr;
-        CBTTuple        parenttuple;
-        BlockNumber     nblkno;
+    if (full)
+        cbt_build_next_page(state, pagestate);
 
-        /*
-		 * Link the old page into its parent, using its minimum key. If we
-		 * don't have a parent, we have to create one; this adds a new btree
-		 * level.
-		 */
-        if (opagestate->cbtps_parent == NULL)
-        {
-            opagestate->cbtps_parent = palloc(sizeof(CBTPageState));
-            cbt_init_pagestate(opagestate->cbtps_parent, state, opagestate->cbtps_level + 1);
-        }
+    pagestate->cbtps_lastoff = OffsetNumberNext(pagestate->cbtps_lastoff);
+    if (!cbt_page_additem(pagestate->cbtps_page, pagestate->cbtps_lastoff, newtuple))
+        elog(ERROR, "failed to add item to the index page");
 
-        parenttuple = palloc(sizeof(CBTTupleData));
-        ItemPointerSet(&self_itemptr, oblkno, P_FIRSTOFFSET);
-        CBTFormTuple(&self_itemptr, parenttuple, opagestate->total_count);
-        cbt_build_add_tuple(state, opagestate->cbtps_parent, parenttuple);
-        ItemPointerSet(&opaque->cbto_parent, opagestate->cbtps_parent->cbtps_blockno, opagestate->cbtps_parent->cbtps_lastoff);
+    if (pagestate->cbtps_level == CBT_LEAF_LEVEL)
+        state->indtuples++;
+    pagestate->total_count += newtuple->childcnt;
+}
 
-        /* Create new page of same level and update pagestate at this level*/
-        cbt_init_pagestate(pagestate, state, pagestate->cbtps_level);
-        npage = pagestate->cbtps_page;
+/*
+ * The page of pagestate is full. Write the page to disk, conenct it to
+ * its parent, and start the next page in the same workspace.
+ */
+static void
+cbt_build_next_page(CBTBuildState *state, CBTPageState *pagestate)
+{
+    Page            page = pagestate->cbtps_page;
+    CBTPageOpaque   opaque = (CBTPageOpaque )PageGetSpecialPointer(page);
+    BlockNumber     oblkno = pagestate->cbtps_blockno;
+    ItemPointerData self_itemptr;
+    CBTTupleData    parenttuple;
+    BlockNumber     nblkno;
 
-        /* and assign it a page position */
-        nblkno = pagestate->cbtps_blockno;
-        CBTPageOpaque oopaque = (CBTPageOpaque) PageGetSpecialPointer(opage);
-        CBTPageOpaque nopaque = (CBTPageOpaque) PageGetSpecialPointer(npage);
+    /*
+     * Link the old page into its parent, using its minimum key. If we
+     * don't have a parent, we have to create one; this adds a new btree
+     * level.
+     */
+    if (pagestate->cbtps_parent == NULL)
+    {
+        pagestate->cbtps_parent = palloc(sizeof(CBTPageState));
+        pagestate->cbtps_parent->cbtps_page = NULL;
+        cbt_init_pagestate(pagestate->cbtps_parent, state, pagestate->cbtps_level + 1);
+    }
 
-        oopaque->cbto_next = nblkno;
-        nopaque->cbto_prev = oblkno;
-        nopaque->cbto_next = InvalidBlockNumber;	/* redundant */
+    ItemPointerSet(&self_itemptr, oblkno, P_FIRSTOFFSET);
+    CBTFormTuple(&self_itemptr, &parenttuple, pagestate->total_count);
+    cbt_build_add_tuple(state, pagestate->cbtps_parent, &parenttuple);
+    ItemPointerSet(&opaque->cbto_parent, pagestate->cbtps_parent->cbtps_blockno, pagestate->cbtps_parent->cbtps_lastoff);
 
-        /*
-         * Write out the old page.  We never need to touch it again, so we can
-         * free the opage workspace too.
-         */
-        cbt_writepage(state, opage, oblkno);
-    }
+    /*
+     * The next page of the level gets the next block, as the parent has
+     * its block already. Write out the old page; it is copied into the
+     * write batch, so the workspace can be set up for the new page.
+     */
+    nblkno = state->cbtbs_pages_alloced + 1;
+    opaque->cbto_next = nblkno;
+    cbt_writepage(state, page, oblkno);
 
-    pagestate->cbtps_lastoff = OffsetNumberNext(pagestate->cbtps_lastoff);
-    if (PageAddItem(pagestate->cbtps_page, (Item) newtuple, tuplesz, pagestate->cbtps_lastoff, false, false)
-            == InvalidOffsetNumber)
-        elog(ERROR, "failed to add item to the index page");
+    cbt_init_pagestate(pagestate, state, pagestate->cbtps_level);
+    Assert(pagestate->cbtps_blockno == nblkno);
+    CBTPageGetOpaque(pagestate->cbtps_page)->cbto_prev = oblkno;
+}
 
-    state->indtuples++;
-    pagestate->total_count += newtuple->childcnt;
+/*
+ * Does a leaf being built have to be written out before newtuple is added?
+ * It does once it is out of room, or filled past the fillfactor with more
+ * than one item.
+ */
+static bool
+cbt_leaf_full(Page page, CBTTuple newtuple, Size maxfill)
+{
+    return !cbt_page_hasroom(page, newtuple) ||
+        (CBTPageGetFreeSpace(page) < maxfill && CBTPageGetNItems(page) > 1);
 }
 
 /*
- * Write a page of counted B tree to disk.
+ * Queue a page of counted B tree to be written to disk. The page is copied
+ * into the write batch, which is flushed when it is full.
  */
 void
 cbt_writepage(CBTBuildState *buildstate, Page page, BlockNumber blkno)
 {
+    int         n = buildstate->cbtbs_nbatch;
+
+    memcpy(buildstate->cbtbs_batch + (Size) n * BLCKSZ, page, BLCKSZ);
+    buildstate->cbtbs_batch_blknos[n] = blkno;
+    if (++buildstate->cbtbs_nbatch == CBT_BUILD_BATCH_PAGES)
+        cbt_flush_batch(buildstate);
+}
+
+/*
+ * Write out the batched pages in block order. Pages of one level get
+ * consecutive blocks unless a parent was started in between, so the batch
+ * is mostly one run that extends the file. The pages are WAL-logged
+ * together before any of them is written; each still gets its own
+ * full-page record, as the replay of XLOG_FPI in this server version only
+ * restores the first block of a record.
+ */
+static void
+cbt_flush_batch(CBTBuildState *buildstate)
+{
+    struct
+    {
+        BlockNumber blkno;
+        int         slot;
+    }           order[CBT_BUILD_BATCH_PAGES];
+    int         n = buildstate->cbtbs_nbatch;
+    int         i;
+
+    if (n == 0)
+        return;
+
+    for (i = 0; i < n; i++)
+    {
+        order[i].blkno = buildstate->cbtbs_batch_blknos[i];
+        order[i].slot = i;
+    }
+    qsort(order, n, sizeof(order[0]), cbt_blkno_cmp);
+
     /* Ensure rd_smgr is open (could have been closed by relcache flush!) */
     RelationOpenSmgr(buildstate->index);
 
     /* XLOG stuff */
     if (buildstate->cbtbs_use_wal)
     {
-        /* We use the heap NEWPAGE record type for this */
-        log_newpage(&buildstate->index->rd_node, MAIN_FORKNUM, blkno, page, true);
+        for (i = 0; i < n; i++)
+        {
+            /* We use the heap NEWPAGE record type for this */
+            log_newpage(&buildstate->index->rd_node, MAIN_FORKNUM, order[i].blkno,
+                        (Page) (buildstate->cbtbs_batch + (Size) order[i].slot * BLCKSZ),
+                        true);
+        }
     }
 
-    /*
-     * If we have to write pages nonsequentially, fill in the space with
-     * zeroes until we come back and overwrite.  This is not logically
-     * necessary on standard Unix filesystems (unwritten space will read as
-     * zeroes anyway), but it should help to avoid fragmentation. The dummy
-     * pages aren't WAL-logged though.
-     */
-    while (blkno > buildstate->cbtbs_pages_written)
+    for (i = 0; i < n; i++)
     {
-        if (!buildstate->cbtbs_zero_page)
-            buildstate->cbtbs_zero_page = (Page) palloc0(BLCKSZ);
-        /* don't set checksum for all-zero page */
-        smgrextend(buildstate->index->rd_smgr, MAIN_FORKNUM,
-                   buildstate->cbtbs_pages_written++,
-                   (char *) buildstate->cbtbs_zero_page,
-                   true);
-    }
+        BlockNumber blkno = order[i].blkno;
+        Page        page = (Page) (buildstate->cbtbs_batch + (Size) order[i].slot * BLCKSZ);
 
-    PageSetChecksumInplace(page, blkno);
+        /*
+         * If we have to write pages nonsequentially, fill in the space with
+         * zeroes until we come back and overwrite.  This is not logically
+         * necessary on standard Unix filesystems (unwritten space will read as
+         * zeroes anyway), but it should help to avoid fragmentation. The dummy
+         * pages aren't WAL-logged though.
+         */
+        while (blkno > buildstate->cbtbs_pages_written)
+        {
+            if (!buildstate->cbtbs_zero_page)
+                buildstate->cbtbs_zero_page = (Page) MemoryContextAllocZero(buildstate->context,
+                                                                            BLCKSZ);
+            /* don't set checksum for all-zero page */
+            smgrextend(buildstate->index->rd_smgr, MAIN_FORKNUM,
+                       buildstate->cbtbs_pages_written++,
+                       (char *) buildstate->cbtbs_zero_page,
+                       true);
+        }
 
-    /*
-     * Now write the page.  There's no need for smgr to schedule an fsync for
-     * this write; we'll do it ourselves before ending the build.
-     */
-    if (blkno == buildstate->cbtbs_pages_written)
-    {
-        /* extending the file... */
-        smgrextend(buildstate->index->rd_smgr, MAIN_FORKNUM, blkno,
-                   (char *) page, true);
-        buildstate->cbtbs_pages_written++;
-    }
-    else
-    {
-        /* overwriting a block we zero-filled before */
-        smgrwrite(buildstate->index->rd_smgr, MAIN_FORKNUM, blkno,
-                  (char *) page, true);
+        PageSetChecksumInplace(page, blkno);
+
+        /*
+         * Now write the page.  There's no need for smgr to schedule an fsync for
+         * this write; we'll do it ourselves before ending the build.
+         */
+        if (blkno == buildstate->cbtbs_pages_written)
+        {
+            /* extending the file... */
+            smgrextend(buildstate->index->rd_smgr, MAIN_FORKNUM, blkno,
+                       (char *) page, true);
+            buildstate->cbtbs_pages_written++;
+        }
+        else
+        {
+            /* overwriting a block we zero-filled before */
+            smgrwrite(buildstate->index->rd_smgr, MAIN_FORKNUM, blkno,
+                      (char *) page, true);
+        }
     }
 
-    pfree(page);
+    buildstate->cbtbs_nbatch = 0;
+}
+
+static int
+cbt_blkno_cmp(const void *a, const void *b)
+{
+    BlockNumber ba = *(const BlockNumber *) a;
+    BlockNumber bb = *(const BlockNumber *) b;
+
+    return (ba > bb) - (ba < bb);
 }
 
 /*
@@ -327,32 +1264,35 @@ cbt_writepage(CBTBuildState *buildstate, Page page, BlockNumber blkno)
 void
 cbt_init_pagestate(CBTPageState *pagestate, CBTBuildState *bstate, uint32 level)
 {
-    pagestate->cbtps_page = cbt_newpage(level);
+    if (pagestate->cbtps_page == NULL)
+        pagestate->cbtps_page = (Page) palloc(BLCKSZ);
+    cbt_newpage(pagestate->cbtps_page, level);
     pagestate->cbtps_blockno = ++bstate->cbtbs_pages_alloced;
     pagestate->cbtps_lastoff = P_FIRSTOFFSET - 1;
     pagestate->total_count = 0;
     pagestate->cbtps_level = level;
+    pagestate->cbtps_maxitems = CBT_INTERNAL_CAPACITY *
+        CBTGetNonLeafFillFactor(bstate->index) / 100;
     if (level > CBT_LEAF_LEVEL)
-        pagestate->cbtps_maxfill = (BLCKSZ * (100 - CBTREE_NONLEAF_FILLFACTOR) / 100);
+        pagestate->cbtps_maxfill = 0;
     else
-        pagestate->cbtps_maxfill = (Size) RelationGetTargetPageFreeSpace(bstate->index,
-                                                                         CBTREE_DEFAULT_FILLFACTOR);
+        pagestate->cbtps_maxfill = (Size) CBTGetTargetPageFreeSpace(bstate->index);
 
     if (level == CBT_LEAF_LEVEL)
+    {
         bstate->leaf_pagestate = pagestate;
+        bstate->cbtbs_nleaves++;
+    }
 }
 
 /*
- * Create a new cbt page on a level.
+ * Set up page as a new cbt page on a level.
  */
-Page
-cbt_newpage(uint32 level)
+void
+cbt_newpage(Page page, uint32 level)
 {
-    Page		page;
     CBTPageOpaque opaque;
 
-    page = (Page) palloc(BLCKSZ);
-
     /* Zero the page and set up standard page header info */
     CBTInitPage(page, (uint16) ((level > CBT_LEAF_LEVEL) ? 0 : CBT_LEAF));
 
@@ -361,8 +1301,6 @@ cbt_newpage(uint32 level)
     opaque->cbto_prev = opaque->cbto_next = InvalidBlockNumber;
     ItemPointerSet(&opaque->cbto_parent, InvalidBlockNumber, InvalidOffsetNumber);
     opaque->level = level;
-
-    return page;
 }
 
 /*
@@ -390,13 +1328,25 @@ CBTInitPage(Page page, uint16 flags)
     opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
     memset(opaque, 0, sizeof(CBTPageOpaqueData));
     opaque->cbto_flags = flags;
+
+    /*
+     * Leaf entries grow from the leaf header up to pd_upper. Internal pages
+     * keep their arrays in the whole page body, see CBT_INTERNAL_CAPACITY,
+     * so there is no hole between pd_lower and pd_upper.
+     */
+    if (flags & CBT_LEAF)
+        ((PageHeader) page)->pd_lower = MAXALIGN(SizeOfPageHeaderData) +
+                                        sizeof(CBTLeafHeaderData);
+    else if ((flags & CBT_META) == 0)
+        ((PageHeader) page)->pd_lower = ((PageHeader) page)->pd_upper;
 }
 
 /*
  * Fill information of the meta page.
  */
 void
-CBTFillMetaPage(Page metapage, BlockNumber root, uint32 level)
+CBTFillMetaPage(Page metapage, BlockNumber root, uint32 level,
+                BlockNumber nleaves)
 {
     CBTMetaPageData *metadata;
 
@@ -404,8 +1354,14 @@ CBTFillMetaPage(Page metapage, BlockNumber root, uint32 level)
     metadata = CBTPageGetMeta(metapage);
     memset(metadata, 0, sizeof(CBTMetaPageData));
     metadata->cbtm_magic = CBT_MAGIC;
+    metadata->cbtm_version = CBT_VERSION;
     metadata->cbtm_level = level;
     metadata->cbtm_root = root;
+    metadata->cbtm_nleaves = nleaves;
+
+    /* Keep the meta data out of the hole, generic WAL skips it */
+    ((PageHeader) metapage)->pd_lower =
+        ((char *) metadata + sizeof(CBTMetaPageData)) - (char *) metapage;
 }
 
 /*
@@ -417,7 +1373,7 @@ void cbtbuildempty(Relation index)
 
     /* Construct metapage. */
     metapage = (Page) palloc(BLCKSZ);
-    CBTFillMetaPage(metapage, InvalidBlockNumber, 0);
+    CBTFillMetaPage(metapage, InvalidBlockNumber, 0, 0);
 
     /*
 	 * Write the page and log it.  It might seem that an immediate sync would
@@ -430,7 +1386,7 @@ void cbtbuildempty(Relation index)
     smgrwrite(index->rd_smgr, INIT_FORKNUM, CBT_METAPAGE,
               (char *) metapage, true);
     log_newpage(&index->rd_smgr->smgr_rnode.node, INIT_FORKNUM,
-                CBT_METAPAGE, metapage, false);
+                CBT_METAPAGE, metapage, true);
 
     /*
      * An immediate sync is required even if we xlog'd the page, because the
@@ -446,10 +1402,161 @@ cbtcanreturn(Relation index, int attno)
     return false;
 }
 
+/*
+ * Register the reloptions of cbtree indexes, called from _PG_init.
+ */
+void
+cbt_init_reloptions(void)
+{
+    cbt_relopt_kind = add_reloption_kind();
+
+    add_int_reloption(cbt_relopt_kind, "fillfactor",
+                      "Packs leaf pages only to this percentage",
+                      CBTREE_DEFAULT_FILLFACTOR, CBTREE_MIN_FILLFACTOR, 100);
+    add_int_reloption(cbt_relopt_kind, "nonleaf_fillfactor",
+                      "Packs internal pages only to this percentage",
+                      CBTREE_NONLEAF_FILLFACTOR, CBTREE_MIN_FILLFACTOR, 100);
+    add_string_reloption(cbt_relopt_kind, "split_policy",
+                         "Where full pages are split: balanced, append, prepend or adaptive",
+                         "balanced", cbt_validate_split_policy);
+    add_string_reloption(cbt_relopt_kind, "build_order",
+                         "Column, optionally followed by ASC or DESC, whose order the build gives the positions",
+                         NULL, cbt_validate_build_order);
+}
+
+/*
+ * Parse a build_order value, a column name optionally followed by ASC or
+ * DESC. The name is folded to lower case unless it is double-quoted.
+ * Returns false if the value is not of that form.
+ */
+static bool
+cbt_parse_build_order(const char *value, char **colname, bool *desc)
+{
+    char       *str = pstrdup(value);
+    char       *name;
+    char       *dir;
+    char       *end;
+
+    *desc = false;
+
+    name = str;
+    while (scanner_isspace(*name))
+        name++;
+
+    if (*name == '"')
+    {
+        name++;
+        end = strchr(name, '"');
+        if (end == NULL || end == name)
+            return false;
+        *end++ = '\0';
+    }
+    else
+    {
+        end = name;
+        while (*end != '\0' && !scanner_isspace(*end))
+            end++;
+        if (end == name)
+            return false;
+        if (*end != '\0')
+            *end++ = '\0';
+        name = downcase_truncate_identifier(name, strlen(name), false);
+    }
+
+    /* The direction, if any, is all that may follow */
+    dir = end;
+    while (scanner_isspace(*dir))
+        dir++;
+    end = dir;
+    while (*end != '\0' && !scanner_isspace(*end))
+        end++;
+    if (*end != '\0')
+    {
+        *end++ = '\0';
+        while (scanner_isspace(*end))
+            end++;
+        if (*end != '\0')
+            return false;
+    }
+
+    if (pg_strcasecmp(dir, "desc") == 0)
+        *desc = true;
+    else if (*dir != '\0' && pg_strcasecmp(dir, "asc") != 0)
+        return false;
+
+    *colname = name;
+    return true;
+}
+
+static void
+cbt_validate_build_order(char *value)
+{
+    char       *colname;
+    bool        desc;
+
+    if (value != NULL && !cbt_parse_build_order(value, &colname, &desc))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid value for \"build_order\" option"),
+                 errdetail("The value is a column name, optionally followed by ASC or DESC.")));
+}
+
+/*
+ * Parse a split_policy value. Returns -1 if it is not valid.
+ */
+static int
+cbt_parse_split_policy(const char *value)
+{
+    if (value == NULL || pg_strcasecmp(value, "balanced") == 0)
+        return CBT_SPLIT_BALANCED;
+    if (pg_strcasecmp(value, "append") == 0)
+        return CBT_SPLIT_APPEND;
+    if (pg_strcasecmp(value, "prepend") == 0)
+        return CBT_SPLIT_PREPEND;
+    if (pg_strcasecmp(value, "adaptive") == 0)
+        return CBT_SPLIT_ADAPTIVE;
+    return -1;
+}
+
+static void
+cbt_validate_split_policy(char *value)
+{
+    if (cbt_parse_split_policy(value) < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid value for \"split_policy\" option"),
+                 errdetail("Valid values are \"balanced\", \"append\", \"prepend\", and \"adaptive\".")));
+}
+
 bytea *
 cbtoptions(Datum reloptions, bool validate)
 {
-    return NULL;
+    static const relopt_parse_elt tab[] = {
+        {"fillfactor", RELOPT_TYPE_INT, offsetof(CBTOptions, fillfactor)},
+        {"nonleaf_fillfactor", RELOPT_TYPE_INT, offsetof(CBTOptions, nonleaf_fillfactor)},
+        {"split_policy", RELOPT_TYPE_STRING, offsetof(CBTOptions, split_policy_str)},
+        {"build_order", RELOPT_TYPE_STRING, offsetof(CBTOptions, build_order)}
+    };
+    relopt_value *options;
+    int         numoptions;
+    CBTOptions *rdopts;
+
+    options = parseRelOptions(reloptions, validate, cbt_relopt_kind, &numoptions);
+
+    /* if none set, we're done */
+    if (numoptions == 0)
+        return NULL;
+
+    rdopts = allocateReloptStruct(sizeof(CBTOptions), options, numoptions);
+    fillRelOptions((void *) rdopts, sizeof(CBTOptions), options, numoptions,
+                   validate, tab, lengthof(tab));
+    pfree(options);
+
+    /* The value was checked when it was set, an unknown one is balanced */
+    rdopts->split_policy = (CBTSplitPolicy)
+        Max(cbt_parse_split_policy(GET_STRING_RELOPTION(rdopts, split_policy_str)), 0);
+
+    return (bytea *) rdopts;
 }
 
 bool
@@ -1,7 +1,40 @@
+/*--------------------------------------------------------
+ *
+ * cbtcost.c
+ *		Cost estimation of counted btree index scans.
+ *
+ * IDENTIFICATION
+ *		contrib/cbtree/cbtcost.c
+ *
+ *--------------------------------------------------------
+ */
+
 #include "postgres.h"
 
+#include <math.h>
+
+#include "cbtree.h"
+#include "access/genam.h"
+#include "catalog/pg_type.h"
 #include "nodes/relation.h"
+#include "optimizer/cost.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/selfuncs.h"
+
+static double cbt_qual_tuples(PlannerInfo *root, IndexOptInfo *index,
+                              List *qinfos, double ntuples);
 
+/*
+ * Estimate the cost of a cbtree scan.
+ *
+ * The positions are not related to the column statistics, so instead of
+ * clauselist_selectivity the number of matching tuples is derived from the
+ * position range the quals select: one tuple for an equality lookup and
+ * b - a + 1 tuples for a range. The descent costs one page per level of
+ * the tree as cached from the meta page, and the leaf pages are read in
+ * proportion to the tuples returned.
+ */
 void cbtcostestimate (PlannerInfo *root,
                 IndexPath *path,
                 double loop_count,
@@ -10,5 +43,168 @@ void cbtcostestimate (PlannerInfo *root,
                 Selectivity *indexSelectivity,
                 double *indexCorrelation, double *indexPages)
 {
+    IndexOptInfo *index = path->indexinfo;
+    List       *qinfos;
+    GenericCosts costs;
+    Relation    indexRel;
+    double      ntuples;
+    uint32      height;
+    Cost        descentCost;
+
+    /*
+     * The height of the tree comes from the meta page data cached in the
+     * relcache entry, which the planner has open and locked already; the
+     * size is the planner's estimate.
+     */
+    indexRel = index_open(index->indexoid, NoLock);
+    height = cbt_getrootheight(indexRel);
+    index_close(indexRel, NoLock);
+
+    ntuples = Max(index->tuples, 1.0);
+
+    qinfos = deconstruct_indexquals(path);
+
+    MemSet(&costs, 0, sizeof(costs));
+    costs.numIndexTuples = cbt_qual_tuples(root, index, qinfos, ntuples);
+
+    /*
+     * genericcostestimate charges the leaf pages in proportion to the
+     * tuples fetched, with loop_count taken into account for repeated
+     * scans, and the per-tuple CPU cost.
+     */
+    genericcostestimate(root, path, loop_count, qinfos, &costs);
+
+    /*
+     * Add the cost of the descent. Like btree we assume the upper pages
+     * stay in cache, so only the CPU cost of examining them is charged:
+     * summing the child counts is linear in the fanout, which is about
+     * ntuples^(1/height).
+     */
+    descentCost = 0;
+    if (height > 0)
+    {
+        double      fanout = pow(ntuples, 1.0 / (double) height);
+
+        descentCost = height * (50.0 + fanout / 2.0) * cpu_operator_cost;
+    }
+    costs.indexStartupCost += descentCost;
+    costs.indexTotalCost += descentCost;
+
+    /*
+     * The elements of pos = ANY(array) are looked up in one descent, whose
+     * upper levels they share; each further element costs about one more
+     * page examined rather than a descent of its own.
+     */
+    if (costs.num_sa_scans > 1 && height > 0)
+        costs.indexTotalCost += (costs.num_sa_scans - 1) * descentCost / height;
+
+    *indexStartupCost = costs.indexStartupCost;
+    *indexTotalCost = costs.indexTotalCost;
+    *indexSelectivity = Min(costs.numIndexTuples * costs.num_sa_scans / ntuples,
+                            1.0);
+
+    /*
+     * The order of positions has no relation to the physical order of the
+     * heap once tuples are inserted at arbitrary positions.
+     */
+    *indexCorrelation = 0.0;
+    *indexPages = costs.numIndexPages;
+}
+
+/*
+ * Estimate the number of index tuples selected by the quals of one scan.
+ * Bounds compared with a Param are only known at execution time and get
+ * the default inequality selectivities.
+ */
+static double
+cbt_qual_tuples(PlannerInfo *root, IndexOptInfo *index, List *qinfos,
+                double ntuples)
+{
+    double      lowpos = 1;
+    double      highpos = ntuples;
+    bool        lowknown = false;
+    bool        highknown = false;
+    bool        lowparam = false;
+    bool        highparam = false;
+    double      nvalues = -1;
+    double      result;
+    ListCell   *lc;
+
+    foreach(lc, qinfos)
+    {
+        IndexQualInfo *qinfo = (IndexQualInfo *) lfirst(lc);
+        Node       *other = estimate_expression_value(root, qinfo->other_operand);
+        int         strategy;
+        bool        isconst;
+        double      arg = 0;
+
+        strategy = get_op_opfamily_strategy(qinfo->clause_op,
+                                            index->opfamily[qinfo->indexcol]);
+
+        /* "const op pos" is the commuted form of "pos op const" */
+        if (!qinfo->varonleft)
+            strategy = CBTREE_NSTRATEGIES + 1 - strategy;
+
+        /*
+         * pos = ANY(array) is run as one scan per element, and
+         * genericcostestimate already multiplies by the number of scans.
+         */
+        if (IsA(qinfo->rinfo->clause, ScalarArrayOpExpr))
+        {
+            if (strategy == CBTREE_EQUAL_STRATEGY)
+                nvalues = 1;
+            continue;
+        }
+
+        isconst = IsA(other, Const) && !((Const *) other)->constisnull &&
+                  ((Const *) other)->consttype == INT4OID;
+        if (isconst)
+            arg = (double) DatumGetInt32(((Const *) other)->constvalue);
+
+        switch (strategy)
+        {
+            case CBTREE_LESS_STRATEGY:
+            case CBTREE_LESS_EQUAL_STRATEGY:
+                if (!isconst)
+                    highparam = true;
+                else
+                {
+                    if (strategy == CBTREE_LESS_STRATEGY)
+                        arg -= 1;
+                    highpos = highknown ? Min(highpos, arg) : Min(ntuples, arg);
+                    highknown = true;
+                }
+                break;
+            case CBTREE_EQUAL_STRATEGY:
+                /* an equality lookup returns at most one tuple */
+                nvalues = 1;
+                break;
+            case CBTREE_GREATER_EQUAL_STRATEGY:
+            case CBTREE_GREATER_STRATEGY:
+                if (!isconst)
+                    lowparam = true;
+                else
+                {
+                    if (strategy == CBTREE_GREATER_STRATEGY)
+                        arg += 1;
+                    lowpos = lowknown ? Max(lowpos, arg) : Max(1, arg);
+                    lowknown = true;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    if (nvalues >= 0)
+        return Max(nvalues, 1.0);
+
+    result = highpos - lowpos + 1;
+
+    if (lowparam && highparam)
+        result = Min(result, DEFAULT_RANGE_INEQ_SEL * ntuples);
+    else if (lowparam || highparam)
+        result = Min(result, DEFAULT_INEQ_SEL * ntuples);
 
-}
\ No newline at end of file
+    return Max(result, 1.0);
+}
@@ -18,12 +18,31 @@
 #include "storage/indexfsm.h"
 #include "storage/lmgr.h"
 #include "access/genam.h"
+#include "access/generic_xlog.h"
 
-Buffer cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack);
+Buffer cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack,
+                      Buffer cbuf);
 void cbt_insert_tuple(Relation index, uint32 position, ItemPointer itmptr);
-void cbt_insert_on_page(Relation index, CBTStack stack, CBTTuple newtup, Buffer *buf);
-void cbt_change_parent(CBTStack stack, Relation rel, int change);
-uint32 cbt_find_totalcnt(Relation index);
+static void cbt_insert_tids(Relation index, uint32 position, ItemPointer tids,
+                            int ntids);
+static Buffer cbt_splice_leaf(Relation index, Buffer buf, CBTStack stack,
+                              ItemPointer tids, int ntids);
+void cbt_insert_on_page(Relation index, CBTStack stack, CBTTuple newtup, Buffer *buf,
+                        Buffer cbuf);
+static BlockNumber cbt_newroot(Relation rel, uint32 level,
+                               Buffer lbuf, uint32 lcount,
+                               BlockNumber rblkno, uint32 rcount);
+static void cbt_insert_parent(Relation rel, Buffer lbuf, Buffer rbuf,
+                              CBTStack pstack, uint32 lcount, uint32 rcount,
+                              bool is_root);
+static void cbt_finish_split(Relation rel, Buffer lbuf, CBTStack pstack);
+static bool cbt_defer_change(Relation rel, Buffer buf, CBTStack parent);
+static void cbt_apply_count(Relation rel, Buffer cbuf, Buffer pbuf, OffsetNumber off);
+static bool cbt_insert_rightmost(Relation index, uint32 position, CBTTuple itup);
+static void cbt_remember_rightmost(Relation index, Buffer buf, uint32 total);
+static Buffer cbt_get_free_buffer(Relation rel);
+static OffsetNumber cbt_split_point(Relation rel, Page page, OffsetNumber insertoff,
+                                    CBTTuple newitem);
 
 
 /*
@@ -41,235 +60,1014 @@ cbtinsert(Relation index, Datum *values, bool *isnull,
 
 /*
  * Find total number of tuples in the counted B tree.
+ * That is the sum of the counts of the root and of the changes its children
+ * keep pending. Nothing is written: the root is share-locked, which keeps
+ * children from being listed or dropped from the list, and the listed
+ * children are locked too, so that what they keep pending can't change
+ * while it is added up. They are locked after the root, against the usual
+ * order, so a lock on them is only tried; a child that is busy is waited
+ * for with nothing locked, and the sum is started over.
  */
 uint32
 cbt_find_totalcnt(Relation index)
 {
-    Buffer      rootbuf;
-    Page        rootpage;
-    OffsetNumber    maxoff;
-    OffsetNumber    offset;
-    uint32      total_cnt = 0;
+    for (;;)
+    {
+        Buffer      rootbuf = cbt_getroot(index, CBT_READ);
+        Buffer      cbufs[CBT_MAX_PENDING];
+        Buffer      busy = InvalidBuffer;
+        Page        rootpage;
+        CBTPageOpaque rootopaque;
+        int64       total;
+        int         nlocked = 0;
+        int         i;
+
+        if (!BufferIsValid(rootbuf))
+            return 0;
+
+        rootpage = BufferGetPage(rootbuf);
+        rootopaque = CBTPageGetOpaque(rootpage);
+        total = cbt_page_total(rootpage);
+
+        if (!P_ISLEAF(rootopaque))
+        {
+            for (i = 0; i < rootopaque->cbto_npending; i++)
+            {
+                Buffer      cbuf = ReadBuffer(index, CBTInternalPending(rootpage)[i]);
+
+                if (!ConditionalLockBuffer(cbuf))
+                {
+                    busy = cbuf;
+                    break;
+                }
+                cbufs[nlocked++] = cbuf;
+                total += CBTPageGetOpaque(BufferGetPage(cbuf))->cbto_pending;
+            }
+        }
 
-    rootbuf = cbt_getroot(index, CBT_READ);
+        for (i = nlocked - 1; i >= 0; i--)
+            UnlockReleaseBuffer(cbufs[i]);
+        UnlockReleaseBuffer(rootbuf);
 
-    if (BufferIsInvalid(rootbuf))
-        return 0;
-    rootpage = BufferGetPage(rootbuf);
-    maxoff = PageGetMaxOffsetNumber(rootpage);
+        if (!BufferIsValid(busy))
+            return (uint32) total;
+
+        LockBuffer(busy, CBT_READ);
+        UnlockReleaseBuffer(busy);
+    }
+}
+
+/*
+ * Apply a change in the number of leaf pages to the meta page. That only
+ * happens when leaves are added or removed; the number of tuples is not
+ * kept there, see cbt_find_totalcnt. The meta page is locked last, after
+ * any tree page the caller holds.
+ */
+void
+cbt_update_meta(Relation rel, int nleaves)
+{
+    Buffer      metabuf;
+    CBTMetaPageData *metad;
+    GenericXLogState *state;
+
+    metabuf = cbt_get_buffer(rel, CBT_METAPAGE, CBT_WRITE);
+
+    state = GenericXLogStart(rel);
+    metad = CBTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+    metad->cbtm_nleaves += nleaves;
+    GenericXLogFinish(state);
+
+    UnlockReleaseBuffer(metabuf);
+}
+
+/*
+ * Insert a tuple pointing to itmptr into the tree at specified position.
+ */
+void
+cbt_insert_tuple(Relation index, uint32 position, ItemPointer itmptr)
+{
+    cbt_insert_tids(index, position, itmptr, 1);
+}
 
-    if (maxoff == 0)
+/*
+ * Insert ntids tuples pointing to tids into the tree, the first one at the
+ * specified position and the others right after it, in their order. They
+ * are spliced in CBT_SPLICE_MAX_TIDS at a time, each batch with a single
+ * descent.
+ */
+void
+cbt_insert_many(Relation index, uint32 position, ItemPointer tids, int ntids)
+{
+    while (ntids > 0)
     {
-        UnlockReleaseBuffer(rootbuf);
-        return 0;
+        int         n = Min(ntids, CBT_SPLICE_MAX_TIDS);
+
+        cbt_insert_tids(index, position, tids, n);
+        position += n;
+        tids += n;
+        ntids -= n;
+
+        CHECK_FOR_INTERRUPTS();
     }
+}
+
+/*
+ * Insert ntids tuples pointing to tids at the specified position.
+ *
+ * The tree is descended once, read-locking one page at a time, and only the
+ * leaf is write-locked. The path is kept in a local array. The tuples are
+ * added to the leaf in a record that also counts them in its
+ * cbto_incomplete, and the counts above are raised afterwards by
+ * cbt_finish_count, one level per record from the bottom up. A page may have
+ * been split since its downlink was followed; if the position is now on the
+ * right half, the descent moves right.
+ */
+static void
+cbt_insert_tids(Relation index, uint32 position, ItemPointer tids, int ntids)
+{
+    CBTTupleData    itup;
+    CBTStackData    path[CBTREE_MAX_LEVELS];
+    CBTStack        stack = NULL;
+    Buffer          buf;
+    Page            page;
+    CBTPageOpaque   opaque;
+    BlockNumber     leafblkno;
+    uint32          leftcount = 0;
+    int             depth = 0;
+    int             lockmode = CBT_READ;
+    bool            append = false;
+
+	/* Sanity check that position is a positive integer. */
+	Assert (position > 0);
 
-    offset = P_FIRSTOFFSET;
+    Assert (ntids > 0 && ntids <= CBT_SPLICE_MAX_TIDS);
+
+    CBTFormTuple(&tids[0], &itup, 1);
+
+    /*
+     * If the position is larger than total number of tuples,
+     * then insert the tuple to the last in the sequence. Appends
+     * of one tuple first try the cached rightmost leaf, which
+     * avoids the descent. Otherwise the descent finds out that
+     * the position is past the end.
+     */
+    if (ntids == 1 && cbt_insert_rightmost(index, position, &itup))
+        return;
+
+    buf = cbt_getroot(index, CBT_WRITE);
 
     for (;;)
     {
-        ItemId      curid;
-        CBTTuple    tuple;
+        OffsetNumber    offnum;
+        uint32          pageleft = 0;
+        BlockNumber     blkno;
 
-        curid = PageGetItemId(rootpage, offset);
+        page = BufferGetPage(buf);
+        opaque = CBTPageGetOpaque(page);
+        blkno = BufferGetBlockNumber(buf);
 
-        if (!ItemIdIsDead(curid))
+        /* The leaf is the only page that is write-locked */
+        if (P_ISLEAF(opaque) && lockmode != CBT_WRITE)
         {
-            tuple = (CBTTuple) PageGetItem(rootpage, curid);
-            total_cnt += tuple->childcnt;
+            LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+            LockBuffer(buf, CBT_WRITE);
+            lockmode = CBT_WRITE;
+            continue;
         }
 
-        if (offset == maxoff) {
-            UnlockReleaseBuffer(rootbuf);
-            return total_cnt;
+        /* Give the right half of an unfinished split its downlink first */
+        if (P_ISLEAF(opaque) && P_INCOMPLETE_SPLIT(opaque))
+        {
+            cbt_finish_split(index, buf, stack);
+            buf = cbt_get_buffer(index, blkno, CBT_WRITE);
+            continue;
         }
 
-        offset = OffsetNumberNext(offset);
+        if (append || P_IGNORE(opaque))
+            offnum = InvalidOffsetNumber;
+        else
+            offnum = cbt_search_page(index, page, position - leftcount, &pageleft);
+
+        if (offnum == InvalidOffsetNumber && !P_RIGHTMOST(opaque))
+        {
+            Buffer          rbuf;
+
+            /*
+             * The position is on a page to the right, split off since the
+             * downlink was followed, or the page was deleted.
+             */
+            leftcount += pageleft;
+            rbuf = cbt_get_buffer(index, opaque->cbto_next, lockmode);
+            UnlockReleaseBuffer(buf);
+            buf = rbuf;
+            continue;
+        }
+
+        if (P_IGNORE(opaque))
+        {
+            /* The last page of the level was deleted, start over */
+            UnlockReleaseBuffer(buf);
+            buf = cbt_getroot(index, CBT_WRITE);
+            stack = NULL;
+            depth = 0;
+            leftcount = 0;
+            lockmode = CBT_READ;
+            append = false;
+            continue;
+        }
+
+        if (offnum == InvalidOffsetNumber)
+        {
+            /* Past the end of the tree, append after the last tuple */
+            append = true;
+            offnum = cbt_page_nitems(page);
+            if (P_ISLEAF(opaque))
+                offnum = OffsetNumberNext(offnum);
+        }
+
+        if (depth >= CBTREE_MAX_LEVELS)
+            elog(ERROR, "cbtree index \"%s\" is deeper than %d levels",
+                 RelationGetRelationName(index), CBTREE_MAX_LEVELS);
+
+        leftcount += pageleft;
+        path[depth].cbts_blkno = blkno;
+        path[depth].cbts_offset = offnum;
+        path[depth].total_count = leftcount;
+        path[depth].cbts_parent = stack;
+        stack = &path[depth++];
+
+        if (P_ISLEAF(opaque))
+            break;
+
+        blkno = CBTInternalGetBlock(page, offnum);
+        UnlockReleaseBuffer(buf);
+        buf = cbt_get_buffer(index, blkno, CBT_READ);
     }
+
+    leafblkno = BufferGetBlockNumber(buf);
+    if (ntids == 1)
+        cbt_insert_on_page(index, stack, &itup, &buf, InvalidBuffer);
+    else
+        buf = cbt_splice_leaf(index, buf, stack, tids, ntids);
+    /*
+     * The page where the append was noticed added all of its count to
+     * leftcount, so leftcount is the total the descent saw.
+     */
+    if (append)
+        cbt_remember_rightmost(index, buf, leftcount + ntids);
+
+    /*
+     * A split leaves the change in the incomplete count of the original
+     * leaf, which kept the downlink. It is carried up from there.
+     */
+    if (BufferGetBlockNumber(buf) != leafblkno)
+    {
+        UnlockReleaseBuffer(buf);
+        buf = cbt_get_buffer(index, leafblkno, CBT_WRITE);
+    }
+    if (!P_IGNORE(CBTPageGetOpaque(BufferGetPage(buf))))
+        cbt_finish_count(index, buf, stack->cbts_parent);
+    UnlockReleaseBuffer(buf);
 }
 
 /*
- * Insert a tuple pointing to itmptr into the tree at specified position.
+ * Append itup after the last tuple of the tree through the rightmost leaf
+ * cached in rd_amcache. The leaf and its ancestors on the right spine are
+ * write-locked bottom-up, in the same order a split locks them, and checked
+ * before anything is changed: every page must still be the rightmost one of
+ * its level and have the child below as its last downlink.
+ *
+ * Only positions past the total cached with the leaf are tried, so that
+ * inserts elsewhere don't lock the spine. That total is just a guess, the
+ * position is checked against the counts of the root once it is locked.
+ * Returns false, with nothing changed, if the cache is stale, the position
+ * isn't past the end or the leaf has no room; the caller then goes through
+ * the regular path.
  */
-void
-cbt_insert_tuple(Relation index, uint32 position, ItemPointer itmptr)
+static bool
+cbt_insert_rightmost(Relation index, uint32 position, CBTTuple itup)
 {
-    Buffer              insertionbuf;
-    CBTTuple            itup;
-    CBTStack            stack;
+    CBTCacheData   *cache = (CBTCacheData *) index->rd_amcache;
+    Buffer          bufs[CBTREE_MAX_LEVELS];
+    int             nbufs = 0;
+    BlockNumber     childblkno;
+    ItemPointerData parent;
+    Page            page;
+    CBTPageOpaque   opaque;
+    uint32          total = 0;
+    bool            valid;
+    int             i;
+
+    if (cache == NULL || cache->cbtc_rightmost == InvalidBlockNumber ||
+        position <= cache->cbtc_total)
+        return false;
+
+    childblkno = cache->cbtc_rightmost;
+    bufs[nbufs++] = cbt_get_buffer(index, childblkno, CBT_WRITE);
+    page = BufferGetPage(bufs[0]);
+    if (PageIsNew(page))
+        valid = false;
+    else
+    {
+        opaque = CBTPageGetOpaque(page);
+        valid = P_ISLEAF(opaque) && P_RIGHTMOST(opaque) && !P_IGNORE(opaque) &&
+                CBTPageGetNItems(page) >= P_FIRSTOFFSET &&
+                cbt_page_hasroom(page, itup);
+        parent = opaque->cbto_parent;
+    }
 
-	/* Sanity check that position is a positive integer. */
-	Assert (position > 0);
+    while (valid && ItemPointerIsValid(&parent))
+    {
+        if (nbufs >= CBTREE_MAX_LEVELS)
+        {
+            valid = false;
+            break;
+        }
 
-    stack = cbt_search(index, position, &insertionbuf, CBT_WRITE);
+        bufs[nbufs] = cbt_get_buffer(index, ItemPointerGetBlockNumber(&parent), CBT_WRITE);
+        page = BufferGetPage(bufs[nbufs++]);
+        opaque = CBTPageGetOpaque(page);
 
-    if (BufferIsInvalid(insertionbuf) || stack == NULL)
-    {
-        uint32      newpos;
-        /*
-         * If the position is larger than total number of tuples,
-         * then insert the tuple to the last in the sequence
-         */
-        newpos = cbt_find_totalcnt(index);
+        if (P_ISLEAF(opaque) || P_IGNORE(opaque) || !P_RIGHTMOST(opaque) ||
+            CBTPageGetNItems(page) < P_FIRSTOFFSET)
+        {
+            valid = false;
+            break;
+        }
 
-        /* If the index is empty then directly build the stack */
-        if (newpos == 0)
+        if (CBTInternalGetBlock(page, CBTPageGetNItems(page)) != childblkno)
         {
-            insertionbuf = cbt_getroot(index, CBT_READ);
-            LockBuffer(insertionbuf, BUFFER_LOCK_UNLOCK);
-            LockBuffer(insertionbuf, CBT_WRITE);
-            stack = palloc(sizeof(CBTStackData));
-            stack->cbts_parent = NULL;
-            stack->cbts_blkno = BufferGetBlockNumber(insertionbuf);
-            stack->cbts_offset = P_FIRSTOFFSET;
-            stack->total_count = 0;
-        } else
+            valid = false;
+            break;
+        }
+
+        childblkno = ItemPointerGetBlockNumber(&parent);
+        parent = opaque->cbto_parent;
+    }
+
+    /* The top of the spine must be the root */
+    if (valid && !P_ISROOT(opaque))
+        valid = false;
+
+    /* The whole spine is locked, so the total can't change under us */
+    if (valid)
+    {
+        page = BufferGetPage(bufs[nbufs - 1]);
+        total = cbt_page_total(page);
+        if (!P_ISLEAF(opaque) && opaque->cbto_npending > 0)
+            total += (uint32) cbt_pending_sum(index, page);
+        cache->cbtc_total = total;
+        if (position <= total)
         {
-            stack = cbt_search(index, newpos, &insertionbuf, CBT_WRITE);
-            stack->cbts_offset++;
+            for (i = nbufs - 1; i >= 0; i--)
+                UnlockReleaseBuffer(bufs[i]);
+            return false;
         }
     }
 
-    itup = palloc(sizeof(CBTTupleData));
-    CBTFormTuple(itmptr, itup, 1);
-    cbt_change_parent(stack->cbts_parent, index, 1);
-    cbt_insert_on_page(index, stack, itup, &insertionbuf);
-    UnlockReleaseBuffer(insertionbuf);
-    cbt_freestack(stack);
+    if (valid)
+    {
+        GenericXLogState *state = GenericXLogStart(index);
+
+        /* The leaf first, then the counts of the spine from the bottom up */
+        page = GenericXLogRegisterBuffer(state, bufs[0], 0);
+        if (!cbt_page_additem(page, OffsetNumberNext(CBTPageGetNItems(page)), itup))
+        {
+            GenericXLogAbort(state);
+            elog(ERROR, "failed to add item to the index page");
+        }
+        if (nbufs > 1)
+            CBTPageGetOpaque(page)->cbto_incomplete += itup->childcnt;
+        GenericXLogFinish(state);
+
+        for (i = 1; i < nbufs; i++)
+            cbt_apply_count(index, bufs[i - 1], bufs[i],
+                            CBTPageGetNItems(BufferGetPage(bufs[i])));
+
+        cache->cbtc_total = total + itup->childcnt;
+    }
+    else if (index->rd_amcache != NULL)
+        ((CBTCacheData *) index->rd_amcache)->cbtc_rightmost = InvalidBlockNumber;
+
+    for (i = nbufs - 1; i >= 0; i--)
+        UnlockReleaseBuffer(bufs[i]);
+
+    return valid;
 }
 
 /*
- * Insert a tuple on page. The buffer is assumed to have write lock and will not be
- * freed. Stack must contain the insertion position and its parents.
+ * Remember the leaf in buf as the rightmost one, if it is, with the total
+ * number of tuples the caller saw after its append. Concurrent changes may
+ * make it off; cbt_insert_rightmost checks the position against the root.
  */
-void
-cbt_insert_on_page(Relation index, CBTStack stack, CBTTuple newtup, Buffer *buf)
+static void
+cbt_remember_rightmost(Relation index, Buffer buf, uint32 total)
 {
-    Page        page;
-    size_t      itemsz;
+    CBTPageOpaque   opaque = CBTPageGetOpaque(BufferGetPage(buf));
+    CBTCacheData   *cache = (CBTCacheData *) index->rd_amcache;
 
-    if (stack == NULL)
+    if (cache != NULL && P_ISLEAF(opaque) && P_RIGHTMOST(opaque))
     {
-        /* a new root is should be constructed */
-        page = BufferGetPage(*buf);
-        CBTInitPage(page, CBT_ROOT);
-        stack = palloc(sizeof(CBTStackData));
-        stack->cbts_blkno = BufferGetBlockNumber(*buf);
-        stack->cbts_offset = P_FIRSTOFFSET;
-    } else
+        cache->cbtc_rightmost = BufferGetBlockNumber(buf);
+        cache->cbtc_total = total;
+    }
+}
+
+/*
+ * Splice ntids tuples pointing to tids into the leaf in buf at the offset
+ * in stack. The leaf counts them in its cbto_incomplete, unless it is the
+ * root, for the caller to carry up. If they don't all fit,
+ * the items of the leaf and the new ones are laid out in order over the
+ * leaf and a chain of new leaves right of it, each filled up before the
+ * next is started. This is a split into more than two pages: every page
+ * of the chain but the last has CBT_INCOMPLETE_SPLIT set, and the downlink
+ * of the leaf counts the whole chain. The new pages then get downlinks
+ * from left to right, each one counting the rest of the chain, and lose
+ * their flag one by one. The chain stays locked until that is done, and
+ * the buffer of its last page is returned, still locked.
+ */
+static Buffer
+cbt_splice_leaf(Relation index, Buffer buf, CBTStack stack,
+                ItemPointer tids, int ntids)
+{
+    Page            page = BufferGetPage(buf);
+    CBTPageOpaque   opaque = CBTPageGetOpaque(page);
+    BlockNumber     origblkno = BufferGetBlockNumber(buf);
+    int             before = stack->cbts_offset - P_FIRSTOFFSET;
+    int             nold = CBTPageGetNItems(page);
+    bool            is_root = P_ISROOT(opaque);
+    Buffer          rbufs[CBT_SPLICE_MAX_PAGES];
+    int             nnew = 0;
+    Buffer          sbuf = InvalidBuffer;
+    Page            leftpage;
+    Page            curpage;
+    CBTPageOpaque   lopaque;
+    ItemPointer     oldtids;
+    CBTTupleData    item;
+    GenericXLogState *state;
+    uint32          chaincount;
+    int             i;
+
+    /* Most splices fit on the leaf */
+    state = GenericXLogStart(index);
+    curpage = GenericXLogRegisterBuffer(state, buf, 0);
+    for (i = 0; i < ntids; i++)
     {
-        page = BufferGetPage(*buf);
+        CBTFormTuple(&tids[i], &item, 1);
+        if (!cbt_page_additem(curpage, stack->cbts_offset + i, &item))
+            break;
+    }
+    if (i == ntids)
+    {
+        if (!is_root)
+            CBTPageGetOpaque(curpage)->cbto_incomplete += ntids;
+        GenericXLogFinish(state);
+        return buf;
+    }
+    GenericXLogAbort(state);
+
+    oldtids = (ItemPointer) palloc(Max(nold, 1) * sizeof(ItemPointerData));
+    if (nold > 0)
+        cbt_leaf_gettids(page, P_FIRSTOFFSET, nold, oldtids);
+
+    /* As in a split, the leaf is rewritten in a temporary page */
+    leftpage = PageGetTempPage(page);
+    CBTInitPage(leftpage, opaque->cbto_flags & ~CBT_ROOT);
+    PageSetLSN(leftpage, PageGetLSN(page));
+    lopaque = CBTPageGetOpaque(leftpage);
+    lopaque->cbto_prev = opaque->cbto_prev;
+    lopaque->cbto_next = opaque->cbto_next;
+    lopaque->cbto_parent = opaque->cbto_parent;
+    lopaque->cbto_pending = opaque->cbto_pending;
+    lopaque->cbto_incomplete = opaque->cbto_incomplete + (is_root ? 0 : ntids);
+    lopaque->level = opaque->level;
+
+    curpage = leftpage;
+    for (i = 0; i < nold + ntids; i++)
+    {
+        if (i < before)
+            CBTFormTuple(&oldtids[i], &item, 1);
+        else if (i < before + ntids)
+            CBTFormTuple(&tids[i - before], &item, 1);
+        else
+            CBTFormTuple(&oldtids[i - ntids], &item, 1);
+
+        if (cbt_page_additem(curpage, OffsetNumberNext(CBTPageGetNItems(curpage)), &item))
+            continue;
+
+        /* The page is full, start the next one of the chain */
+        if (nnew >= CBT_SPLICE_MAX_PAGES)
+        {
+            while (nnew > 0)
+                memset(BufferGetPage(rbufs[--nnew]), 0, BLCKSZ);
+            elog(ERROR, "too many pages for a splice in index \"%s\"",
+                 RelationGetRelationName(index));
+        }
+        rbufs[nnew] = cbt_get_buffer(index, InvalidBlockNumber, CBT_WRITE);
+        curpage = BufferGetPage(rbufs[nnew]);
+        CBTInitPage(curpage, opaque->cbto_flags & ~(CBT_ROOT | CBT_INCOMPLETE_SPLIT));
+        CBTPageGetOpaque(curpage)->cbto_parent = opaque->cbto_parent;
+        CBTPageGetOpaque(curpage)->level = opaque->level;
+        nnew++;
+
+        if (!cbt_page_additem(curpage, P_FIRSTOFFSET, &item))
+            elog(ERROR, "failed to add item to the index page");
     }
+    pfree(oldtids);
 
-    itemsz = MAXALIGN(sizeof(CBTTupleData));
-    if (PageGetFreeSpace(page) < itemsz)
+    /* Link the chain in between the leaf and its old right sibling */
+    for (i = 0; i < nnew; i++)
     {
-        *buf = cbt_split_page(index, *buf, newtup, stack);
+        CBTPageOpaque   ropaque = CBTPageGetOpaque(BufferGetPage(rbufs[i]));
+
+        ropaque->cbto_prev = (i == 0) ? origblkno : BufferGetBlockNumber(rbufs[i - 1]);
+        ropaque->cbto_next = (i == nnew - 1) ? opaque->cbto_next :
+            BufferGetBlockNumber(rbufs[i + 1]);
+        if (i < nnew - 1)
+            ropaque->cbto_flags |= CBT_INCOMPLETE_SPLIT;
     }
-    else
+    if (nnew > 0)
+    {
+        lopaque->cbto_next = BufferGetBlockNumber(rbufs[0]);
+        lopaque->cbto_flags |= CBT_INCOMPLETE_SPLIT;
+    }
+
+    if (nnew > 0 && !P_RIGHTMOST(opaque))
+    {
+        CBTPageOpaque   sopaque;
+
+        sbuf = cbt_get_buffer(index, opaque->cbto_next, CBT_WRITE);
+        sopaque = CBTPageGetOpaque(BufferGetPage(sbuf));
+        if (sopaque->cbto_prev != origblkno)
+        {
+            for (i = 0; i < nnew; i++)
+                memset(BufferGetPage(rbufs[i]), 0, BLCKSZ);
+            elog(ERROR, "right sibling's left-link doesn't match: "
+                    "block %u links to %u instead of expected %u in index \"%s\"",
+                 opaque->cbto_next, sopaque->cbto_prev, origblkno,
+                 RelationGetRelationName(index));
+        }
+    }
+
+    /*
+     * The new pages past the first one can't be reached until it is linked
+     * in, so they are logged first, whole, in as many records as it takes.
+     * A crash before the last record only leaves them unused. The last one
+     * rewrites the leaf and links in the first new page and the sibling.
+     */
+    state = NULL;
+    for (i = nnew - 1; i >= 1; i--)
     {
-        PageAddItem(page, (Item) newtup, itemsz, stack->cbts_offset, false, false);
-        START_CRIT_SECTION();
+        if (state == NULL)
+            state = GenericXLogStart(index);
+        GenericXLogRegisterBuffer(state, rbufs[i], GENERIC_XLOG_FULL_IMAGE);
+        if (i % MAX_GENERIC_XLOG_PAGES == 1)
+        {
+            GenericXLogFinish(state);
+            state = NULL;
+        }
+    }
+    if (state != NULL)
+        GenericXLogFinish(state);
+
+    state = GenericXLogStart(index);
+    memcpy(GenericXLogRegisterBuffer(state, buf, 0), leftpage, BLCKSZ);
+    if (nnew > 0)
+        GenericXLogRegisterBuffer(state, rbufs[0], GENERIC_XLOG_FULL_IMAGE);
+    if (BufferIsValid(sbuf))
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, sbuf, 0))->cbto_prev =
+            BufferGetBlockNumber(rbufs[nnew - 1]);
+    GenericXLogFinish(state);
+    pfree(leftpage);
+
+    if (BufferIsValid(sbuf))
+        UnlockReleaseBuffer(sbuf);
 
-        MarkBufferDirty(*buf);
+    /* Give every new page its downlink */
+    chaincount = 0;
+    for (i = 0; i < nnew; i++)
+        chaincount += cbt_page_total(BufferGetPage(rbufs[i]));
 
-        END_CRIT_SECTION();
+    for (i = 0; i < nnew; i++)
+    {
+        cbt_insert_parent(index, buf, rbufs[i], stack->cbts_parent,
+                          cbt_page_total(BufferGetPage(buf)), chaincount,
+                          is_root && i == 0);
+        chaincount -= cbt_page_total(BufferGetPage(rbufs[i]));
+        UnlockReleaseBuffer(buf);
+        buf = rbufs[i];
     }
+
+    if (nnew > 0)
+        cbt_update_meta(index, nnew);
+
+    return buf;
 }
 
+/*
+ * Insert a tuple on page. The buffer is assumed to have write lock and will not be
+ * freed. Stack must contain the insertion position and its parents. If the
+ * page has to be split, *buf and the stack are changed to the half that
+ * received the tuple. A tuple added to a leaf other than the root is
+ * counted in the incomplete count of the leaf, or of the left half.
+ *
+ * If cbuf is valid, newtup is the downlink of the right half of a split of
+ * the child in cbuf, which is locked. The downlink of the child, right
+ * before the new one, then gives up the count of the right half, and the
+ * split of the child is marked finished, in the same WAL record.
+ */
 void
-cbt_change_children(Relation rel, ItemPointer child, BlockNumber parentblkno, OffsetNumber parentoffset)
+cbt_insert_on_page(Relation index, CBTStack stack, CBTTuple newtup, Buffer *buf,
+                   Buffer cbuf)
 {
-    Buffer          childbuf;
-    Page            page;
-    CBTPageOpaque   opaque;
+    Page        page = BufferGetPage(*buf);
 
-    childbuf = cbt_get_buffer(rel, ItemPointerGetBlockNumber(child), CBT_WRITE);
-    page = BufferGetPage(childbuf);
-    opaque = (CBTPageOpaque )PageGetSpecialPointer(page);
+    if (!cbt_page_hasroom(page, newtup))
+    {
+        *buf = cbt_split_page(index, *buf, newtup, stack, cbuf);
+    }
+    else
+    {
+        GenericXLogState *state = GenericXLogStart(index);
+
+        page = GenericXLogRegisterBuffer(state, *buf, 0);
+        if (BufferIsValid(cbuf))
+        {
+            CBTInternalGetCount(page, stack->cbts_offset - 1) -= newtup->childcnt;
+            CBTPageGetOpaque(GenericXLogRegisterBuffer(state, cbuf, 0))->cbto_flags &=
+                ~CBT_INCOMPLETE_SPLIT;
+        }
+        else if (!P_ISROOT(CBTPageGetOpaque(page)))
+            CBTPageGetOpaque(page)->cbto_incomplete += newtup->childcnt;
+        if (!cbt_page_additem(page, stack->cbts_offset, newtup))
+        {
+            GenericXLogAbort(state);
+            elog(ERROR, "failed to add item to the index page");
+        }
+        GenericXLogFinish(state);
+    }
+}
+
+/*
+ * Write-lock the parent page described by stack and find the downlink to
+ * child on it. Since the stack entry was made the downlink may have moved
+ * right, if the parent was split, or to a lower slot, if vacuum removed
+ * downlinks before it; the stack entry is updated to where it is now.
+ * Returns InvalidBuffer if the downlink can't be found.
+ */
+Buffer
+cbt_getstackbuf(Relation rel, CBTStack stack, BlockNumber child)
+{
+    BlockNumber     blkno = stack->cbts_blkno;
+    OffsetNumber    start = stack->cbts_offset;
+
+    for (;;)
+    {
+        Buffer          buf;
+        Page            page;
+        CBTPageOpaque   opaque;
+
+        buf = cbt_get_buffer(rel, blkno, CBT_WRITE);
+        page = BufferGetPage(buf);
+        opaque = CBTPageGetOpaque(page);
+
+        /* Give the right half of an unfinished split its downlink first */
+        if (P_INCOMPLETE_SPLIT(opaque))
+        {
+            cbt_finish_split(rel, buf, NULL);
+            continue;
+        }
 
-    START_CRIT_SECTION();
+        if (!P_IGNORE(opaque) && !P_ISLEAF(opaque))
+        {
+            OffsetNumber offnum = cbt_internal_find_block(page, child, start);
 
-    ItemPointerSet(&opaque->cbto_parent, parentblkno, parentoffset);
-    MarkBufferDirty(childbuf);
+            if (offnum != InvalidOffsetNumber)
+            {
+                stack->cbts_blkno = blkno;
+                stack->cbts_offset = offnum;
+                return buf;
+            }
+        }
 
-    END_CRIT_SECTION();
+        blkno = opaque->cbto_next;
+        start = P_FIRSTOFFSET;
+        UnlockReleaseBuffer(buf);
 
-    UnlockReleaseBuffer(childbuf);
+        if (blkno == InvalidBlockNumber)
+            return InvalidBuffer;
+    }
 }
 
 /*
- * Change children count in parents.
- * This function will trace down stack and add change
- * to the children count in parent tuples.
+ * Carry the incomplete count of the page in buf up to the root. The
+ * caller holds the page write-locked, and still does on return; stack is
+ * the path above it, or NULL to follow the parent hints. Should the root
+ * have been split since the descent, the path is continued above the top
+ * of the stack through the hints as well.
+ *
+ * Each level takes one WAL record that moves the change from the child to
+ * its downlink and to the incomplete count of the parent, with both pages
+ * locked, so a reader sees the counts above a page either with the change
+ * or without it, and never a downlink that counts tuples the page below
+ * doesn't have yet. An error or crash in between leaves the rest of the
+ * change on the page it had reached, where the next insert through the
+ * page or vacuum finds it and carries it on.
+ *
+ * With cbt_pending_limit set, a child of the root keeps the change in its
+ * cbto_pending instead of passing it on, so writers rarely need more than
+ * a share lock on the root; the sum is applied to the downlink once it
+ * reaches the limit. The pending sum and the npending count of the root
+ * are updated with both pages locked.
  */
 void
-cbt_change_parent(CBTStack stack, Relation rel, int change)
+cbt_finish_count(Relation rel, Buffer buf, CBTStack stack)
 {
-    ItemId      itemid;
-    Buffer      buf;
-    Page        page;
-    CBTTuple    tuple;
+    Buffer          childbuf = buf;
+    CBTStackData    hint;
 
-    if (stack == NULL)
-        return;
+    for (;;)
+    {
+        CBTPageOpaque   copaque = CBTPageGetOpaque(BufferGetPage(childbuf));
+        BlockNumber     child = BufferGetBlockNumber(childbuf);
+        Buffer          pbuf;
+        Page            ppage;
+        CBTPageOpaque   popaque;
+        int32           change = copaque->cbto_incomplete;
 
-    buf = cbt_get_buffer(rel, stack->cbts_blkno, CBT_WRITE);
-    page = BufferGetPage(buf);
-    itemid = PageGetItemId(page, stack->cbts_offset);
-    tuple = (CBTTuple )PageGetItem(page, itemid);
+        if (!P_INCOMPLETE_COUNT(copaque) || P_ISROOT(copaque))
+            break;
 
-    START_CRIT_SECTION();
+        if (stack == NULL)
+        {
+            /* Dropping the change would leave every count above it wrong */
+            if (!ItemPointerIsValid(&copaque->cbto_parent))
+                elog(ERROR, "block %u of index \"%s\" is not the root and has no parent hint",
+                     child, RelationGetRelationName(rel));
+            hint.cbts_blkno = ItemPointerGetBlockNumber(&copaque->cbto_parent);
+            hint.cbts_offset = ItemPointerGetOffsetNumber(&copaque->cbto_parent);
+            hint.total_count = 0;
+            hint.cbts_parent = NULL;
+            stack = &hint;
+        }
 
-    tuple->childcnt += change;
-    MarkBufferDirty(buf);
+        /* Keep the change pending on the child if that's allowed */
+        if (cbt_defer_change(rel, childbuf, stack))
+            break;
 
-    END_CRIT_SECTION();
+        pbuf = cbt_getstackbuf(rel, stack, child);
+        if (!BufferIsValid(pbuf))
+            elog(ERROR, "failed to re-find parent of block %u in index \"%s\"",
+                 child, RelationGetRelationName(rel));
+        ppage = BufferGetPage(pbuf);
+        popaque = CBTPageGetOpaque(ppage);
 
-    UnlockReleaseBuffer(buf);
-    cbt_change_parent(stack->cbts_parent, rel, change);
+        if (copaque->cbto_pending == 0 && P_ISROOT(popaque) &&
+            Abs(change) < cbt_pending_limit &&
+            popaque->cbto_npending < CBT_MAX_PENDING)
+        {
+            GenericXLogState *state = GenericXLogStart(rel);
+
+            /* The child starts to keep changes pending */
+            cbt_pending_add(GenericXLogRegisterBuffer(state, pbuf, 0), child);
+            copaque = CBTPageGetOpaque(GenericXLogRegisterBuffer(state, childbuf, 0));
+            copaque->cbto_pending = change;
+            copaque->cbto_incomplete = 0;
+            GenericXLogFinish(state);
+        }
+        else
+            cbt_apply_count(rel, childbuf, pbuf, stack->cbts_offset);
+
+        if (childbuf != buf)
+            UnlockReleaseBuffer(childbuf);
+        childbuf = pbuf;
+        stack = stack->cbts_parent;
+    }
+
+    if (childbuf != buf)
+        UnlockReleaseBuffer(childbuf);
+}
+
+/*
+ * Move the incomplete count of the child in cbuf, and what it keeps
+ * pending, to its downlink at off on the parent in pbuf, in one WAL
+ * record. Both pages are write-locked. The incomplete count moves on to
+ * the parent, unless that is the root; what the child kept pending is in
+ * the counts above the parent already.
+ */
+static void
+cbt_apply_count(Relation rel, Buffer cbuf, Buffer pbuf, OffsetNumber off)
+{
+    GenericXLogState *state = GenericXLogStart(rel);
+    Page            ppage = GenericXLogRegisterBuffer(state, pbuf, 0);
+    CBTPageOpaque   popaque = CBTPageGetOpaque(ppage);
+    CBTPageOpaque   copaque;
+
+    copaque = CBTPageGetOpaque(GenericXLogRegisterBuffer(state, cbuf, 0));
+    CBTInternalGetCount(ppage, off) += copaque->cbto_incomplete + copaque->cbto_pending;
+    if (!P_ISROOT(popaque))
+        popaque->cbto_incomplete += copaque->cbto_incomplete;
+    if (copaque->cbto_pending != 0)
+        cbt_pending_forget(ppage, BufferGetBlockNumber(cbuf));
+    copaque->cbto_pending = 0;
+    copaque->cbto_incomplete = 0;
+    GenericXLogFinish(state);
+}
+
+/*
+ * Add the incomplete count of the internal page in buf, which is locked,
+ * to its pending sum instead of to its downlink. That is only done if the
+ * parent is the root, which then just needs a share lock, and if the sum
+ * stays nonzero and below cbt_pending_limit. Returns false with nothing
+ * changed otherwise.
+ */
+static bool
+cbt_defer_change(Relation rel, Buffer buf, CBTStack parent)
+{
+    CBTPageOpaque   opaque = CBTPageGetOpaque(BufferGetPage(buf));
+    int64           pending = (int64) opaque->cbto_pending + opaque->cbto_incomplete;
+    Buffer          pbuf;
+    Page            ppage;
+    CBTPageOpaque   popaque;
+    bool            result;
+
+    if (opaque->cbto_pending == 0 || pending == 0 ||
+        pending >= cbt_pending_limit || -pending >= cbt_pending_limit ||
+        parent->cbts_parent != NULL)
+        return false;
+
+    pbuf = cbt_get_buffer(rel, parent->cbts_blkno, CBT_READ);
+    ppage = BufferGetPage(pbuf);
+    popaque = CBTPageGetOpaque(ppage);
+
+    result = P_ISROOT(popaque) && !P_IGNORE(popaque) &&
+        cbt_internal_find_block(ppage, BufferGetBlockNumber(buf),
+                                parent->cbts_offset) != InvalidOffsetNumber;
+
+    if (result)
+    {
+        GenericXLogState *state = GenericXLogStart(rel);
+
+        opaque = CBTPageGetOpaque(GenericXLogRegisterBuffer(state, buf, 0));
+        opaque->cbto_pending = (int32) pending;
+        opaque->cbto_incomplete = 0;
+        GenericXLogFinish(state);
+    }
+
+    UnlockReleaseBuffer(pbuf);
+    return result;
+}
+
+/*
+ * Fold the changes the children of the internal page in buf keep pending
+ * into its counts, so that they are exact and the page can be searched
+ * without looking at its children. Readers do this when they come to such
+ * a page, so each change kept pending is folded once, however many reads
+ * follow. The caller holds the page exclusively locked, and does again on
+ * return.
+ *
+ * The children are locked after the page, against the usual order, so a
+ * lock on them is only tried. A child that is locked, maybe by a writer
+ * waiting for the page, is waited for with the page unlocked, and the
+ * page is looked at again.
+ */
+void
+cbt_fold_pending(Relation rel, Buffer buf)
+{
+    Page            page = BufferGetPage(buf);
+    CBTPageOpaque   opaque = CBTPageGetOpaque(page);
+
+    while (!P_IGNORE(opaque) && opaque->cbto_npending > 0)
+    {
+        BlockNumber     child = CBTInternalPending(page)[opaque->cbto_npending - 1];
+        Buffer          cbuf = ReadBuffer(rel, child);
+        CBTPageOpaque   copaque;
+        GenericXLogState *state;
+        Page            xpage;
+        OffsetNumber    off;
+
+        if (!ConditionalLockBuffer(cbuf))
+        {
+            LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+            LockBuffer(cbuf, CBT_WRITE);
+            UnlockReleaseBuffer(cbuf);
+            LockBuffer(buf, CBT_WRITE);
+            continue;
+        }
+
+        /* A child whose downlink was cut away takes its change with it */
+        off = cbt_internal_find_block(page, child, P_FIRSTOFFSET);
+
+        state = GenericXLogStart(rel);
+        xpage = GenericXLogRegisterBuffer(state, buf, 0);
+        copaque = CBTPageGetOpaque(GenericXLogRegisterBuffer(state, cbuf, 0));
+        if (off != InvalidOffsetNumber)
+            CBTInternalGetCount(xpage, off) += copaque->cbto_pending;
+        copaque->cbto_pending = 0;
+        cbt_pending_forget(xpage, child);
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(cbuf);
+    }
+}
+
+/*
+ * Make a new root above the two halves of a split root and point the meta
+ * page to it. The split of the left half in lbuf is marked finished in the
+ * same WAL record. Returns the block number of the new root.
+ */
+static BlockNumber
+cbt_newroot(Relation rel, uint32 level,
+            Buffer lbuf, uint32 lcount,
+            BlockNumber rblkno, uint32 rcount)
+{
+    Buffer          rootbuf;
+    Buffer          metabuf;
+    Page            rootpage;
+    CBTPageOpaque   rootopaque;
+    CBTMetaPageData *metad;
+    BlockNumber     rootblkno;
+    CBTTupleData    downlink;
+    ItemPointerData itemptr;
+    GenericXLogState *state;
+
+    rootbuf = cbt_get_buffer(rel, InvalidBlockNumber, CBT_WRITE);
+    rootblkno = BufferGetBlockNumber(rootbuf);
+    rootpage = BufferGetPage(rootbuf);
+
+    /* The page is not linked into the tree yet, fill it and log all of it */
+    CBTInitPage(rootpage, CBT_ROOT);
+    rootopaque = CBTPageGetOpaque(rootpage);
+    rootopaque->cbto_prev = rootopaque->cbto_next = InvalidBlockNumber;
+    ItemPointerSetInvalid(&rootopaque->cbto_parent);
+    rootopaque->level = level;
+
+    ItemPointerSet(&itemptr, BufferGetBlockNumber(lbuf), P_FIRSTOFFSET);
+    CBTFormTuple(&itemptr, &downlink, lcount);
+    cbt_page_additem(rootpage, P_FIRSTOFFSET, &downlink);
+    ItemPointerSet(&itemptr, rblkno, P_FIRSTOFFSET);
+    CBTFormTuple(&itemptr, &downlink, rcount);
+    cbt_page_additem(rootpage, OffsetNumberNext(P_FIRSTOFFSET), &downlink);
+
+    metabuf = cbt_get_buffer(rel, CBT_METAPAGE, CBT_WRITE);
+
+    state = GenericXLogStart(rel);
+    GenericXLogRegisterBuffer(state, rootbuf, GENERIC_XLOG_FULL_IMAGE);
+    metad = CBTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+    metad->cbtm_root = rootblkno;
+    metad->cbtm_level = level;
+    CBTPageGetOpaque(GenericXLogRegisterBuffer(state, lbuf, 0))->cbto_flags &=
+        ~CBT_INCOMPLETE_SPLIT;
+    GenericXLogFinish(state);
+
+    UnlockReleaseBuffer(metabuf);
+    UnlockReleaseBuffer(rootbuf);
+
+    return rootblkno;
 }
 
 /*
  * Split a page and insert a new tuple into the correct page.
  * Return the Buffer the new tuple is at and update the stack.
+ *
+ * Leaf and internal pages are split alike through the cbt_page_* helpers.
+ * The split happens in two steps, like in nbtree. First the two halves are
+ * written and linked into the level, with CBT_INCOMPLETE_SPLIT set on the
+ * left one; its downlink in the parent still counts both halves, which
+ * readers cope with by moving right (see cbt_search). Then the downlink of
+ * the right half is added to the parent by cbt_insert_parent, with both
+ * halves still locked so that no writer sees the right half without one.
+ * Children moved to the right half keep their parent hint, which stays
+ * correct since cbt_getstackbuf looks for a downlink by moving right.
  */
 Buffer
-cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack)
+cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack,
+               Buffer cbuf)
 {
     Buffer		rbuf;
-    Buffer      parent;
-    Page        parentpage;
     Page		origpage;
     Page		leftpage,
                 rightpage;
     BlockNumber origpagenumber,
-                rightpagenumber,
-                parentblkno;
+                rightpagenumber;
     CBTPageOpaque ropaque,
                 lopaque,
-                oopaque,
-                parentopaque;
+                oopaque;
     Buffer		sbuf = InvalidBuffer;
     Page		spage = NULL;
     CBTPageOpaque sopaque = NULL;
-    Size		itemsz;
-    ItemId		itemid;
-    ItemId      parentitemid;
-    CBTTuple	item;
+    CBTTupleData item;
     OffsetNumber leftoff,
                 rightoff;
     OffsetNumber maxoff;
     OffsetNumber i;
     OffsetNumber firstright;
-    OffsetNumber newitemoff = stack->cbts_offset;
-    OffsetNumber newitemoffonpage = InvalidOffsetNumber;
+    OffsetNumber insertoff = stack->cbts_offset;
+    OffsetNumber newitemoff = InvalidOffsetNumber;
     bool        newitemonleft;
     bool        is_leaf;
-    CBTTuple    parenttuple;
-    CBTTuple    newparenttuple;
-    ItemPointerData ritemptr;
+    bool        is_root;
     uint32      leftcount, rightcount;
+    GenericXLogState *state;
 
     /* Acquire a new page to split into */
     rbuf = cbt_get_buffer(rel, InvalidBlockNumber, CBT_WRITE);
@@ -292,12 +1090,17 @@ cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack)
     origpagenumber = BufferGetBlockNumber(origbuf);
     rightpagenumber = BufferGetBlockNumber(rbuf);
 
+    oopaque = (CBTPageOpaque) PageGetSpecialPointer(origpage);
+    is_leaf = P_ISLEAF(oopaque);
+    is_root = P_ISROOT(oopaque);
+
     /*
-     * The flag here does not matter since we are going
-     * to reset it later.
-     * Right page has already been initialized by cbt_set_buffer.
+     * Both halves are initialized with the flags of the original page, which
+     * decide the layout of the page. If we're splitting this page, it won't
+     * be the root when we're done.
      */
-    CBTInitPage(leftpage, CBT_LEAF);
+    CBTInitPage(leftpage, oopaque->cbto_flags & ~CBT_ROOT);
+    CBTInitPage(rightpage, oopaque->cbto_flags & ~(CBT_ROOT | CBT_INCOMPLETE_SPLIT));
 
     /*
      * Copy the original page's LSN into leftpage, which will become the
@@ -307,17 +1110,13 @@ cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack)
     PageSetLSN(leftpage, PageGetLSN(origpage));
 
     /* init cbtree private data */
-    oopaque = (CBTPageOpaque) PageGetSpecialPointer(origpage);
     lopaque = (CBTPageOpaque) PageGetSpecialPointer(leftpage);
     ropaque = (CBTPageOpaque) PageGetSpecialPointer(rightpage);
 
-    /* if we're splitting this page, it won't be the root when we're done */
-    /* also, clear the SPLIT_END and HAS_GARBAGE flags in both pages */
-    lopaque->cbto_flags = oopaque->cbto_flags;
-    lopaque->cbto_flags &= ~CBT_ROOT;
-    ropaque->cbto_flags = lopaque->cbto_flags;
     /* set flag in left page indicating that the right page has no downlink */
-    //lopaque->cbto_flags |= CBT_INCOMPLETE_SPLIT;
+    lopaque->cbto_flags |= CBT_INCOMPLETE_SPLIT;
+    lopaque->cbto_parent = oopaque->cbto_parent;
+    ropaque->cbto_parent = oopaque->cbto_parent;
     lopaque->cbto_prev = oopaque->cbto_prev;
     lopaque->cbto_next = rightpagenumber;
     ropaque->cbto_prev = origpagenumber;
@@ -325,143 +1124,68 @@ cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack)
     lopaque->level = ropaque->level = oopaque->level;
 
     /*
-     * Now transfer all the data items to the appropriate page.
-     *
-     * Note: we *must* insert at least the right page's items in item-number
-     * order, for the benefit of _bt_restore_page().
+     * Now transfer all the data items, the new one included, to the
+     * appropriate page. Those before firstright go to the left page.
      */
-    //@TODO: handle children's backward pointer when splitting
-    maxoff = PageGetMaxOffsetNumber(origpage);
-    newitemonleft = (newitemoff <= (maxoff / 2));
-    firstright = maxoff / 2 + 1;
-    itemsz = sizeof(CBTTupleData);
-    itemsz = MAXALIGN(itemsz);
+    maxoff = cbt_page_nitems(origpage);
+    firstright = cbt_split_point(rel, origpage, insertoff, newitem);
+    newitemonleft = (insertoff < firstright);
     leftoff = rightoff = P_FIRSTOFFSET;
     leftcount = rightcount = 0;
-    is_leaf = P_ISLEAF(oopaque);
 
-    for (i = P_FIRSTOFFSET; i <= maxoff; i = OffsetNumberNext(i))
+    for (i = P_FIRSTOFFSET; i <= maxoff + 1; i = OffsetNumberNext(i))
     {
-        itemid = PageGetItemId(origpage, i);
-        item = (CBTTuple) PageGetItem(origpage, itemid);
+        Page        page;
+        OffsetNumber off;
 
-        /*
-         * Insert new tuples to the correct page
-         * Updating children backward pointer is not necessary since it will
-         * be done in children's iteration
-         */
-        if (i == newitemoff)
-        {
-            if (newitemonleft)
-            {
-                PageAddItem(leftpage, (Item) newitem, itemsz, leftoff, false, false);
-                newitemoff = leftoff;
-                leftoff = OffsetNumberNext(leftoff);
-                leftcount += newitem->childcnt;
-            }
-            else
-            {
-                PageAddItem(rightpage, (Item) newitem, itemsz, rightoff, false, false);
-                newitemoff = rightoff;
-                rightoff = OffsetNumberNext(rightoff);
-                rightcount += newitem->childcnt;
-            }
-        }
+        if (i == insertoff)
+            item = *newitem;
+        else
+            cbt_page_getitem(origpage, (i < insertoff) ? i : i - 1, &item);
+
+        /* The downlink of a split child gives up what its right half has */
+        if (BufferIsValid(cbuf) && i == insertoff - 1)
+            item.childcnt -= newitem->childcnt;
 
         /* decide which page to put it on */
         if (i < firstright)
         {
-            PageAddItem(leftpage, (Item) item, itemsz, leftoff, false, false);
-            /* Change the backward pointer in children's page */
-            if (!is_leaf)
-                cbt_change_children(rel, &item->itemptr, origpagenumber, leftoff);
+            page = leftpage;
+            off = leftoff;
             leftoff = OffsetNumberNext(leftoff);
-            leftcount += item->childcnt;
+            leftcount += item.childcnt;
         }
         else
         {
-            PageAddItem(rightpage, (Item) item, itemsz, rightoff, false, false);
-            /* Change the backward pointer in children's page */
-            if (!is_leaf)
-                cbt_change_children(rel, &item->itemptr, rightpagenumber, rightoff);
+            page = rightpage;
+            off = rightoff;
             rightoff = OffsetNumberNext(rightoff);
-            rightcount += item->childcnt;
+            rightcount += item.childcnt;
         }
-    }
 
-    /* cope with possibility that newitem goes at the end */
-    if (i <= newitemoff)
-    {
-        /*
-         * Can't have newitemonleft here; that would imply we were told to put
-         * *everything* on the left page, which cannot fit (if it could, we'd
-         * not be splitting the page).
-         */
-        PageAddItem(rightpage, (Item) newitem, itemsz, rightoff, false, false);
-        newitemoff = rightoff;
-        rightoff = OffsetNumberNext(rightoff);
-        rightcount += item->childcnt;
-    }
-
-    /* now update the parent tuple */
-    if (stack->cbts_parent == NULL)
-    {
-        Buffer              metabuf;
-        Page                metapg;
-        CBTMetaPageData     *metad;
-        ItemPointerData     litemptr;
+        if (!cbt_page_additem(page, off, &item))
+        {
+            memset(rightpage, 0, BufferGetPageSize(rbuf));
+            elog(ERROR, "failed to add item to the index page");
+        }
 
-        /* If the current page is the original root,
-         * then build a new root and update the meta page
-         */
-        metabuf = cbt_get_buffer(rel, CBT_METAPAGE, CBT_WRITE);
-        metapg = BufferGetPage(metabuf);
-        metad = CBTPageGetMeta(metapg);
-
-        parent = cbt_get_buffer(rel, InvalidBlockNumber, CBT_WRITE);
-        parentblkno = BufferGetBlockNumber(parent);
-        parentopaque = (CBTPageOpaque) PageGetSpecialPointer(BufferGetPage(parent));
-        parentopaque->cbto_prev = parentopaque->cbto_next = InvalidBlockNumber;
-        parentopaque->cbto_flags = CBT_ROOT;
-        parentopaque->level = oopaque->level + 1;
-
-        START_CRIT_SECTION();
-
-        metad->cbtm_root = parentblkno;
-        metad->cbtm_level = parentopaque->level;
-
-        MarkBufferDirty(parent);
-        MarkBufferDirty(metabuf);
-
-        END_CRIT_SECTION();
-        UnlockReleaseBuffer(metabuf);
-
-        /* Insert the left page into the new root */
-        parenttuple = (CBTTuple) palloc(sizeof(CBTTupleData));
-        ItemPointerSet(&litemptr, origpagenumber, P_FIRSTOFFSET);
-        CBTFormTuple(&litemptr, parenttuple, (uint32)leftcount);
-        stack->cbts_parent = palloc(sizeof(CBTStackData));
-        stack->cbts_parent->cbts_offset = P_FIRSTOFFSET;
-        stack->cbts_parent->cbts_blkno = parentblkno;
-        stack->cbts_parent->cbts_parent = NULL;
-        cbt_insert_on_page(rel, stack->cbts_parent, parenttuple, &parent);
-        ItemPointerSet(&oopaque->cbto_parent, parentblkno, P_FIRSTOFFSET);
+        if (i == insertoff)
+            newitemoff = off;
     }
-    else
-    {
-        parent = cbt_get_buffer(rel, stack->cbts_parent->cbts_blkno, CBT_WRITE);
-        parentpage = BufferGetPage(parent);
-        parentitemid = PageGetItemId(parentpage, stack->cbts_parent->cbts_offset);
-        parenttuple = (CBTTuple) PageGetItem(parentpage, parentitemid);
-        parenttuple->childcnt = (uint32) leftcount;
-    }
-    newparenttuple = palloc(sizeof(CBTTupleData));
-    ItemPointerSet(&ritemptr, BufferGetBlockNumber(rbuf), P_FIRSTOFFSET);
-    CBTFormTuple(&ritemptr, newparenttuple, (uint32) rightcount);
-    stack->cbts_parent->cbts_offset++;
-    cbt_insert_on_page(rel, stack->cbts_parent, newparenttuple, &parent);
-    ItemPointerSet(&ropaque->cbto_parent, stack->cbts_parent->cbts_blkno, stack->cbts_parent->cbts_offset);
-    UnlockReleaseBuffer(parent);
+
+    /*
+     * The left half keeps the pending change of the page, which is relative
+     * to the downlink it keeps. The children keeping a change pending go on
+     * the list of the half their downlink went to; they can't start or stop
+     * doing so while the page is locked. The incomplete count stays on the
+     * left half as well, along with a new tuple of a leaf.
+     */
+    lopaque->cbto_pending = oopaque->cbto_pending;
+    lopaque->cbto_incomplete = oopaque->cbto_incomplete;
+    if (is_leaf && !is_root)
+        lopaque->cbto_incomplete += newitem->childcnt;
+    if (!is_leaf && oopaque->cbto_npending > 0)
+        cbt_pending_divide(origpage, leftpage, rightpage);
 
     /*
      * We have to grab the right sibling (if any) and fix the prev pointer
@@ -484,83 +1208,42 @@ cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack)
                  oopaque->cbto_next, sopaque->cbto_prev, origpagenumber,
                  RelationGetRelationName(rel));
         }
-
-        /*
-         * Check to see if we can set the SPLIT_END flag in the right-hand
-         * split page; this can save some I/O for vacuum since it need not
-         * proceed to the right sibling.  We can set the flag if the right
-         * sibling has a different cycleid: that means it could not be part of
-         * a group of pages that were all split off from the same ancestor
-         * page.  If you're confused, imagine that page A splits to A B and
-         * then again, yielding A C B, while vacuum is in progress.  Tuples
-         * originally in A could now be in either B or C, hence vacuum must
-         * examine both pages.  But if D, our right sibling, has a different
-         * cycleid then it could not contain any tuples that were in A when
-         * the vacuum started.
-         *
-         * if (sopaque->btpo_cycleid != ropaque->btpo_cycleid)
-         *   ropaque->btpo_flags |= BTP_SPLIT_END;
-         */
     }
 
     /*
      * Right sibling is locked, new siblings are prepared, but original page
      * is not updated yet.
      *
-     * NO EREPORT(ERROR) till right sibling is updated.  We can get away with
-     * not starting the critical section till here because we haven't been
-     * scribbling on the original page yet; see comments above.
-     */
-    START_CRIT_SECTION();
-
-    /*
      * By here, the original data page has been split into two new halves, and
      * these are correct.  The algorithm requires that the left page never
      * move during a split, so we copy the new left page back on top of the
-     * original.  Note that this is not a waste of time, since we also require
-     * (in the page management code) that the center of a page always be
-     * clean, and the most efficient way to guarantee this is just to compact
-     * the data by reinserting it into a new left page.  (XXX the latter
-     * comment is probably obsolete; but in any case it's good to not scribble
-     * on the original page until we enter the critical section.)
-     *
-     * We need to do this before writing the WAL record, so that XLogInsert
-     * can WAL log an image of the page if necessary.
+     * original. The pages go into one WAL record; the right half is new and
+     * logged whole, the others as deltas. That includes the child whose
+     * split the new downlink finishes, if there is one.
      */
-    PageRestoreTempPage(leftpage, origpage);
-    /* leftpage, lopaque must not be used below here */
-
-    MarkBufferDirty(origbuf);
-    MarkBufferDirty(rbuf);
-
+    state = GenericXLogStart(rel);
+    memcpy(GenericXLogRegisterBuffer(state, origbuf, 0), leftpage, BLCKSZ);
+    GenericXLogRegisterBuffer(state, rbuf, GENERIC_XLOG_FULL_IMAGE);
     if (!P_RIGHTMOST(ropaque))
-    {
-        sopaque->cbto_prev = rightpagenumber;
-        MarkBufferDirty(sbuf);
-    }
-
-    /*
-     * Clear INCOMPLETE_SPLIT flag on child if inserting the new item finishes
-     * a split.
-     */
-    //if (!isleaf)
-    //{
-        //Page		cpage = BufferGetPage(cbuf);
-        //CBTPageOpaque cpageop = (CBTPageOpaque) PageGetSpecialPointer(cpage);
-
-        //cpageop->cbto_flags &= ~CBT_INCOMPLETE_SPLIT;
-        //MarkBufferDirty(cbuf);
-    //}
-
-    END_CRIT_SECTION();
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, sbuf, 0))->cbto_prev =
+            rightpagenumber;
+    if (BufferIsValid(cbuf))
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, cbuf, 0))->cbto_flags &=
+            ~CBT_INCOMPLETE_SPLIT;
+    GenericXLogFinish(state);
+    pfree(leftpage);
+    /* leftpage, lopaque and oopaque must not be used below here */
 
     /* release the old right sibling */
     if (!P_RIGHTMOST(ropaque))
         UnlockReleaseBuffer(sbuf);
 
-    /* release the child */
-    //if (!isleaf)
-       // UnlockReleaseBuffer(cbuf);
+    /* Tell the parent about the right half, or make a new root */
+    cbt_insert_parent(rel, origbuf, rbuf, stack->cbts_parent,
+                      leftcount, rightcount, is_root);
+
+    if (is_leaf)
+        cbt_update_meta(rel, 1);
 
     if (newitemonleft)
     {
@@ -578,6 +1261,188 @@ cbt_split_page(Relation rel, Buffer origbuf, CBTTuple newitem, CBTStack stack)
     }
 }
 
+/*
+ * Second step of a split: add the downlink of the right half in rbuf to
+ * the parent of the left half in lbuf, or build a new root above them if
+ * the left half was the root, and clear the split marker. pstack is the
+ * parent's stack entry, or NULL to go through the parent hint. The
+ * downlink of the left half still counts both halves, so it loses rcount.
+ * lcount and rcount are the page totals, rcount including the pages after
+ * the right half that have no downlink yet either; the changes their
+ * children keep pending are added here, as the new downlinks have to count
+ * them. Both halves stay locked.
+ */
+static void
+cbt_insert_parent(Relation rel, Buffer lbuf, Buffer rbuf, CBTStack pstack,
+                  uint32 lcount, uint32 rcount, bool is_root)
+{
+    CBTPageOpaque   lopaque = CBTPageGetOpaque(BufferGetPage(lbuf));
+    CBTPageOpaque   ropaque = CBTPageGetOpaque(BufferGetPage(rbuf));
+    BlockNumber     lblkno = BufferGetBlockNumber(lbuf);
+    BlockNumber     rblkno = BufferGetBlockNumber(rbuf);
+    ItemPointerData lparent;
+    ItemPointerData rparent;
+    int64           lpending = 0;
+    int64           rpending = 0;
+    GenericXLogState *state;
+
+    if (lopaque->cbto_npending > 0)
+        lpending = cbt_pending_sum(rel, BufferGetPage(lbuf));
+    if (ropaque->cbto_npending > 0)
+        rpending = cbt_pending_sum(rel, BufferGetPage(rbuf));
+    lcount += lpending;
+    rcount += rpending;
+
+    if (is_root)
+    {
+        BlockNumber rootblkno;
+
+        rootblkno = cbt_newroot(rel, lopaque->level + 1,
+                                lbuf, lcount, rblkno, rcount);
+        ItemPointerSet(&lparent, rootblkno, P_FIRSTOFFSET);
+        ItemPointerSet(&rparent, rootblkno, OffsetNumberNext(P_FIRSTOFFSET));
+    }
+    else
+    {
+        CBTStackData    hint;
+        CBTTupleData    downlink;
+        ItemPointerData ritemptr;
+        Buffer          parent = InvalidBuffer;
+
+        if (pstack == NULL && ItemPointerIsValid(&lopaque->cbto_parent))
+        {
+            /* The root was split since the descent, go through the hint */
+            hint.cbts_blkno = ItemPointerGetBlockNumber(&lopaque->cbto_parent);
+            hint.cbts_offset = ItemPointerGetOffsetNumber(&lopaque->cbto_parent);
+            hint.total_count = 0;
+            hint.cbts_parent = NULL;
+            pstack = &hint;
+        }
+
+        if (pstack != NULL)
+            parent = cbt_getstackbuf(rel, pstack, lblkno);
+        if (!BufferIsValid(parent))
+            elog(ERROR, "failed to re-find parent of block %u in index \"%s\"",
+                 lblkno, RelationGetRelationName(rel));
+
+        /* The left half keeps the old downlink, the right one goes after it */
+        ItemPointerSet(&lparent, pstack->cbts_blkno, pstack->cbts_offset);
+        ItemPointerSet(&ritemptr, rblkno, P_FIRSTOFFSET);
+        CBTFormTuple(&ritemptr, &downlink, rcount);
+        pstack->cbts_offset++;
+        cbt_insert_on_page(rel, pstack, &downlink, &parent, lbuf);
+        ItemPointerSet(&rparent, pstack->cbts_blkno, pstack->cbts_offset);
+        UnlockReleaseBuffer(parent);
+    }
+
+    /* The split is finished by now, only the parent hints are left */
+    state = GenericXLogStart(rel);
+    CBTPageGetOpaque(GenericXLogRegisterBuffer(state, lbuf, 0))->cbto_parent = lparent;
+    CBTPageGetOpaque(GenericXLogRegisterBuffer(state, rbuf, 0))->cbto_parent = rparent;
+    GenericXLogFinish(state);
+}
+
+/*
+ * Finish the split of the page in lbuf, whose right half never got a
+ * downlink because the backend doing the split failed in between. lbuf
+ * is released. The right half may be the first of a chain left by a
+ * splice (see cbt_splice_leaf); its downlink then counts the rest of the
+ * chain too, which is kept share-locked meanwhile so that it can't change.
+ */
+static void
+cbt_finish_split(Relation rel, Buffer lbuf, CBTStack pstack)
+{
+    Page            lpage = BufferGetPage(lbuf);
+    CBTPageOpaque   lopaque = CBTPageGetOpaque(lpage);
+    Buffer          rbuf;
+    Buffer          chain[CBT_SPLICE_MAX_PAGES];
+    int             nchain = 0;
+    CBTPageOpaque   copaque;
+    CBTMetaPageData metad;
+    uint32          rcount;
+    bool            is_root;
+
+    Assert(P_INCOMPLETE_SPLIT(lopaque));
+
+    /* A left half without a parent was the root if the meta page says so */
+    is_root = cbt_getmeta(rel, &metad) &&
+              metad.cbtm_root == BufferGetBlockNumber(lbuf);
+
+    rbuf = cbt_get_buffer(rel, lopaque->cbto_next, CBT_WRITE);
+    rcount = cbt_page_total(BufferGetPage(rbuf));
+
+    copaque = CBTPageGetOpaque(BufferGetPage(rbuf));
+    while (P_INCOMPLETE_SPLIT(copaque))
+    {
+        if (nchain >= CBT_SPLICE_MAX_PAGES)
+            elog(ERROR, "unfinished split of block %u in index \"%s\" spans too many pages",
+                 BufferGetBlockNumber(lbuf), RelationGetRelationName(rel));
+        chain[nchain] = cbt_get_buffer(rel, copaque->cbto_next, CBT_READ);
+        rcount += cbt_page_total(BufferGetPage(chain[nchain]));
+        copaque = CBTPageGetOpaque(BufferGetPage(chain[nchain++]));
+    }
+
+    cbt_insert_parent(rel, lbuf, rbuf, pstack, cbt_page_total(lpage),
+                      rcount, is_root);
+
+    while (nchain > 0)
+        UnlockReleaseBuffer(chain[--nchain]);
+    UnlockReleaseBuffer(rbuf);
+    UnlockReleaseBuffer(lbuf);
+}
+
+/*
+ * Choose where the full page is split when newitem goes in at insertoff,
+ * following the split_policy of the index. Returns the offset, counting
+ * the new item, of the first item of the right half. A leaf split off the
+ * middle is moved towards it as far as needed for both halves to fit.
+ */
+static OffsetNumber
+cbt_split_point(Relation rel, Page page, OffsetNumber insertoff, CBTTuple newitem)
+{
+    CBTSplitPolicy  policy = CBTGetSplitPolicy(rel);
+    bool            leaf = P_ISLEAF(CBTPageGetOpaque(page));
+    int             nitems = CBTPageGetNItems(page) + 1;
+    int             half = nitems / 2;
+    int             fillfactor;
+    int             nleft;
+
+    fillfactor = leaf ? CBTGetFillFactor(rel) : CBTGetNonLeafFillFactor(rel);
+
+    if ((policy == CBT_SPLIT_APPEND || policy == CBT_SPLIT_ADAPTIVE) &&
+        insertoff == nitems)
+        nleft = nitems * fillfactor / 100;
+    else if ((policy == CBT_SPLIT_PREPEND || policy == CBT_SPLIT_ADAPTIVE) &&
+             insertoff == P_FIRSTOFFSET)
+        nleft = nitems - nitems * fillfactor / 100;
+    else
+        nleft = half;
+    nleft = Max(1, Min(nleft, nitems - 1));
+
+    /*
+     * Half of a full leaf always fits. More may not, if the entries of the
+     * bigger half can't be stored narrowly.
+     */
+    if (leaf && nleft != half)
+    {
+        ItemPointer tids = (ItemPointer) palloc(nitems * sizeof(ItemPointerData));
+
+        cbt_leaf_gettids(page, P_FIRSTOFFSET, insertoff - P_FIRSTOFFSET, tids);
+        tids[insertoff - P_FIRSTOFFSET] = newitem->itemptr;
+        cbt_leaf_gettids(page, insertoff, nitems - insertoff,
+                         tids + insertoff - P_FIRSTOFFSET + 1);
+
+        while (nleft != half &&
+               !(cbt_leaf_fits(tids, nleft) &&
+                 cbt_leaf_fits(tids + nleft, nitems - nleft)))
+            nleft += (nleft < half) ? Min(16, half - nleft) : -Min(16, nleft - half);
+
+        pfree(tids);
+    }
+
+    return (OffsetNumber) (nleft + P_FIRSTOFFSET);
+}
+
 /*
  * Get a buffer of on the specified page. If blkno is not valid,
  * then request a new buffer if access is CBT_WRITE.
@@ -596,9 +1461,33 @@ cbt_get_buffer(Relation rel, BlockNumber blkno, int access)
     {
         bool        needLock;
         Page        page;
+        int         nextra;
+        int         i;
 
         Assert(access == CBT_WRITE);
 
+        /* Take a page recycled by vacuum, or left over by an extension */
+        buf = cbt_get_free_buffer(rel);
+        if (BufferIsValid(buf))
+            return buf;
+
+        /*
+         * Extend the relation. Another backend could be doing the same, so
+         * if we have to wait for the lock, the pages it added are looked
+         * for first.
+         */
+        needLock = !RELATION_IS_LOCAL(rel);
+        if (needLock && !ConditionalLockRelationForExtension(rel, ExclusiveLock))
+        {
+            LockRelationForExtension(rel, ExclusiveLock);
+            buf = cbt_get_free_buffer(rel);
+            if (BufferIsValid(buf))
+            {
+                UnlockRelationForExtension(rel, ExclusiveLock);
+                return buf;
+            }
+        }
+
         buf = ReadBuffer(rel, P_NEW);
 
         /* Acquire buffer lock on new page */
@@ -608,8 +1497,63 @@ cbt_get_buffer(Relation rel, BlockNumber blkno, int access)
         page = BufferGetPage(buf);
         Assert(PageIsNew(page));
         CBTInitPage(page, CBT_LEAF);
+
+        /*
+         * Add more pages while we hold the lock, so that a burst of splits
+         * doesn't queue on it page by page. They stay all zero until taken.
+         */
+        if (needLock)
+        {
+            nextra = CBT_EXTEND_PAGES - 1 +
+                CBT_EXTEND_PER_WAITER * RelationExtensionLockWaiterCount(rel);
+            nextra = Min(nextra, CBT_EXTEND_MAX_PAGES);
+            for (i = 0; i < nextra; i++)
+            {
+                Buffer      extrabuf = ReadBuffer(rel, P_NEW);
+
+                RecordFreeIndexPage(rel, BufferGetBlockNumber(extrabuf));
+                ReleaseBuffer(extrabuf);
+            }
+
+            UnlockRelationForExtension(rel, ExclusiveLock);
+
+            /* Make the new pages visible to searches of the free space map */
+            if (nextra > 0)
+                IndexFreeSpaceMapVacuum(rel);
+        }
     }
 
     /* ref count and lock type are correct */
     return buf;
 }
+
+/*
+ * Get a free page from the free space map, write-locked and initialized as
+ * a leaf. The map is only a hint, so a page someone else took in between
+ * is passed over. Returns InvalidBuffer if there is none.
+ */
+static Buffer
+cbt_get_free_buffer(Relation rel)
+{
+    BlockNumber blkno;
+    Buffer      buf;
+
+    while ((blkno = GetFreeIndexPage(rel)) != InvalidBlockNumber)
+    {
+        buf = ReadBuffer(rel, blkno);
+        if (ConditionalLockBuffer(buf))
+        {
+            Page        page = BufferGetPage(buf);
+
+            if (cbt_page_recyclable(page))
+            {
+                CBTInitPage(page, CBT_LEAF);
+                return buf;
+            }
+            LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+        }
+        ReleaseBuffer(buf);
+    }
+
+    return InvalidBuffer;
+}
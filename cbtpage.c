@@ -0,0 +1,625 @@
+/*--------------------------------------------------------
+ *
+ * cbtpage.c
+ *		Page layout helpers of a counted btree.
+ *
+ * Neither kind of page uses line pointers. Leaf pages hold an array of
+ * delta-encoded heap TIDs (see CBTLeafHeaderData), so an item is found
+ * by its position alone. Internal pages keep the subtree counts and the
+ * downlinks in two parallel arrays (see CBT_INTERNAL_CAPACITY), so that
+ * the descent can sum the counts a vector register at a time.
+ *
+ * IDENTIFICATION
+ *		contrib/cbtree/cbtpage.c
+ *
+ *--------------------------------------------------------
+ */
+
+#include "postgres.h"
+
+#include "cbtree.h"
+#include "access/transam.h"
+#include "storage/bufpage.h"
+#include "utils/snapmgr.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CBT_BLOCK_WIDTH		8
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define CBT_BLOCK_WIDTH		4
+#else
+#define CBT_BLOCK_WIDTH		1
+#endif
+
+static inline uint32 cbt_block_sum(const uint32 *counts);
+static bool cbt_leaf_encode(Page page, ItemPointer tid, uint32 *entry);
+static Size cbt_leaf_needed(Page page, ItemPointer tid);
+static void cbt_leaf_widen(Page page);
+static bool cbt_leaf_additem(Page page, OffsetNumber off, ItemPointer tid);
+
+
+/*
+ * Sum CBT_BLOCK_WIDTH consecutive counts.
+ */
+static inline uint32
+cbt_block_sum(const uint32 *counts)
+{
+#if defined(__AVX2__)
+    __m256i     v = _mm256_loadu_si256((const __m256i *) counts);
+    __m128i     s = _mm_add_epi32(_mm256_castsi256_si128(v),
+                                  _mm256_extracti128_si256(v, 1));
+
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32) _mm_cvtsi128_si32(s);
+#elif defined(__SSE2__)
+    __m128i     s = _mm_loadu_si128((const __m128i *) counts);
+
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32) _mm_cvtsi128_si32(s);
+#else
+    return counts[0];
+#endif
+}
+
+/*
+ * Sum of the counts in the first nslots slots of an internal page.
+ */
+uint32
+cbt_internal_prefix(Page page, OffsetNumber nslots)
+{
+    const uint32 *counts = CBTInternalCounts(page);
+    uint32      sum = 0;
+    int         i = 0;
+
+    Assert(nslots <= CBTPageGetNItems(page));
+
+    for (; i + CBT_BLOCK_WIDTH <= nslots; i += CBT_BLOCK_WIDTH)
+        sum += cbt_block_sum(counts + i);
+    for (; i < nslots; i++)
+        sum += counts[i];
+
+    return sum;
+}
+
+/*
+ * Find the slot of an internal page whose subtree holds the target-th
+ * tuple below the page, counting from 1. Whole blocks of counts are
+ * skipped while the running sum stays below the target, the block that
+ * reaches it is walked one slot at a time. The number of tuples to the
+ * left of the slot is returned in leftcount. Returns InvalidOffsetNumber
+ * if the page holds fewer tuples than target, leftcount is then the total.
+ */
+OffsetNumber
+cbt_internal_search(Page page, uint32 target, uint32 *leftcount)
+{
+    const uint32 *counts = CBTInternalCounts(page);
+    int         nitems = CBTPageGetNItems(page);
+    uint32      left = 0;
+    int         i = 0;
+
+    Assert(target > 0);
+
+    for (; i + CBT_BLOCK_WIDTH <= nitems; i += CBT_BLOCK_WIDTH)
+    {
+        uint32      sum = cbt_block_sum(counts + i);
+
+        if (left + sum >= target)
+            break;
+        left += sum;
+    }
+
+    for (; i < nitems; i++)
+    {
+        if (left + counts[i] >= target)
+        {
+            *leftcount = left;
+            return (OffsetNumber) (i + P_FIRSTOFFSET);
+        }
+        left += counts[i];
+    }
+
+    *leftcount = left;
+    return InvalidOffsetNumber;
+}
+
+/*
+ * Find the slot of the downlink to blkno on an internal page. The slot
+ * in hint is tried first, then the slots to its right and finally the
+ * ones to its left. Returns InvalidOffsetNumber if there is no such
+ * downlink on the page.
+ */
+OffsetNumber
+cbt_internal_find_block(Page page, BlockNumber blkno, OffsetNumber hint)
+{
+    const BlockNumber *blocks = CBTInternalBlocks(page);
+    int         nitems = CBTPageGetNItems(page);
+    int         start;
+    int         i;
+
+    start = (hint >= P_FIRSTOFFSET && hint <= nitems) ? hint - P_FIRSTOFFSET : 0;
+
+    for (i = start; i < nitems; i++)
+    {
+        if (blocks[i] == blkno)
+            return (OffsetNumber) (i + P_FIRSTOFFSET);
+    }
+    for (i = start - 1; i >= 0; i--)
+    {
+        if (blocks[i] == blkno)
+            return (OffsetNumber) (i + P_FIRSTOFFSET);
+    }
+
+    return InvalidOffsetNumber;
+}
+
+/*
+ * Encode tid as a narrow entry of the leaf. Returns false if it is too
+ * far from the base block of the page.
+ */
+static bool
+cbt_leaf_encode(Page page, ItemPointer tid, uint32 *entry)
+{
+    int64       delta;
+    OffsetNumber offnum = ItemPointerGetOffsetNumber(tid);
+
+    delta = (int64) ItemPointerGetBlockNumber(tid) -
+            (int64) CBTLeafGetHeader(page)->cbtl_base;
+    if (delta < -CBT_LEAF_DELTA_BIAS || delta >= CBT_LEAF_DELTA_BIAS ||
+        offnum > CBT_LEAF_OFFSET_MASK)
+        return false;
+
+    *entry = ((uint32) (delta + CBT_LEAF_DELTA_BIAS) << CBT_LEAF_OFFSET_BITS) |
+             (uint32) offnum;
+    return true;
+}
+
+/*
+ * Do the ntids heap TIDs, in this order, fit on an empty leaf?
+ */
+bool
+cbt_leaf_fits(ItemPointer tids, int ntids)
+{
+    Size        space = BLCKSZ - MAXALIGN(SizeOfPageHeaderData) -
+                        sizeof(CBTLeafHeaderData) - MAXALIGN(sizeof(CBTPageOpaqueData));
+    int64       base;
+    int         i;
+
+    if (ntids * sizeof(ItemPointerData) <= space)
+        return true;
+    if (ntids * sizeof(uint32) > space)
+        return false;
+
+    /* The first TID is the base, see cbt_leaf_additem */
+    base = ItemPointerGetBlockNumber(&tids[0]);
+    for (i = 0; i < ntids; i++)
+    {
+        int64       delta = (int64) ItemPointerGetBlockNumber(&tids[i]) - base;
+
+        if (delta < -CBT_LEAF_DELTA_BIAS || delta >= CBT_LEAF_DELTA_BIAS ||
+            ItemPointerGetOffsetNumber(&tids[i]) > CBT_LEAF_OFFSET_MASK)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Free space a leaf needs to take tid, including the conversion of its
+ * entries to the wide format if tid can't be encoded narrowly.
+ */
+static Size
+cbt_leaf_needed(Page page, ItemPointer tid)
+{
+    int         nitems = CBTPageGetNItems(page);
+    uint32      entry;
+
+    /* An empty page starts over with tid as its base */
+    if (nitems == 0)
+        return sizeof(uint32);
+
+    if (CBTLeafIsWide(page))
+        return sizeof(ItemPointerData);
+
+    if (cbt_leaf_encode(page, tid, &entry))
+        return sizeof(uint32);
+
+    return (nitems + 1) * sizeof(ItemPointerData) - nitems * sizeof(uint32);
+}
+
+/*
+ * Rewrite the narrow entries of a leaf as ItemPointerData. Working from
+ * the last entry backwards never overwrites an entry not converted yet.
+ */
+static void
+cbt_leaf_widen(Page page)
+{
+    char       *entries = CBTLeafGetEntries(page);
+    int         nitems = CBTPageGetNItems(page);
+    int         i;
+
+    for (i = nitems - 1; i >= 0; i--)
+    {
+        ItemPointerData tid;
+
+        cbt_leaf_gettids(page, (OffsetNumber) (i + P_FIRSTOFFSET), 1, &tid);
+        memcpy(entries + i * sizeof(ItemPointerData), &tid, sizeof(ItemPointerData));
+    }
+
+    CBTLeafGetHeader(page)->cbtl_flags |= CBTL_WIDE;
+    ((PageHeader) page)->pd_lower += nitems * (sizeof(ItemPointerData) - sizeof(uint32));
+}
+
+/*
+ * Insert tid at off of a leaf. Returns false if the page is full.
+ */
+static bool
+cbt_leaf_additem(Page page, OffsetNumber off, ItemPointer tid)
+{
+    CBTLeafHeaderData *lhdr = CBTLeafGetHeader(page);
+    int         nitems = CBTPageGetNItems(page);
+    int         idx = off - P_FIRSTOFFSET;
+    char       *entries;
+    Size        esize;
+    uint32      entry = 0;
+
+    Assert(idx >= 0 && idx <= nitems);
+
+    if (CBTPageGetFreeSpace(page) < cbt_leaf_needed(page, tid))
+        return false;
+
+    if (nitems == 0)
+    {
+        lhdr->cbtl_base = ItemPointerGetBlockNumber(tid);
+        lhdr->cbtl_flags &= ~CBTL_WIDE;
+    }
+
+    if (!CBTLeafIsWide(page) && !cbt_leaf_encode(page, tid, &entry))
+        cbt_leaf_widen(page);
+
+    esize = CBTLeafEntrySize(page);
+    entries = CBTLeafGetEntries(page);
+    memmove(entries + (idx + 1) * esize, entries + idx * esize,
+            (nitems - idx) * esize);
+    if (CBTLeafIsWide(page))
+        memcpy(entries + idx * esize, tid, esize);
+    else
+        memcpy(entries + idx * esize, &entry, esize);
+
+    ((PageHeader) page)->pd_lower += esize;
+    CBTPageGetNItems(page) = nitems + 1;
+
+    return true;
+}
+
+/*
+ * Decode n heap TIDs of a leaf, starting from the item at off, into tids.
+ */
+void
+cbt_leaf_gettids(Page page, OffsetNumber off, int n, ItemPointer tids)
+{
+    const char *entries = CBTLeafGetEntries(page);
+    int         idx = off - P_FIRSTOFFSET;
+    const uint32 *narrow;
+    BlockNumber base;
+    int         i;
+
+    Assert(idx >= 0 && idx + n <= CBTPageGetNItems(page));
+
+    if (CBTLeafIsWide(page))
+    {
+        memcpy(tids, entries + idx * sizeof(ItemPointerData),
+               n * sizeof(ItemPointerData));
+        return;
+    }
+
+    /* Unsigned wraparound takes the bias back out */
+    narrow = (const uint32 *) entries + idx;
+    base = CBTLeafGetHeader(page)->cbtl_base - CBT_LEAF_DELTA_BIAS;
+    for (i = 0; i < n; i++)
+        ItemPointerSet(&tids[i], base + (narrow[i] >> CBT_LEAF_OFFSET_BITS),
+                       (OffsetNumber) (narrow[i] & CBT_LEAF_OFFSET_MASK));
+}
+
+/*
+ * Number of items on a page.
+ */
+OffsetNumber
+cbt_page_nitems(Page page)
+{
+    return CBTPageGetNItems(page);
+}
+
+/*
+ * Copy the item at off into itup. A leaf item is returned with a count
+ * of 1, the downlink of an internal page as a tuple pointing to the first
+ * offset of the child.
+ */
+void
+cbt_page_getitem(Page page, OffsetNumber off, CBTTuple itup)
+{
+    if (P_ISLEAF(CBTPageGetOpaque(page)))
+    {
+        cbt_leaf_gettids(page, off, 1, &itup->itemptr);
+        itup->childcnt = 1;
+        return;
+    }
+
+    Assert(off >= P_FIRSTOFFSET && off <= CBTPageGetNItems(page));
+    ItemPointerSet(&itup->itemptr, CBTInternalGetBlock(page, off), P_FIRSTOFFSET);
+    itup->childcnt = CBTInternalGetCount(page, off);
+}
+
+/*
+ * Can itup be added to the page?
+ */
+bool
+cbt_page_hasroom(Page page, CBTTuple itup)
+{
+    if (P_ISLEAF(CBTPageGetOpaque(page)))
+        return CBTPageGetFreeSpace(page) >= cbt_leaf_needed(page, &itup->itemptr);
+
+    return CBTPageGetNItems(page) < CBT_INTERNAL_CAPACITY;
+}
+
+/*
+ * Insert itup at off, moving the items from off on one slot to the right.
+ * Returns false if the page is full.
+ */
+bool
+cbt_page_additem(Page page, OffsetNumber off, CBTTuple itup)
+{
+    uint32     *counts;
+    BlockNumber *blocks;
+    int         nitems;
+    int         idx;
+
+    if (P_ISLEAF(CBTPageGetOpaque(page)))
+        return cbt_leaf_additem(page, off, &itup->itemptr);
+
+    nitems = CBTPageGetNItems(page);
+    if (nitems >= CBT_INTERNAL_CAPACITY)
+        return false;
+
+    Assert(off >= P_FIRSTOFFSET && off <= nitems + 1);
+    counts = CBTInternalCounts(page);
+    blocks = CBTInternalBlocks(page);
+    idx = off - P_FIRSTOFFSET;
+
+    memmove(counts + idx + 1, counts + idx, (nitems - idx) * sizeof(uint32));
+    memmove(blocks + idx + 1, blocks + idx, (nitems - idx) * sizeof(BlockNumber));
+    counts[idx] = itup->childcnt;
+    blocks[idx] = ItemPointerGetBlockNumber(&itup->itemptr);
+    CBTPageGetNItems(page) = nitems + 1;
+
+    return true;
+}
+
+/*
+ * Remove the item at off, closing the gap.
+ */
+void
+cbt_page_delitem(Page page, OffsetNumber off)
+{
+    cbt_page_delitems(page, off, 1);
+}
+
+/*
+ * Remove the n items from off on, closing the gap with a single move.
+ */
+void
+cbt_page_delitems(Page page, OffsetNumber off, int n)
+{
+    uint32     *counts;
+    BlockNumber *blocks;
+    int         nitems = CBTPageGetNItems(page);
+    int         idx = off - P_FIRSTOFFSET;
+
+    Assert(off >= P_FIRSTOFFSET && n >= 0 && idx + n <= nitems);
+
+    if (P_ISLEAF(CBTPageGetOpaque(page)))
+    {
+        char       *entries = CBTLeafGetEntries(page);
+        Size        esize = CBTLeafEntrySize(page);
+
+        memmove(entries + idx * esize, entries + (idx + n) * esize,
+                (nitems - idx - n) * esize);
+        ((PageHeader) page)->pd_lower -= n * esize;
+        CBTPageGetNItems(page) = nitems - n;
+        return;
+    }
+
+    counts = CBTInternalCounts(page);
+    blocks = CBTInternalBlocks(page);
+
+    memmove(counts + idx, counts + idx + n, (nitems - idx - n) * sizeof(uint32));
+    memmove(blocks + idx, blocks + idx + n, (nitems - idx - n) * sizeof(BlockNumber));
+    CBTPageGetNItems(page) = nitems - n;
+}
+
+/*
+ * Remove the n items at the offsets in offnums, which are in increasing
+ * order. The items kept are moved down in a single pass.
+ */
+void
+cbt_page_multidelete(Page page, OffsetNumber *offnums, int n)
+{
+    int         nitems = CBTPageGetNItems(page);
+    int         next = 0;
+    int         dst = 0;
+    int         src;
+
+    if (P_ISLEAF(CBTPageGetOpaque(page)))
+    {
+        char       *entries = CBTLeafGetEntries(page);
+        Size        esize = CBTLeafEntrySize(page);
+
+        for (src = 0; src < nitems; src++)
+        {
+            if (next < n && offnums[next] == src + P_FIRSTOFFSET)
+            {
+                next++;
+                continue;
+            }
+            if (dst != src)
+                memcpy(entries + dst * esize, entries + src * esize, esize);
+            dst++;
+        }
+
+        Assert(next == n);
+        ((PageHeader) page)->pd_lower -= (nitems - dst) * esize;
+    }
+    else
+    {
+        uint32     *counts = CBTInternalCounts(page);
+        BlockNumber *blocks = CBTInternalBlocks(page);
+
+        for (src = 0; src < nitems; src++)
+        {
+            if (next < n && offnums[next] == src + P_FIRSTOFFSET)
+            {
+                next++;
+                continue;
+            }
+            counts[dst] = counts[src];
+            blocks[dst] = blocks[src];
+            dst++;
+        }
+
+        Assert(next == n);
+    }
+
+    CBTPageGetNItems(page) = dst;
+}
+
+/*
+ * Find the item of a page holding the target-th tuple below it, counting
+ * from 1. The number of tuples to the left of the item is returned in
+ * leftcount. Returns InvalidOffsetNumber if the page holds fewer tuples
+ * than target, leftcount is then the total of the page.
+ */
+OffsetNumber
+cbt_page_search(Page page, uint32 target, uint32 *leftcount)
+{
+    int         nitems;
+
+    if (!P_ISLEAF(CBTPageGetOpaque(page)))
+        return cbt_internal_search(page, target, leftcount);
+
+    /* Every leaf item counts 1, so the target is the offset */
+    nitems = CBTPageGetNItems(page);
+    if (target > (uint32) nitems)
+    {
+        *leftcount = nitems;
+        return InvalidOffsetNumber;
+    }
+
+    *leftcount = target - 1;
+    return (OffsetNumber) (target - 1 + P_FIRSTOFFSET);
+}
+
+/*
+ * How full a page is, in percent of the space its items can take.
+ */
+int
+cbt_page_fill(Page page)
+{
+    Size        start;
+    Size        usable;
+
+    if (!P_ISLEAF(CBTPageGetOpaque(page)))
+        return (int) (CBTPageGetNItems(page) * 100 / CBT_INTERNAL_CAPACITY);
+
+    start = CBTLeafGetEntries(page) - (char *) page;
+    usable = ((PageHeader) page)->pd_upper - start;
+    return (int) ((((PageHeader) page)->pd_lower - start) * 100 / usable);
+}
+
+/*
+ * Can the page be taken for a new one? It can if it was never used, or if
+ * it was unlinked before every transaction still running began.
+ */
+bool
+cbt_page_recyclable(Page page)
+{
+    CBTPageOpaque opaque;
+
+    if (PageIsNew(page))
+        return true;
+
+    opaque = CBTPageGetOpaque(page);
+    return P_ISDELETED(opaque) && P_ISUNLINKED(opaque) &&
+        TransactionIdIsValid(opaque->cbto_xact) &&
+        TransactionIdPrecedes(opaque->cbto_xact, RecentGlobalXmin);
+}
+
+/*
+ * Number of tuples below a page.
+ */
+uint32
+cbt_page_total(Page page)
+{
+    if (P_ISLEAF(CBTPageGetOpaque(page)))
+        return CBTPageGetNItems(page);
+
+    return cbt_internal_prefix(page, CBTPageGetNItems(page));
+}
+
+/*
+ * Add blkno to the children of an internal page that keep a change
+ * pending. The caller checks there is room.
+ */
+void
+cbt_pending_add(Page page, BlockNumber blkno)
+{
+    CBTPageOpaque opaque = CBTPageGetOpaque(page);
+
+    Assert(opaque->cbto_npending < CBT_MAX_PENDING);
+    CBTInternalPending(page)[opaque->cbto_npending++] = blkno;
+}
+
+/*
+ * Take blkno off the children of an internal page that keep a change
+ * pending. The last one on the list fills its place.
+ */
+void
+cbt_pending_forget(Page page, BlockNumber blkno)
+{
+    CBTPageOpaque opaque = CBTPageGetOpaque(page);
+    BlockNumber *pending = CBTInternalPending(page);
+    int         i;
+
+    for (i = 0; i < opaque->cbto_npending; i++)
+    {
+        if (pending[i] == blkno)
+        {
+            pending[i] = pending[--opaque->cbto_npending];
+            return;
+        }
+    }
+
+    elog(ERROR, "block %u is not listed as keeping a change pending", blkno);
+}
+
+/*
+ * Give the children of a page being split that keep a change pending to
+ * the half, left or right, that their downlinks went to.
+ */
+void
+cbt_pending_divide(Page page, Page left, Page right)
+{
+    CBTPageOpaque opaque = CBTPageGetOpaque(page);
+    int         i;
+
+    for (i = 0; i < opaque->cbto_npending; i++)
+    {
+        BlockNumber blkno = CBTInternalPending(page)[i];
+
+        if (cbt_internal_find_block(left, blkno, P_FIRSTOFFSET) != InvalidOffsetNumber)
+            cbt_pending_add(left, blkno);
+        else
+            cbt_pending_add(right, blkno);
+    }
+}
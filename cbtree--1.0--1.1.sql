@@ -0,0 +1,48 @@
+/* contrib/cbtree/cbtree--1.0--1.1.sql on postgres 10.1 */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION cbtree UPDATE TO '1.1'" to load this file. \quit
+
+-- Strategy 1 of int4_ops was =; it is now <, with <=, =, >= and > as 2 to 5.
+-- The operator is an internal member of the opclass and ALTER OPERATOR FAMILY
+-- cannot drop it, so point the existing entry, and its dependency, at < instead.
+UPDATE pg_catalog.pg_depend
+SET refobjid = '<(int4,int4)'::pg_catalog.regoperator
+WHERE classid = 'pg_catalog.pg_amop'::pg_catalog.regclass
+  AND refclassid = 'pg_catalog.pg_operator'::pg_catalog.regclass
+  AND refobjid = '=(int4,int4)'::pg_catalog.regoperator
+  AND objid IN (SELECT oid FROM pg_catalog.pg_amop
+                WHERE amopmethod = (SELECT oid FROM pg_catalog.pg_am WHERE amname = 'cbtree')
+                  AND amopstrategy = 1
+                  AND amopopr = '=(int4,int4)'::pg_catalog.regoperator);
+
+UPDATE pg_catalog.pg_amop
+SET amopopr = '<(int4,int4)'::pg_catalog.regoperator
+WHERE amopmethod = (SELECT oid FROM pg_catalog.pg_am WHERE amname = 'cbtree')
+  AND amopstrategy = 1
+  AND amopopr = '=(int4,int4)'::pg_catalog.regoperator;
+
+ALTER OPERATOR FAMILY int4_ops USING cbtree ADD
+	OPERATOR	2	<=(int4, int4),
+	OPERATOR	3	=(int4, int4),
+	OPERATOR	4	>=(int4, int4),
+	OPERATOR	5	>(int4, int4);
+
+-- Number of tuples in a cbtree index, the sum of the counts of its root
+CREATE FUNCTION cbt_count(index regclass)
+RETURNS bigint
+AS 'MODULE_PATHNAME'
+LANGUAGE C STRICT;
+
+-- Splice heap TIDs into a cbtree index, the first one at position. Each TID
+-- must be a visible row of the table that is not indexed yet.
+CREATE FUNCTION cbt_insert_many(index regclass, position int4, tids tid[])
+RETURNS void
+AS 'MODULE_PATHNAME', 'cbt_splice'
+LANGUAGE C STRICT;
+
+-- Cut the positions from_pos to to_pos out of a cbtree index
+CREATE FUNCTION cbt_delete_range(index regclass, from_pos int4, to_pos int4)
+RETURNS bigint
+AS 'MODULE_PATHNAME', 'cbt_cut'
+LANGUAGE C STRICT;
@@ -14,12 +14,85 @@
 #include "cbtree.h"
 #include "fmgr.h"
 #include "access/amapi.h"
+#include "access/genam.h"
+#include "access/heapam.h"
+#include "access/htup_details.h"
+#include "catalog/index.h"
+#include "miscadmin.h"
+#include "storage/lmgr.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/rel.h"
+#include "utils/snapmgr.h"
 
 PG_MODULE_MAGIC;
 
+/* GUC parameters */
+int         cbt_pending_limit = 0;
+int         cbt_merge_threshold = 25;
+int         cbt_parallel_build_workers = 2;
+
 PG_FUNCTION_INFO_V1(cbthandler);
+PG_FUNCTION_INFO_V1(cbt_count);
+PG_FUNCTION_INFO_V1(cbt_splice);
+PG_FUNCTION_INFO_V1(cbt_cut);
 
+void _PG_init(void);
 Datum cbthandler(PG_FUNCTION_ARGS);
+Datum cbt_count(PG_FUNCTION_ARGS);
+Datum cbt_splice(PG_FUNCTION_ARGS);
+Datum cbt_cut(PG_FUNCTION_ARGS);
+
+/*
+ * Module load callback.
+ */
+void
+_PG_init(void)
+{
+    DefineCustomIntVariable("cbtree.pending_count_limit",
+                            "Largest count change a child of the root may keep pending.",
+                            "Changes are applied to the root once they reach this "
+                            "size. Zero applies every change to the root at once.",
+                            &cbt_pending_limit,
+                            0,
+                            0, INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("cbtree.merge_threshold",
+                            "Fill percentage below which vacuum merges a leaf page with its right sibling.",
+                            "A leaf that fits into its right sibling is merged into it, "
+                            "and a right sibling below the threshold takes items from "
+                            "the page. Zero disables merging.",
+                            &cbt_merge_threshold,
+                            25,
+                            0, 50,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("cbtree.parallel_build_workers",
+                            "Largest number of parallel workers an index build uses.",
+                            "Each worker scans a range of the table, and fills and "
+                            "writes the leaves for it. Zero builds in the backend alone.",
+                            &cbt_parallel_build_workers,
+                            2,
+                            0, CBT_MAX_PARALLEL_WORKERS,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    cbt_init_reloptions();
+}
 
 /*
  * Counted btree handler function: return IndexAmRoutine with access method parameters
@@ -32,13 +105,13 @@ cbthandler(PG_FUNCTION_ARGS)
 
 	amroutine->amstrategies = CBTREE_NSTRATEGIES;
 	amroutine->amsupport = CBTREE_NPROC;
-	amroutine->amcanorder = false;
+	amroutine->amcanorder = true;
 	amroutine->amcanorderbyop = false;
-	amroutine->amcanbackward = false;
+	amroutine->amcanbackward = true;
 	amroutine->amcanunique = false;
 	amroutine->amcanmulticol = true;
 	amroutine->amoptionalkey = true;
-	amroutine->amsearcharray = false;
+	amroutine->amsearcharray = true;
 	amroutine->amsearchnulls = false;
 	amroutine->amstorage = false;
 	amroutine->amclusterable = false;
@@ -61,8 +134,8 @@ cbthandler(PG_FUNCTION_ARGS)
 	amroutine->amgettuple = cbtgettuple;
 	amroutine->amgetbitmap = NULL;
 	amroutine->amendscan = cbtendscan;
-	amroutine->ammarkpos = NULL;
-	amroutine->amrestrpos = NULL;
+	amroutine->ammarkpos = cbtmarkpos;
+	amroutine->amrestrpos = cbtrestrpos;
 	amroutine->amestimateparallelscan = NULL;
 	amroutine->aminitparallelscan = NULL;
 	amroutine->amparallelrescan = NULL;
@@ -70,4 +143,185 @@ cbthandler(PG_FUNCTION_ARGS)
 	PG_RETURN_POINTER(amroutine);
 }
 
+/*
+ * Return the number of tuples in a counted btree, i.e. the length of the
+ * sequence. It is the sum of the counts of the root, the heap is not
+ * accessed.
+ */
+Datum
+cbt_count(PG_FUNCTION_ARGS)
+{
+    Oid         indexoid = PG_GETARG_OID(0);
+    Relation    index;
+    int64       count;
+
+    index = index_open(indexoid, AccessShareLock);
+
+    if (index->rd_amroutine->ambuild != cbtbuild)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a cbtree index",
+                        RelationGetRelationName(index))));
+
+    count = (int64) cbt_find_totalcnt(index);
+
+    index_close(index, AccessShareLock);
+
+    PG_RETURN_INT64(count);
+}
+
+/*
+ * SQL interface of cbt_insert_many: splice the heap TIDs in an array into
+ * a cbtree index at a position. Only the index is changed, so this is for
+ * rows that have no index entry, such as those whose positions were cut
+ * with cbt_delete_range. The owner of the table may do that.
+ *
+ * Every TID must be a row of the table visible to the statement, given
+ * once, and not indexed yet; the whole index is read to check the last.
+ * Splices and cuts of the same table are kept apart by the
+ * ShareUpdateExclusiveLock on it, inserts of new rows go on.
+ */
+Datum
+cbt_splice(PG_FUNCTION_ARGS)
+{
+    Oid         indexoid = PG_GETARG_OID(0);
+    int32       position = PG_GETARG_INT32(1);
+    ArrayType  *tidarray = PG_GETARG_ARRAYTYPE_P(2);
+    Oid         heapoid;
+    Relation    heap;
+    Relation    index;
+    BlockNumber nblocks;
+    ItemPointer tids;
+    ItemPointer sorted;
+    ItemPointer indexed;
+    int         ntids;
+    int         i;
+
+    if (position < 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("position must be at least 1")));
+    if (ARR_NDIM(tidarray) > 1 || array_contains_nulls(tidarray))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("TIDs must be given in a one-dimensional array without nulls")));
+
+    /* Check the owner before anything is locked, then the table first */
+    heapoid = IndexGetRelation(indexoid, false);
+    if (!pg_class_ownercheck(heapoid, GetUserId()))
+        aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS,
+                       get_rel_name(heapoid));
+    heap = heap_open(heapoid, ShareUpdateExclusiveLock);
+    index = index_open(indexoid, RowExclusiveLock);
+
+    if (index->rd_amroutine->ambuild != cbtbuild)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a cbtree index",
+                        RelationGetRelationName(index))));
+
+    /* tid is a fixed-width type with no padding, the elements are an array */
+    tids = (ItemPointer) ARR_DATA_PTR(tidarray);
+    ntids = ArrayGetNItems(ARR_NDIM(tidarray), ARR_DIMS(tidarray));
+
+    nblocks = RelationGetNumberOfBlocks(heap);
+    for (i = 0; i < ntids; i++)
+    {
+        HeapTupleData tuple;
+        Buffer      buffer;
+
+        if (!ItemPointerIsValid(&tids[i]) ||
+            ItemPointerGetBlockNumber(&tids[i]) >= nblocks)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("invalid TID (%u,%u)",
+                            BlockIdGetBlockNumber(&tids[i].ip_blkid),
+                            tids[i].ip_posid)));
+
+        tuple.t_self = tids[i];
+        if (!heap_fetch(heap, GetActiveSnapshot(), &tuple, &buffer, false, NULL))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("TID (%u,%u) is not a visible row of table \"%s\"",
+                            BlockIdGetBlockNumber(&tids[i].ip_blkid),
+                            tids[i].ip_posid, RelationGetRelationName(heap))));
+
+        /* Index entries point at the first tuple of a HOT chain */
+        if (HeapTupleIsHeapOnly(&tuple))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("TID (%u,%u) is a heap-only tuple",
+                            BlockIdGetBlockNumber(&tids[i].ip_blkid),
+                            tids[i].ip_posid),
+                     errhint("Give the TID of the tuple its update chain starts at.")));
+        ReleaseBuffer(buffer);
+    }
+
+    sorted = (ItemPointer) palloc(ntids * sizeof(ItemPointerData));
+    memcpy(sorted, tids, ntids * sizeof(ItemPointerData));
+    qsort(sorted, ntids, sizeof(ItemPointerData), cbt_tid_cmp);
+    for (i = 1; i < ntids; i++)
+    {
+        if (ItemPointerEquals(&sorted[i - 1], &sorted[i]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("TID (%u,%u) is given more than once",
+                            BlockIdGetBlockNumber(&sorted[i].ip_blkid),
+                            sorted[i].ip_posid)));
+    }
+
+    indexed = cbt_find_indexed(index, sorted, ntids);
+    if (indexed != NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("TID (%u,%u) is indexed already",
+                        BlockIdGetBlockNumber(&indexed->ip_blkid),
+                        indexed->ip_posid)));
+    pfree(sorted);
+
+    cbt_insert_many(index, (uint32) position, tids, ntids);
+
+    index_close(index, NoLock);
+    heap_close(heap, NoLock);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * SQL interface of cbt_delete_range: cut the positions from_pos to to_pos
+ * out of a cbtree index and return how many tuples went. Only the index
+ * is changed. Other writers are kept out by an ExclusiveLock on the table,
+ * which only its owner may take here.
+ */
+Datum
+cbt_cut(PG_FUNCTION_ARGS)
+{
+    Oid         indexoid = PG_GETARG_OID(0);
+    int32       from = PG_GETARG_INT32(1);
+    int32       to = PG_GETARG_INT32(2);
+    Oid         heapoid;
+    Relation    index;
+    uint32      removed = 0;
+
+    /* Check the owner before anything is locked, then the table first */
+    heapoid = IndexGetRelation(indexoid, false);
+    if (!pg_class_ownercheck(heapoid, GetUserId()))
+        aclcheck_error(ACLCHECK_NOT_OWNER, ACL_KIND_CLASS,
+                       get_rel_name(heapoid));
+    LockRelationOid(heapoid, ExclusiveLock);
+    index = index_open(indexoid, ExclusiveLock);
+
+    if (index->rd_amroutine->ambuild != cbtbuild)
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not a cbtree index",
+                        RelationGetRelationName(index))));
+
+    if (to >= 1 && from <= to)
+        removed = cbt_delete_range(index, (uint32) Max(from, 1), (uint32) to);
+
+    index_close(index, NoLock);
+
+    PG_RETURN_INT64((int64) removed);
+}
 
@@ -13,17 +13,52 @@
 
 #include "postgres.h"
 
+#include "storage/buf.h"
 #include "storage/bufpage.h"
 #include "storage/itemptr.h"
 #include "utils/relcache.h"
 #include "access/genam.h"
 #include "nodes/relation.h"
 
-#define CBTREE_NSTRATEGIES		 1
-#define CBTREE_EQUAL_STRATEGY	 1
+/*
+ * Strategy numbers follow btree's, so that the planner can map the
+ * opclass operators onto the integer btree opfamily.
+ */
+#define CBTREE_NSTRATEGIES				5
+#define CBTREE_LESS_STRATEGY			1
+#define CBTREE_LESS_EQUAL_STRATEGY		2
+#define CBTREE_EQUAL_STRATEGY			3
+#define CBTREE_GREATER_EQUAL_STRATEGY	4
+#define CBTREE_GREATER_STRATEGY			5
 
 #define CBTREE_NPROC			 1
 
+/*
+ * cbto_parent is a hint: the block is the parent page the downlink was on
+ * when the hint was set, the offset its slot there. Downlinks only move
+ * right when parents split, so the parent is found by looking for the
+ * downlink on that page and then to its right (see cbt_getstackbuf).
+ *
+ * cbto_pending is a change of the count below a page that is not in its
+ * downlink yet: the count in the parent plus cbto_pending is the
+ * number of tuples below the page. cbto_npending is the number of children
+ * of the page with a nonzero cbto_pending, which are listed on the page
+ * (see CBTInternalPending). See cbt_finish_count and cbt_fold_pending.
+ *
+ * cbto_incomplete is a count change of the page that its downlink doesn't
+ * have yet because it is still being carried up. The change of a page is
+ * logged with the page first and then moved up one level per WAL record,
+ * so the count in the parent plus cbto_pending plus cbto_incomplete is
+ * the number of tuples below the page at any point. Readers ignore it and
+ * see the counts as they were before the change; a change left behind by
+ * an error or crash is carried up by the next writer that passes or by
+ * vacuum (see cbt_finish_count).
+ *
+ * A deleted page stays in the sibling chain until vacuum cleanup unlinks
+ * it and sets CBT_UNLINKED. cbto_xact is then the next transaction ID at
+ * that time; once no running transaction is older, nobody can still be on
+ * the way to the page and it can be reused (see cbt_page_recyclable).
+ */
 typedef struct CBTPageOpaqueData
 {
     BlockNumber cbto_prev;
@@ -31,7 +66,11 @@ typedef struct CBTPageOpaqueData
 	ItemPointerData cbto_parent;
     uint32      level;
     uint16      cbto_flags;
-
+    uint16      cbto_nitems;    /* # of items on the page */
+    int32       cbto_pending;   /* count change not applied to the parent */
+    int32       cbto_incomplete;    /* count change not carried up yet */
+    uint16      cbto_npending;  /* # of children with a pending change */
+    TransactionId cbto_xact;    /* next xid when unlinked, if deleted */
 } CBTPageOpaqueData;
 
 typedef CBTPageOpaqueData *CBTPageOpaque;
@@ -41,6 +80,8 @@ typedef CBTPageOpaqueData *CBTPageOpaque;
 #define CBT_META        (1 << 2)
 #define CBT_DELETED     (1 << 3)
 #define CBT_HALF_DEAD	(1 << 4)
+#define CBT_INCOMPLETE_SPLIT	(1 << 5)	/* right sibling has no downlink yet */
+#define CBT_UNLINKED	(1 << 6)	/* deleted, and no sibling links to it */
 
 #define CBTPageGetOpaque(page) ((CBTPageOpaque) PageGetSpecialPointer(page))
 #define CBTPageIsMeta(page) \
@@ -53,8 +94,10 @@ typedef CBTPageOpaqueData *CBTPageOpaque;
 typedef struct CBTMetaPageData
 {
     uint32     cbtm_magic;
+    uint32      cbtm_version;   /* page layout, CBT_VERSION */
     BlockNumber cbtm_root;
     uint32      cbtm_level;
+    BlockNumber cbtm_nleaves;   /* number of leaf pages */
 
 	//BlockNumber cbtm_fastroot;
 	//uint32 		cbtm_fastlevel;
@@ -63,8 +106,44 @@ typedef struct CBTMetaPageData
 #define CBTPageGetMeta(p) \
 	((CBTMetaPageData *) PageGetContents(p))
 
+#define CBT_LEAF_LEVEL              1
+#define CBTREE_MAX_LEVELS			32
+#define CBT_MAX_PARALLEL_WORKERS	64
+
+/*
+ * A page on the path of the last read descent, with the LSN it had then.
+ * The page is known to be unchanged as long as its LSN is.
+ */
+typedef struct CBTPathLevel
+{
+	BlockNumber cbtp_blkno;
+	XLogRecPtr	cbtp_lsn;
+	uint32		cbtp_left;		/* tuples before the page */
+	uint32		cbtp_count;		/* tuples in its subtree */
+} CBTPathLevel;
+
+/*
+ * Backend-local data kept in rd_amcache. The copy of the meta page must
+ * come first, cbt_getroot reads it through a CBTMetaPageData pointer.
+ */
+typedef struct CBTCacheData
+{
+	CBTMetaPageData cbtc_meta;
+	BlockNumber cbtc_rightmost;	/* last known rightmost leaf, or invalid */
+	uint32		cbtc_total;		/* tuples in the tree after the last append */
+	int			cbtc_pathlen;	/* levels of cbtc_path set, root first */
+	CBTPathLevel cbtc_path[CBTREE_MAX_LEVELS];
+} CBTCacheData;
+
 #define CBT_METAPAGE    0
-#define CBT_MAGIC       0x0451253
+#define CBT_MAGIC       0x0451254
+#define CBT_VERSION     2
+
+/*
+ * Magic number of indexes built before the layout was versioned. Their
+ * pages can't be read anymore, they have to be rebuilt with REINDEX.
+ */
+#define CBT_MAGIC_V1    0x0451253
 
 #define P_LEFTMOST(opaque)		((opaque)->cbto_prev == InvalidBlockNumber)
 #define P_RIGHTMOST(opaque)		((opaque)->cbto_next == InvalidBlockNumber)
@@ -74,6 +153,9 @@ typedef struct CBTMetaPageData
 #define P_ISHALFDEAD(opaque)	(((opaque)->cbto_flags & CBT_HALF_DEAD) != 0)
 #define P_IGNORE(opaque)		(((opaque)->cbto_flags & (CBT_DELETED|CBT_HALF_DEAD)) != 0)
 #define P_ISMETA(opaque)		(((opaque)->cbto_flags & CBT_META) != 0)
+#define P_INCOMPLETE_SPLIT(opaque)	(((opaque)->cbto_flags & CBT_INCOMPLETE_SPLIT) != 0)
+#define P_INCOMPLETE_COUNT(opaque)	((opaque)->cbto_incomplete != 0)
+#define P_ISUNLINKED(opaque)	(((opaque)->cbto_flags & CBT_UNLINKED) != 0)
 
 typedef struct CBTTupleData
 {
@@ -88,6 +170,75 @@ typedef CBTTupleData *CBTTuple;
 
 #define P_FIRSTOFFSET   1
 
+/*
+ * Internal pages don't use line pointers. The page body holds two parallel
+ * arrays of CBT_INTERNAL_CAPACITY entries: first the subtree counts, then
+ * the downlinks. Keeping the counts contiguous lets the descent sum them
+ * with vector instructions. Slots are numbered from P_FIRSTOFFSET like line
+ * pointers and cbto_nitems of them are in use. pd_lower is set to pd_upper
+ * so the arrays are never taken for the hole of a standard page.
+ *
+ * The arrays are followed by the blocks of the children that keep a count
+ * change pending, cbto_npending of them and at most CBT_MAX_PENDING, in no
+ * particular order. They are only changed with the page exclusively locked.
+ */
+#define CBT_MAX_PENDING		16
+
+#define CBT_INTERNAL_CAPACITY \
+	((int) (((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - \
+			  MAXALIGN(sizeof(CBTPageOpaqueData)) - \
+			  CBT_MAX_PENDING * sizeof(BlockNumber)) / \
+			 (sizeof(uint32) + sizeof(BlockNumber))) & ~7))
+
+#define CBTInternalCounts(page) \
+	((uint32 *) PageGetContents(page))
+#define CBTInternalBlocks(page) \
+	((BlockNumber *) (PageGetContents(page) + \
+					  CBT_INTERNAL_CAPACITY * sizeof(uint32)))
+#define CBTInternalPending(page) \
+	((BlockNumber *) (PageGetContents(page) + \
+					  CBT_INTERNAL_CAPACITY * (sizeof(uint32) + sizeof(BlockNumber))))
+#define CBTInternalGetCount(page, off) \
+	(CBTInternalCounts(page)[(off) - P_FIRSTOFFSET])
+#define CBTInternalGetBlock(page, off) \
+	(CBTInternalBlocks(page)[(off) - P_FIRSTOFFSET])
+#define CBTPageGetNItems(page) \
+	(CBTPageGetOpaque(page)->cbto_nitems)
+
+/*
+ * Leaf pages hold nothing but heap TIDs, the count of a leaf item is
+ * always 1. The page body starts with a CBTLeafHeaderData followed by
+ * cbto_nitems fixed-width entries, and pd_lower marks the end of the
+ * entries so that the free space is the usual hole below pd_upper. An
+ * entry is normally a uint32 with the heap offset number in the low
+ * CBT_LEAF_OFFSET_BITS bits and the distance of the heap block from
+ * cbtl_base, biased to be unsigned, above them. A leaf that gets a TID
+ * too far from its base is converted to plain ItemPointerData entries.
+ */
+typedef struct CBTLeafHeaderData
+{
+    BlockNumber cbtl_base;      /* heap block the entries are relative to */
+    uint16      cbtl_flags;
+    uint16      cbtl_unused;
+} CBTLeafHeaderData;
+
+#define CBTL_WIDE               (1 << 0)    /* entries are ItemPointerData */
+
+#define CBT_LEAF_OFFSET_BITS    11
+#define CBT_LEAF_OFFSET_MASK    ((1 << CBT_LEAF_OFFSET_BITS) - 1)
+#define CBT_LEAF_DELTA_BIAS     (1 << (32 - CBT_LEAF_OFFSET_BITS - 1))
+
+#define CBTLeafGetHeader(page) \
+	((CBTLeafHeaderData *) PageGetContents(page))
+#define CBTLeafGetEntries(page) \
+	(PageGetContents(page) + sizeof(CBTLeafHeaderData))
+#define CBTLeafIsWide(page) \
+	((CBTLeafGetHeader(page)->cbtl_flags & CBTL_WIDE) != 0)
+#define CBTLeafEntrySize(page) \
+	(CBTLeafIsWide(page) ? sizeof(ItemPointerData) : sizeof(uint32))
+#define CBTPageGetFreeSpace(page) \
+	((Size) (((PageHeader) (page))->pd_upper - ((PageHeader) (page))->pd_lower))
+
 typedef struct CBTStackData
 {
     BlockNumber cbts_blkno;
@@ -102,8 +253,107 @@ typedef CBTStackData *CBTStack;
 #define CBTREE_DEFAULT_FILLFACTOR	90
 #define CBTREE_NONLEAF_FILLFACTOR	70
 
-#define CBT_LEAF_LEVEL              1
+/*
+ * Where a full page is split. Balanced splits in the middle. Append gives
+ * the left half fillfactor percent of the items when the new one goes at
+ * the end of the page, so that a page left behind by appends stays full;
+ * prepend does the same for the right half when it goes at the start.
+ * Adaptive does either, depending on where the new item goes.
+ */
+typedef enum CBTSplitPolicy
+{
+    CBT_SPLIT_BALANCED,
+    CBT_SPLIT_APPEND,
+    CBT_SPLIT_PREPEND,
+    CBT_SPLIT_ADAPTIVE
+} CBTSplitPolicy;
+
+/* Index reloptions, see cbtoptions */
+typedef struct CBTOptions
+{
+    int32       vl_len_;        /* varlena header (do not touch directly!) */
+    int         fillfactor;     /* leaf fill factor, in percent */
+    int         nonleaf_fillfactor;	/* internal page fill factor */
+    int         split_policy_str;	/* offset of the split_policy string */
+    CBTSplitPolicy split_policy;	/* the same, parsed */
+    int         build_order;    /* offset of the build_order string, or 0 */
+} CBTOptions;
+
+#define CBTGetFillFactor(rel) \
+	((rel)->rd_options ? ((CBTOptions *) (rel)->rd_options)->fillfactor : \
+	 CBTREE_DEFAULT_FILLFACTOR)
+#define CBTGetNonLeafFillFactor(rel) \
+	((rel)->rd_options ? ((CBTOptions *) (rel)->rd_options)->nonleaf_fillfactor : \
+	 CBTREE_NONLEAF_FILLFACTOR)
+#define CBTGetTargetPageFreeSpace(rel) \
+	(BLCKSZ * (100 - CBTGetFillFactor(rel)) / 100)
+#define CBTGetSplitPolicy(rel) \
+	((rel)->rd_options ? ((CBTOptions *) (rel)->rd_options)->split_policy : \
+	 CBT_SPLIT_BALANCED)
+#define CBTGetBuildOrder(rel) \
+	((rel)->rd_options && ((CBTOptions *) (rel)->rd_options)->build_order != 0 ? \
+	 GET_STRING_RELOPTION((CBTOptions *) (rel)->rd_options, build_order) : NULL)
+
+
+#define MaxCBTTuplesPerPage	\
+	((int) ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - \
+			 sizeof(CBTLeafHeaderData) - MAXALIGN(sizeof(CBTPageOpaqueData))) / \
+			sizeof(uint32)))
+
+/*
+ * Fewest tuples a full leaf holds, with wide entries. A leaf that can't
+ * take another TID holds at least this many.
+ */
+#define MinCBTTuplesPerPage	\
+	((int) ((BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - \
+			 sizeof(CBTLeafHeaderData) - MAXALIGN(sizeof(CBTPageOpaqueData))) / \
+			sizeof(ItemPointerData)) - 1)
+
+/*
+ * A splice of many TIDs fills a chain of new leaves right of the leaf it
+ * lands on (see cbt_insert_many). The chain is kept below
+ * CBT_SPLICE_MAX_PAGES pages by splicing at most CBT_SPLICE_MAX_TIDS at a
+ * time, as the whole chain stays locked until every page has a downlink.
+ */
+#define CBT_SPLICE_MAX_PAGES		8
+#define CBT_SPLICE_MAX_TIDS \
+	((CBT_SPLICE_MAX_PAGES - 4) * MinCBTTuplesPerPage)
+
+/*
+ * When no page is free, the relation is extended by CBT_EXTEND_PAGES pages
+ * at once, and by CBT_EXTEND_PER_WAITER more for every backend waiting for
+ * the extension lock, up to CBT_EXTEND_MAX_PAGES. Pages not used right away
+ * go to the free space map.
+ */
+#define CBT_EXTEND_PAGES			8
+#define CBT_EXTEND_PER_WAITER		20
+#define CBT_EXTEND_MAX_PAGES		512
+
+/*
+ * Position of a scan inside the leaf level. Matching heap TIDs of one leaf
+ * are copied out while the page is locked, so the scan never holds a lock
+ * between calls to cbtgettuple.
+ */
+typedef struct CBTScanPosData
+{
+	Buffer		buf;			/* if valid, the buffer is pinned */
+	BlockNumber currPage;		/* leaf the items were read from */
+	BlockNumber nextPage;		/* its right link, if the items reach its end */
+	BlockNumber prevPage;		/* its left link, if they start it */
+	uint32		firstPos;		/* tree position of items[firstItem] */
+	bool		moreLeft;		/* may there be matches before the items? */
+	bool		moreRight;		/* may there be matches after them? */
+	int			arrayFirst;		/* = ANY positions the items are for, */
+	int			arrayLast;		/* as indexes into arrayPos */
+
+	int			firstItem;		/* first valid index in items[] */
+	int			lastItem;		/* last valid index in items[] */
+	int			itemIndex;		/* current index in items[] */
 
+	ItemPointerData items[MaxCBTTuplesPerPage];
+} CBTScanPosData;
+
+typedef CBTScanPosData *CBTScanPos;
 
 #define CBTScanPosIsPinned(scanpos) \
 ( \
@@ -132,21 +382,50 @@ typedef CBTStackData *CBTStack;
 	do { \
 		(scanpos).currPage = InvalidBlockNumber; \
 		(scanpos).nextPage = InvalidBlockNumber; \
+		(scanpos).prevPage = InvalidBlockNumber; \
 		(scanpos).buf = InvalidBuffer; \
-		(scanpos).lsn = InvalidXLogRecPtr; \
-		(scanpos).nextTupleOffset = 0; \
-	} while (0);
-
-#define MaxCBTTuplesPerPage	\
-	((int) ((BLCKSZ - SizeOfPageHeaderData) / \
-			(MAXALIGN(sizeof(CBTTupleData) + 1) + sizeof(ItemIdData))))
+		(scanpos).firstPos = 0; \
+		(scanpos).moreLeft = false; \
+		(scanpos).moreRight = false; \
+		(scanpos).arrayFirst = 0; \
+		(scanpos).arrayLast = -1; \
+		(scanpos).firstItem = 0; \
+		(scanpos).lastItem = -1; \
+		(scanpos).itemIndex = 0; \
+	} while (0)
 
 
 extern void CBTInitPage(Page page, uint16 flags);
 extern void CBTFormTuple(ItemPointer itptr, CBTTuple itup, uint32 childcnt);
 
+/* cbtpage.c */
+extern OffsetNumber cbt_page_nitems(Page page);
+extern void cbt_page_getitem(Page page, OffsetNumber off, CBTTuple itup);
+extern bool cbt_page_hasroom(Page page, CBTTuple itup);
+extern bool cbt_page_additem(Page page, OffsetNumber off, CBTTuple itup);
+extern void cbt_page_delitem(Page page, OffsetNumber off);
+extern void cbt_page_delitems(Page page, OffsetNumber off, int n);
+extern void cbt_page_multidelete(Page page, OffsetNumber *offnums, int n);
+extern OffsetNumber cbt_page_search(Page page, uint32 target, uint32 *leftcount);
+extern uint32 cbt_page_total(Page page);
+extern void cbt_pending_add(Page page, BlockNumber blkno);
+extern void cbt_pending_forget(Page page, BlockNumber blkno);
+extern void cbt_pending_divide(Page page, Page left, Page right);
+extern int cbt_page_fill(Page page);
+extern bool cbt_page_recyclable(Page page);
+extern bool cbt_leaf_fits(ItemPointer tids, int ntids);
+extern void cbt_leaf_gettids(Page page, OffsetNumber off, int n, ItemPointer tids);
+extern uint32 cbt_internal_prefix(Page page, OffsetNumber nslots);
+extern OffsetNumber cbt_internal_search(Page page, uint32 target, uint32 *leftcount);
+extern OffsetNumber cbt_internal_find_block(Page page, BlockNumber blkno, OffsetNumber hint);
+
 extern bool cbtvalidate(Oid opclassoid);
 
+/* cbtree.c */
+extern int cbt_pending_limit;
+extern int cbt_merge_threshold;
+extern int cbt_parallel_build_workers;
+
 /* index access method interface functions */
 extern bool cbtinsert(Relation index, Datum *values, bool *isnull,
                      ItemPointer ht_ctid, Relation heapRel,
@@ -157,6 +436,8 @@ extern bool cbtgettuple(IndexScanDesc scan, ScanDirection dir);
 extern void cbtrescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
                      ScanKey orderbys, int norderbys);
 extern void cbtendscan(IndexScanDesc scan);
+extern void cbtmarkpos(IndexScanDesc scan);
+extern void cbtrestrpos(IndexScanDesc scan);
 extern IndexBuildResult *cbtbuild(Relation heap, Relation index,
                                  struct IndexInfo *indexInfo);
 extern void cbtbuildempty(Relation index);
@@ -166,6 +447,7 @@ extern IndexBulkDeleteResult *cbtbulkdelete(IndexVacuumInfo *info,
 extern IndexBulkDeleteResult *cbtvacuumcleanup(IndexVacuumInfo *info,
                                               IndexBulkDeleteResult *stats);
 extern bytea *cbtoptions(Datum reloptions, bool validate);
+extern void cbt_init_reloptions(void);
 extern void cbtcostestimate(struct PlannerInfo *root, struct IndexPath *path,
                            double loop_count, Cost *indexStartupCost,
                            Cost *indexTotalCost, Selectivity *indexSelectivity,
@@ -173,7 +455,24 @@ extern void cbtcostestimate(struct PlannerInfo *root, struct IndexPath *path,
 extern Buffer cbt_get_buffer(Relation rel, BlockNumber blkno, int access);
 extern bool cbtcanreturn(Relation index, int attno);
 extern Buffer cbt_getroot(Relation rel, int access);
-extern CBTStack cbt_search(Relation rel, uint32 pos, Buffer *bufptr, int access);
-extern void cbt_freestack(CBTStack stack);
+extern bool cbt_getmeta(Relation rel, CBTMetaPageData *metad);
+extern uint32 cbt_getrootheight(Relation rel);
+extern uint32 cbt_find_totalcnt(Relation index);
+extern int64 cbt_pending_sum(Relation rel, Page page);
+extern OffsetNumber cbt_search_page(Relation rel, Page page, uint32 target,
+                                    uint32 *leftcount);
+extern void cbt_update_meta(Relation rel, int nleaves);
+extern void cbt_insert_many(Relation index, uint32 position, ItemPointer tids,
+                            int ntids);
+extern uint32 cbt_delete_range(Relation index, uint32 from, uint32 to);
+extern Buffer cbt_getstackbuf(Relation rel, CBTStack stack, BlockNumber child);
+extern void cbt_finish_count(Relation rel, Buffer buf, CBTStack stack);
+extern void cbt_fold_pending(Relation rel, Buffer buf);
+extern CBTStack cbt_search(Relation rel, uint32 pos, Buffer *bufptr, int access,
+                           CBTStackData *path);
+extern int cbt_search_many(Relation rel, const uint32 *targets, int ntargets,
+                           ItemPointer tids);
+extern ItemPointer cbt_find_indexed(Relation rel, ItemPointer tids, int ntids);
+extern int cbt_tid_cmp(const void *a, const void *b);
 
 #endif
\ No newline at end of file
@@ -2,80 +2,62 @@
 
 #include "cbtree.h"
 #include "access/genam.h"
+#include "access/generic_xlog.h"
 #include "utils/rel.h"
 #include "storage/bufmgr.h"
 #include "access/relscan.h"
 #include "storage/predicate.h"
 #include "miscadmin.h"
+#include "catalog/pg_type.h"
+#include "utils/array.h"
+#include "utils/memutils.h"
 
-CBTStack cbt_search_in_page(Buffer pagebuf, uint32 pos, CBTStack stack);
 bool cbt_first(IndexScanDesc scan, ScanDirection dir);
+bool cbt_next(IndexScanDesc scan, ScanDirection dir);
+static void cbt_preprocess_keys(IndexScanDesc scan);
+static bool cbt_preprocess_array(IndexScanDesc scan, ScanKey sk, int64 *lowpos,
+                                 int64 *highpos);
+static bool cbt_descend(IndexScanDesc scan, ScanDirection dir, uint32 pos);
+static bool cbt_readpage(IndexScanDesc scan, ScanDirection dir, Buffer buf,
+                         OffsetNumber offnum, uint32 pos);
+static bool cbt_steppage(IndexScanDesc scan, ScanDirection dir);
+static Buffer cbt_walk_left(Relation rel, BlockNumber blkno, BlockNumber target);
+static Buffer cbt_path_lookup(Relation rel, uint32 pos, uint32 *leftcount, int *depth);
+static bool cbt_array_readchunk(IndexScanDesc scan, ScanDirection dir, int from);
+static void cbt_search_many_page(Relation rel, Buffer buf, uint32 leftcount,
+                                 const uint32 *targets, int ntargets,
+                                 ItemPointer tids, int *nfound);
+static int cbt_position_cmp(const void *a, const void *b);
+static Buffer cbt_leftmost_leaf(Relation rel);
+static void cbt_cache_meta(Relation rel, CBTMetaPageData *metad);
+static int32 cbt_child_pending(Relation rel, BlockNumber blkno);
 
 
 typedef struct CBTScanOpaqueData
 {
-    ScanKey     keyData;
-    bool        first_scan;
-} CBTScanOpaqueData;
-
-typedef CBTScanOpaqueData *CBTScanOpaque;
-
-/*
- * Search in the current page. Find the node that contains the
- * target leaf.
- */
-CBTStack
-cbt_search_in_page(Buffer pagebuf, uint32 pos, CBTStack stack)
-{
-    Page            page;
-    uint32          leftcount;
-    CBTPageOpaque   opaque;
-    OffsetNumber    maxoff;
-    OffsetNumber    offset;
-    CBTStack        newstack;
-
-    page = BufferGetPage(pagebuf);
-    opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
-    maxoff = PageGetMaxOffsetNumber(page);
-    offset = P_FIRSTOFFSET;
-    if(maxoff < P_FIRSTOFFSET)
-        return NULL;
-
-    if (stack == NULL)
-        leftcount = 0;
-    else
-        leftcount = stack->total_count;
+    bool        qual_ok;        /* false if the keys can never be satisfied */
+    uint32      lowpos;         /* first position to return */
+    uint32      highpos;        /* last position to return */
 
-    for (;;)    {
-        ItemId      curid;
-        CBTTuple    tuple;
-
-        curid = PageGetItemId(page, offset);
-
-        if (!ItemIdIsDead(curid))
-        {
-            tuple = (CBTTuple) PageGetItem(page, curid);
-            leftcount += tuple->childcnt;
+    /*
+     * Positions of a pos = ANY(array) key, sorted and within the range.
+     * Their tuples are looked up a chunk at a time by cbt_search_many.
+     */
+    uint32     *arrayPos;       /* NULL if there is no such key */
+    int         nArrayPos;
+    MemoryContext arrayContext; /* holds arrayPos */
 
-            if (leftcount >= pos)
-            {
-                newstack = palloc(sizeof(CBTStackData));
-                newstack->total_count = leftcount - tuple->childcnt;
-                newstack->cbts_blkno = BufferGetBlockNumber(pagebuf);
-                newstack->cbts_offset = offset;
-                newstack->cbts_parent = stack;
+    CBTScanPosData currPos;     /* current position data */
 
-                return newstack;
-            }
-        }
-
-        if (offset == maxoff) {
-            return NULL;
-        }
+    /*
+     * A mark is only the index of the marked item while the scan is still
+     * on its page, and a copy of the page's items once it has left.
+     */
+    int         markItemIndex;  /* marked item on currPos, or -1 */
+    CBTScanPosData markPos;     /* marked position, if markItemIndex is -1 */
+} CBTScanOpaqueData;
 
-        offset = OffsetNumberNext(offset);
-    }
-}
+typedef CBTScanOpaqueData *CBTScanOpaque;
 
 /*
  * Begin a scan. Initialize the scan opaque.
@@ -88,14 +70,19 @@ cbtbeginscan(Relation rel, int nkeys, int norderbys)
 
     /* No order by operators allowed */
     Assert(norderbys == 0);
-    /* The only key should be the position */
-    Assert(nkeys == 1);
 
     scan = RelationGetIndexScan(rel, nkeys, norderbys);
 
     so = (CBTScanOpaque) palloc(sizeof(CBTScanOpaqueData));
-    so->keyData = (ScanKey) palloc(sizeof(ScanKeyData));
-    so->first_scan = true;
+    so->qual_ok = true;
+    so->lowpos = 1;
+    so->highpos = PG_INT32_MAX;
+    so->arrayPos = NULL;
+    so->nArrayPos = 0;
+    so->arrayContext = NULL;
+    CBTScanPosInvalidate(so->currPos);
+    CBTScanPosInvalidate(so->markPos);
+    so->markItemIndex = -1;
     scan->xs_itupdesc = RelationGetDescr(rel);
     scan->opaque = so;
 
@@ -110,9 +97,9 @@ void cbtendscan(IndexScanDesc scan)
     CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
 
     /* Release storage */
-    if (so->keyData != NULL)
-        pfree(so->keyData);
-
+    CBTScanPosUnpinIfPinned(so->currPos);
+    if (so->arrayContext != NULL)
+        MemoryContextDelete(so->arrayContext);
     pfree(so);
 }
 
@@ -123,10 +110,15 @@ void
 cbtrescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
                ScanKey orderbys, int norderbys)
 {
-    /* cbtree only support 1 position as argument */
-    Assert(nscankeys == 1);
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+
     Assert(orderbys == NULL);
 
+    CBTScanPosUnpinIfPinned(so->currPos);
+    CBTScanPosInvalidate(so->currPos);
+    CBTScanPosInvalidate(so->markPos);
+    so->markItemIndex = -1;
+
     if (scankey && scan->numberOfKeys > 0)
         memmove(scan->keyData,
                 scankey,
@@ -139,13 +131,242 @@ cbtrescan(IndexScanDesc scan, ScanKey scankey, int nscankeys,
 bool
 cbtgettuple(IndexScanDesc scan, ScanDirection dir)
 {
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
     bool        res;
 
     scan->xs_recheck = false;
-    res = cbt_first(scan, dir);
+
+    /*
+     * The first call descends to the lowest matching position, later calls
+     * continue from the items saved in currPos.
+     */
+    if (!CBTScanPosIsValid(so->currPos))
+        res = cbt_first(scan, dir);
+    else
+        res = cbt_next(scan, dir);
+
+    if (res)
+        scan->xs_ctup.t_self = so->currPos.items[so->currPos.itemIndex];
+
     return res;
 }
 
+/*
+ * Convert the scan keys into an inclusive range of positions. Positions
+ * start from 1, an empty range clears qual_ok.
+ */
+static void
+cbt_preprocess_keys(IndexScanDesc scan)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+    int64       lowpos = 1;
+    int64       highpos = PG_INT32_MAX;
+    int         i;
+
+    so->qual_ok = true;
+    so->arrayPos = NULL;
+    so->nArrayPos = 0;
+    if (so->arrayContext != NULL)
+        MemoryContextReset(so->arrayContext);
+
+    for (i = 0; i < scan->numberOfKeys; i++)
+    {
+        ScanKey     sk = &scan->keyData[i];
+        int64       arg;
+
+        if (sk->sk_flags & (SK_ISNULL | SK_SEARCHNULL))
+        {
+            so->qual_ok = false;
+            return;
+        }
+
+        if (sk->sk_flags & SK_SEARCHARRAY)
+        {
+            if (!cbt_preprocess_array(scan, sk, &lowpos, &highpos))
+            {
+                so->qual_ok = false;
+                return;
+            }
+            continue;
+        }
+
+        arg = (int64) DatumGetInt32(sk->sk_argument);
+
+        switch (sk->sk_strategy)
+        {
+            case CBTREE_LESS_STRATEGY:
+                highpos = Min(highpos, arg - 1);
+                break;
+            case CBTREE_LESS_EQUAL_STRATEGY:
+                highpos = Min(highpos, arg);
+                break;
+            case CBTREE_EQUAL_STRATEGY:
+                lowpos = Max(lowpos, arg);
+                highpos = Min(highpos, arg);
+                break;
+            case CBTREE_GREATER_EQUAL_STRATEGY:
+                lowpos = Max(lowpos, arg);
+                break;
+            case CBTREE_GREATER_STRATEGY:
+                lowpos = Max(lowpos, arg + 1);
+                break;
+            default:
+                elog(ERROR, "unrecognized cbtree strategy number: %d",
+                     sk->sk_strategy);
+        }
+    }
+
+    if (lowpos > highpos)
+    {
+        so->qual_ok = false;
+        return;
+    }
+
+    so->lowpos = (uint32) lowpos;
+    so->highpos = (uint32) highpos;
+
+    /* Only the array positions within the range are looked up */
+    if (so->arrayPos != NULL)
+    {
+        int         n = 0;
+
+        for (i = 0; i < so->nArrayPos; i++)
+        {
+            if (so->arrayPos[i] >= so->lowpos && so->arrayPos[i] <= so->highpos)
+                so->arrayPos[n++] = so->arrayPos[i];
+        }
+        so->nArrayPos = n;
+        if (n == 0)
+            so->qual_ok = false;
+    }
+}
+
+/*
+ * Fold a key with an array argument into the scan. pos < ANY(array) and
+ * the like only narrow the range, to the loosest bound in the array. The
+ * positions of pos = ANY(array) are sorted and kept in arrayPos, as the
+ * intersection with those of an earlier such key. Returns false if no
+ * position can match.
+ */
+static bool
+cbt_preprocess_array(IndexScanDesc scan, ScanKey sk, int64 *lowpos, int64 *highpos)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+    ArrayType  *arr = DatumGetArrayTypeP(sk->sk_argument);
+    Datum      *elems;
+    bool       *nulls;
+    int         nelems;
+    uint32     *positions;
+    int         npositions = 0;
+    int64       minval = PG_INT64_MAX;
+    int64       maxval = PG_INT64_MIN;
+    MemoryContext oldcontext;
+    int         i;
+
+    if (so->arrayContext == NULL)
+        so->arrayContext = AllocSetContextCreate(CurrentMemoryContext,
+                                                 "cbtree array keys",
+                                                 ALLOCSET_SMALL_SIZES);
+    oldcontext = MemoryContextSwitchTo(so->arrayContext);
+
+    deconstruct_array(arr, INT4OID, sizeof(int32), true, 'i',
+                      &elems, &nulls, &nelems);
+    positions = (uint32 *) palloc(Max(nelems, 1) * sizeof(uint32));
+    for (i = 0; i < nelems; i++)
+    {
+        int64       val;
+
+        if (nulls[i])
+            continue;
+        val = (int64) DatumGetInt32(elems[i]);
+        minval = Min(minval, val);
+        maxval = Max(maxval, val);
+        if (val >= 1)
+            positions[npositions++] = (uint32) val;
+    }
+
+    MemoryContextSwitchTo(oldcontext);
+
+    /* Nothing matches a NULL */
+    if (minval > maxval)
+        return false;
+
+    switch (sk->sk_strategy)
+    {
+        case CBTREE_LESS_STRATEGY:
+            *highpos = Min(*highpos, maxval - 1);
+            return true;
+        case CBTREE_LESS_EQUAL_STRATEGY:
+            *highpos = Min(*highpos, maxval);
+            return true;
+        case CBTREE_GREATER_EQUAL_STRATEGY:
+            *lowpos = Max(*lowpos, minval);
+            return true;
+        case CBTREE_GREATER_STRATEGY:
+            *lowpos = Max(*lowpos, minval + 1);
+            return true;
+        case CBTREE_EQUAL_STRATEGY:
+            break;
+        default:
+            elog(ERROR, "unrecognized cbtree strategy number: %d",
+                 sk->sk_strategy);
+    }
+
+    if (npositions > 1)
+    {
+        int         n = 1;
+
+        qsort(positions, npositions, sizeof(uint32), cbt_position_cmp);
+        for (i = 1; i < npositions; i++)
+        {
+            if (positions[i] != positions[n - 1])
+                positions[n++] = positions[i];
+        }
+        npositions = n;
+    }
+
+    /* Both lists are sorted, merge them */
+    if (so->arrayPos != NULL)
+    {
+        int         j = 0;
+        int         n = 0;
+
+        for (i = 0; i < so->nArrayPos && j < npositions;)
+        {
+            if (so->arrayPos[i] < positions[j])
+                i++;
+            else if (so->arrayPos[i] > positions[j])
+                j++;
+            else
+            {
+                positions[n++] = positions[j];
+                i++;
+                j++;
+            }
+        }
+        npositions = n;
+    }
+
+    so->arrayPos = positions;
+    so->nArrayPos = npositions;
+    return npositions > 0;
+}
+
+static int
+cbt_position_cmp(const void *a, const void *b)
+{
+    uint32      pa = *(const uint32 *) a;
+    uint32      pb = *(const uint32 *) b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+int
+cbt_tid_cmp(const void *a, const void *b)
+{
+    return ItemPointerCompare((ItemPointer) a, (ItemPointer) b);
+}
+
 /*
  * Get the root of the current counted btree.
  */
@@ -161,6 +382,7 @@ cbt_getroot(Relation rel, int access)
     BlockNumber rootblkno = InvalidBlockNumber;
     uint32		rootlevel;
     CBTMetaPageData *metad;
+    GenericXLogState *state;
 
     /*
      * Try to use previously-cached metapage data to find the root.  This
@@ -211,12 +433,20 @@ cbt_getroot(Relation rel, int access)
 
     /* sanity-check the metapage */
     if (!P_ISMETA(metaopaque) ||
-        metad->cbtm_magic != CBT_MAGIC)
+        (metad->cbtm_magic != CBT_MAGIC && metad->cbtm_magic != CBT_MAGIC_V1))
         ereport(ERROR,
                 (errcode(ERRCODE_INDEX_CORRUPTED),
                         errmsg("index \"%s\" is not a cbtree",
                                RelationGetRelationName(rel))));
 
+    if (metad->cbtm_magic == CBT_MAGIC_V1 || metad->cbtm_version != CBT_VERSION)
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("index \"%s\" has an unsupported page layout",
+                        RelationGetRelationName(rel)),
+                 errdetail("The index was built by an older version of cbtree."),
+                 errhint("REINDEX the index.")));
+
     /* if no root page initialized yet, do it */
     if (metad->cbtm_root == InvalidBlockNumber)
     {
@@ -255,22 +485,21 @@ cbt_getroot(Relation rel, int access)
          */
         rootbuf = cbt_get_buffer(rel, InvalidBlockNumber, CBT_WRITE);
         rootblkno = BufferGetBlockNumber(rootbuf);
-        rootpage = BufferGetPage(rootbuf);
+
+        /* The new root goes to WAL as a full image, together with meta */
+        state = GenericXLogStart(rel);
+        rootpage = GenericXLogRegisterBuffer(state, rootbuf, GENERIC_XLOG_FULL_IMAGE);
         rootopaque = (CBTPageOpaque) PageGetSpecialPointer(rootpage);
         rootopaque->cbto_prev = rootopaque->cbto_next = InvalidBlockNumber;
         rootopaque->cbto_flags = (CBT_LEAF | CBT_ROOT);
         rootopaque->level = CBT_LEAF_LEVEL;
 
-        /* NO ELOG(ERROR) till meta is updated */
-        START_CRIT_SECTION();
-
+        metad = CBTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
         metad->cbtm_root = rootblkno;
         metad->cbtm_level = 1;
+        metad->cbtm_nleaves = 1;
 
-        MarkBufferDirty(rootbuf);
-        MarkBufferDirty(metabuf);
-
-        END_CRIT_SECTION();
+        GenericXLogFinish(state);
 
         /*
          * swap root write lock for read lock.  There is no danger of anyone
@@ -292,9 +521,7 @@ cbt_getroot(Relation rel, int access)
         /*
          * Cache the metapage data for next time
          */
-        rel->rd_amcache = MemoryContextAlloc(rel->rd_indexcxt,
-                                             sizeof(CBTMetaPageData));
-        memcpy(rel->rd_amcache, metad, sizeof(CBTMetaPageData));
+        cbt_cache_meta(rel, metad);
 
         /* Set metabuf to rootbuf to use in for loop */
         rootbuf = metabuf;
@@ -331,125 +558,977 @@ cbt_getroot(Relation rel, int access)
     return rootbuf;
 }
 
+/*
+ * Keep a copy of the meta page data in rd_amcache, with nothing known yet
+ * about the rightmost leaf or the last search path.
+ */
+static void
+cbt_cache_meta(Relation rel, CBTMetaPageData *metad)
+{
+    CBTCacheData *cache;
+
+    cache = (CBTCacheData *) MemoryContextAlloc(rel->rd_indexcxt,
+                                                sizeof(CBTCacheData));
+    memcpy(&cache->cbtc_meta, metad, sizeof(CBTMetaPageData));
+    cache->cbtc_rightmost = InvalidBlockNumber;
+    cache->cbtc_total = PG_UINT32_MAX;
+    cache->cbtc_pathlen = 0;
+    rel->rd_amcache = cache;
+}
+
+/*
+ * Get the height of the tree, the level of its root, for the planner. The
+ * meta page data cached in rd_amcache is used, as cbt_getroot does, and
+ * the meta page is only read to fill the cache. It may be stale, which is
+ * good enough for an estimate. Returns 0 for an index with no root yet.
+ */
+uint32
+cbt_getrootheight(Relation rel)
+{
+    if (rel->rd_amcache == NULL)
+    {
+        CBTMetaPageData metad;
+
+        if (!cbt_getmeta(rel, &metad) || metad.cbtm_root == InvalidBlockNumber)
+            return 0;
+        cbt_cache_meta(rel, &metad);
+    }
+
+    return ((CBTCacheData *) rel->rd_amcache)->cbtc_meta.cbtm_level;
+}
+
+/*
+ * Copy the content of the meta page into metad. Returns false if the
+ * index has no valid meta page yet.
+ */
+bool
+cbt_getmeta(Relation rel, CBTMetaPageData *metad)
+{
+    Buffer      metabuf;
+    Page        metapg;
+    CBTPageOpaque metaopaque;
+    bool        valid;
+
+    if (RelationGetNumberOfBlocks(rel) == 0)
+        return false;
+
+    metabuf = cbt_get_buffer(rel, CBT_METAPAGE, CBT_READ);
+    metapg = BufferGetPage(metabuf);
+    metaopaque = (CBTPageOpaque) PageGetSpecialPointer(metapg);
+
+    valid = P_ISMETA(metaopaque) &&
+            CBTPageGetMeta(metapg)->cbtm_magic == CBT_MAGIC &&
+            CBTPageGetMeta(metapg)->cbtm_version == CBT_VERSION;
+    if (valid)
+        memcpy(metad, CBTPageGetMeta(metapg), sizeof(CBTMetaPageData));
+
+    UnlockReleaseBuffer(metabuf);
+    return valid;
+}
+
+/*
+ * Read the pending change of a child page, see cbt_pending_sum.
+ */
+static int32
+cbt_child_pending(Relation rel, BlockNumber blkno)
+{
+    Buffer      buf;
+    int32       pending;
+
+    buf = ReadBuffer(rel, blkno);
+    pending = ((volatile CBTPageOpaqueData *)
+               CBTPageGetOpaque(BufferGetPage(buf)))->cbto_pending;
+    ReleaseBuffer(buf);
+
+    return pending;
+}
+
+/*
+ * Sum the changes the children of an internal page keep pending. The
+ * caller holds a lock on the page; only the children on its list are
+ * looked at, and they are only pinned, a lock on them while the parent is
+ * held would be taken in the wrong order. A child's pending change only
+ * moves to or from zero with its parent exclusively locked, and otherwise
+ * changes with the parent share-locked, so with an exclusive lock on the
+ * page the sum is exact.
+ */
+int64
+cbt_pending_sum(Relation rel, Page page)
+{
+    int64       sum = 0;
+    int         i;
+
+    for (i = 0; i < CBTPageGetOpaque(page)->cbto_npending; i++)
+        sum += cbt_child_pending(rel, CBTInternalPending(page)[i]);
+
+    return sum;
+}
+
+/*
+ * cbt_page_search, with the changes kept pending by the children of an
+ * internal page added to their counts. Only the children on the list of
+ * the page are read. This is for writers, which hold the root share-locked
+ * while other writers change what its children keep pending; readers fold
+ * the changes into the counts instead, see cbt_fold_pending.
+ */
+OffsetNumber
+cbt_search_page(Relation rel, Page page, uint32 target, uint32 *leftcount)
+{
+    CBTPageOpaque opaque = CBTPageGetOpaque(page);
+    OffsetNumber maxoff = CBTPageGetNItems(page);
+    OffsetNumber offs[CBT_MAX_PENDING];
+    int32       pending[CBT_MAX_PENDING];
+    int         npending;
+    int         i;
+    OffsetNumber off;
+    int64       left = 0;
+
+    if (P_ISLEAF(opaque) || opaque->cbto_npending == 0)
+        return cbt_page_search(page, target, leftcount);
+
+    npending = opaque->cbto_npending;
+    for (i = 0; i < npending; i++)
+    {
+        BlockNumber blkno = CBTInternalPending(page)[i];
+
+        offs[i] = cbt_internal_find_block(page, blkno, P_FIRSTOFFSET);
+        pending[i] = cbt_child_pending(rel, blkno);
+    }
+
+    for (off = P_FIRSTOFFSET; off <= maxoff; off = OffsetNumberNext(off))
+    {
+        int64       count = CBTInternalGetCount(page, off);
+
+        for (i = 0; i < npending; i++)
+        {
+            if (offs[i] == off)
+                count += pending[i];
+        }
+        if ((int64) target <= left + count)
+        {
+            *leftcount = (uint32) left;
+            return off;
+        }
+        left += count;
+    }
+
+    *leftcount = (uint32) left;
+    return InvalidOffsetNumber;
+}
+
 /*
  * Search the cbtree for a particular scankey. A CBTStack will be returned
  * with the scanning path stored in the stack. The last element in stack is
  * the target item found by search. If the scankey is not in the tree then
- * return NULL.
+ * return NULL. The entries of the stack are kept in path, an array of
+ * CBTREE_MAX_LEVELS entries owned by the caller, so nothing is allocated.
+ *
+ * Only one page is locked at a time. A page may be split after its count
+ * was read in the parent and before it is locked here; the positions that
+ * went to the right half are then beyond the page, and are found by moving
+ * right along cbto_next with the count of the page skipped, as Lehman and
+ * Yao do with keys. The right half is always linked before the parent
+ * learns about it, so nothing is missed, and the descent never has to
+ * restart from the root. Count changes kept pending by the children of a
+ * page are folded into its counts before it is searched (see
+ * cbt_fold_pending), so the position is exact.
+ *
+ * Writers change a leaf first and the counts above it afterwards, one
+ * level per WAL record with the child and the parent locked together (see
+ * cbt_finish_count). A descent that meets a change on its way up reads
+ * the counts above the level it has reached without the change, and those
+ * below with it. It still finds the position either as it was before the
+ * change or as it is after: a page whose downlink still counts tuples it
+ * has lost runs out early, and the descent moves right past it. A page
+ * whose downlink does not count the tuples it has gained yet holds more
+ * than the downlink says: positions on it come out as after the change,
+ * and positions past it as before.
+ *
+ * The path of a read descent is remembered in rd_amcache, and the next one
+ * starts from the lowest page on it whose subtree holds the position, if
+ * that is still valid; see cbt_path_lookup. The stack then only holds the
+ * levels from that page down.
  */
 CBTStack
-cbt_search(Relation rel, uint32 pos, Buffer *bufptr, int access)
+cbt_search(Relation rel, uint32 pos, Buffer *bufptr, int access,
+           CBTStackData *path)
 {
     CBTStack        stack = NULL;
-
-    *bufptr = cbt_getroot(rel, access);
+    uint32          leftcount = 0;
+    int             lockmode = CBT_READ;
+    int             depth = 0;
+    uint32          pagecount = PG_UINT32_MAX;
+    bool            remember;
+
+    *bufptr = InvalidBuffer;
+    if (access == CBT_READ)
+        *bufptr = cbt_path_lookup(rel, pos, &leftcount, &depth);
+    if (BufferIsValid(*bufptr))
+        pagecount = ((CBTCacheData *) rel->rd_amcache)->cbtc_path[depth].cbtp_count;
+    else
+        *bufptr = cbt_getroot(rel, access);
 
     if (!BufferIsValid(*bufptr))
         return (CBTStack) NULL;
 
+    /* Page LSNs only move for WAL-logged relations */
+    remember = access == CBT_READ && RelationNeedsWAL(rel);
+
     for (;;)
     {
         Page        page;
         CBTPageOpaque opaque;
         OffsetNumber offnum;
-        CBTTuple    cbttuple;
-        ItemId      itemid;
+        uint32      pageleft;
         BlockNumber blkno;
 
         page = BufferGetPage(*bufptr);
         opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
-        stack = cbt_search_in_page(*bufptr, pos, stack);
 
-        if (stack == NULL)
+        /* The counts must be exact before the page is searched */
+        if (!P_ISLEAF(opaque) && !P_IGNORE(opaque) && opaque->cbto_npending > 0)
         {
-            UnlockReleaseBuffer(*bufptr);
-            return NULL;
+            LockBuffer(*bufptr, BUFFER_LOCK_UNLOCK);
+            LockBuffer(*bufptr, CBT_WRITE);
+            cbt_fold_pending(rel, *bufptr);
+            continue;
         }
 
+        /*
+         * Positions can only be told apart by the LSN of the root. Nothing
+         * is kept pending below it now; a child can only start to keep a
+         * change pending with the root exclusively locked, which moves its
+         * LSN.
+         */
+        if (depth == 0 && !P_ISROOT(opaque))
+        {
+            if (remember && rel->rd_amcache != NULL)
+                ((CBTCacheData *) rel->rd_amcache)->cbtc_pathlen = 0;
+            remember = false;
+        }
+
+        /*
+         * Upgrade to write lock if necessary. The leaf may change while it
+         * is unlocked, so look at it again.
+         */
+        if (P_ISLEAF(opaque) && access == CBT_WRITE && lockmode != CBT_WRITE)
+        {
+            LockBuffer(*bufptr, BUFFER_LOCK_UNLOCK);
+            LockBuffer(*bufptr, CBT_WRITE);
+            lockmode = CBT_WRITE;
+            continue;
+        }
+
+        /* A deleted page holds nothing, whatever is left on it */
+        if (P_IGNORE(opaque))
+        {
+            offnum = InvalidOffsetNumber;
+            pageleft = 0;
+        }
+        else
+            offnum = cbt_page_search(page, pos - leftcount, &pageleft);
+
+        if (offnum == InvalidOffsetNumber)
+        {
+            /* Beyond the last page of the level, the position doesn't exist */
+            if (P_RIGHTMOST(opaque))
+            {
+                UnlockReleaseBuffer(*bufptr);
+                *bufptr = InvalidBuffer;
+                return NULL;
+            }
+
+            /* Move right, past the tuples of this page */
+            leftcount += pageleft;
+            blkno = opaque->cbto_next;
+            LockBuffer(*bufptr, BUFFER_LOCK_UNLOCK);
+            *bufptr = ReleaseAndReadBuffer(*bufptr, rel, blkno);
+            LockBuffer(*bufptr, lockmode);
+            remember = false;
+            continue;
+        }
+
+        if (depth >= CBTREE_MAX_LEVELS)
+            elog(ERROR, "cbtree index \"%s\" is deeper than %d levels",
+                 RelationGetRelationName(rel), CBTREE_MAX_LEVELS);
+
+        if (remember && rel->rd_amcache != NULL)
+        {
+            CBTCacheData *cache = (CBTCacheData *) rel->rd_amcache;
+            CBTPathLevel *level = &cache->cbtc_path[depth];
+
+            level->cbtp_blkno = BufferGetBlockNumber(*bufptr);
+            level->cbtp_lsn = PageGetLSN(page);
+            level->cbtp_left = leftcount;
+            level->cbtp_count = pagecount;
+            cache->cbtc_pathlen = depth + 1;
+        }
+
+        leftcount += pageleft;
+
+        path[depth].total_count = leftcount;
+        path[depth].cbts_blkno = BufferGetBlockNumber(*bufptr);
+        path[depth].cbts_offset = offnum;
+        path[depth].cbts_parent = stack;
+        stack = &path[depth];
+
         if (P_ISLEAF(opaque))
            break;
 
-        offnum = stack->cbts_offset;
-        itemid = PageGetItemId(page, offnum);
-        cbttuple = (CBTTuple) PageGetItem(page, itemid);
-        blkno = ItemPointerGetBlockNumber(&(cbttuple->itemptr));
+        blkno = CBTInternalGetBlock(page, offnum);
+        pagecount = CBTInternalGetCount(page, offnum);
+        depth++;
 
         LockBuffer(*bufptr, BUFFER_LOCK_UNLOCK);
         *bufptr = ReleaseAndReadBuffer(*bufptr, rel, blkno);
         LockBuffer(*bufptr, CBT_READ);
+        lockmode = CBT_READ;
     }
 
-    /* upgrade to write lock if necessary */
-    if (access == CBT_WRITE) {
-        LockBuffer(*bufptr, BUFFER_LOCK_UNLOCK);
-        LockBuffer(*bufptr, access);
+    return stack;
+}
+
+/*
+ * Find where a read descent to pos can start from the path cached by the
+ * last one: the lowest page on it whose subtree held the position then.
+ * The counts on the path are still right if the root hasn't changed since,
+ * as a change of any count is carried up to it, and the page itself must
+ * be unchanged too, as a split or merge moves items without changing any
+ * count. Both are known from their LSN. The root is only pinned to read
+ * its LSN, so a lookup near the last one costs about one page access.
+ * Returns the page read-locked, with the tuples before it in *leftcount
+ * and its level on the path in *depth, or InvalidBuffer.
+ */
+static Buffer
+cbt_path_lookup(Relation rel, uint32 pos, uint32 *leftcount, int *depth)
+{
+    CBTCacheData *cache = (CBTCacheData *) rel->rd_amcache;
+    CBTPathLevel root;
+    CBTPathLevel level;
+    Buffer      buf;
+    XLogRecPtr  lsn;
+    int         d;
+
+    if (cache == NULL || cache->cbtc_pathlen < 2 || !RelationNeedsWAL(rel))
+        return InvalidBuffer;
+
+    for (d = cache->cbtc_pathlen - 1; d > 0; d--)
+    {
+        level = cache->cbtc_path[d];
+        if (pos > level.cbtp_left && pos - level.cbtp_left <= level.cbtp_count)
+            break;
+    }
+    if (d == 0)
+        return InvalidBuffer;
+    root = cache->cbtc_path[0];
+
+    buf = ReadBuffer(rel, root.cbtp_blkno);
+    lsn = BufferGetLSNAtomic(buf);
+    ReleaseBuffer(buf);
+    if (lsn != root.cbtp_lsn)
+    {
+        cache->cbtc_pathlen = 0;
+        return InvalidBuffer;
     }
 
-    return stack;
+    buf = cbt_get_buffer(rel, level.cbtp_blkno, CBT_READ);
+    if (PageGetLSN(BufferGetPage(buf)) != level.cbtp_lsn)
+    {
+        UnlockReleaseBuffer(buf);
+        cache->cbtc_pathlen = d;
+        return InvalidBuffer;
+    }
+
+    *leftcount = level.cbtp_left;
+    *depth = d;
+    return buf;
 }
 
 /*
- * Find the first item in cbtree that satisfy the scan key.
- * Store the result in the index scan descriptor.
+ * Find the first item in cbtree that satisfy the scan key, in the
+ * direction of the scan. Descend once to the lowest position in range,
+ * or to the highest one for a backward scan, and load the matching items
+ * of that leaf into the scan position.
  */
 bool
 cbt_first(IndexScanDesc scan, ScanDirection dir)
 {
-    ScanKey     sk;
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
     uint32      pos;
-    Buffer      buf;
-    CBTStack    stack;
-    OffsetNumber offnum;
-    Page         page;
-    ItemId      id;
-    CBTTuple    tuple;
-    CBTScanOpaque so = scan->opaque;
+    uint32      prevpos = 0;
 
-    if (!so->first_scan)
+    cbt_preprocess_keys(scan);
+    if (!so->qual_ok)
         return false;
 
-    sk = scan->keyData;
-    if (sk->sk_flags & SK_SEARCHNULL)
-        return false;
+    if (so->arrayPos != NULL)
+        return cbt_array_readchunk(scan, dir,
+                                   ScanDirectionIsForward(dir) ? 0 : so->nArrayPos - 1);
+
+    if (ScanDirectionIsForward(dir))
+        return cbt_descend(scan, dir, so->lowpos);
+
+    /*
+     * The end of the range may be past the end of the sequence, then the
+     * scan starts from the last tuple. If tuples are deleted before the
+     * descent gets there, it is tried again with the new length.
+     */
+    for (;;)
+    {
+        pos = Min(so->highpos, cbt_find_totalcnt(scan->indexRelation));
+        if (pos < so->lowpos || (prevpos != 0 && pos >= prevpos))
+        {
+            PredicateLockRelation(scan->indexRelation, scan->xs_snapshot);
+            return false;
+        }
+
+        if (cbt_descend(scan, dir, pos))
+            return true;
+        prevpos = pos;
+    }
+}
+
+/*
+ * Advance to the next item of the scan in its direction, stepping to a
+ * sibling when the items of the current leaf are used up.
+ */
+bool
+cbt_next(IndexScanDesc scan, ScanDirection dir)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
 
-    pos = (uint32)sk->sk_argument;
+    if (ScanDirectionIsForward(dir))
+    {
+        if (++so->currPos.itemIndex > so->currPos.lastItem)
+            return cbt_steppage(scan, dir);
+    }
+    else
+    {
+        if (--so->currPos.itemIndex < so->currPos.firstItem)
+            return cbt_steppage(scan, dir);
+    }
 
-    stack = cbt_search(scan->indexRelation, pos, &buf, CBT_READ);
+    return true;
+}
+
+/*
+ * Descend to the leaf holding position pos and load the items from there
+ * on in the direction of the scan. Returns false if the position isn't in
+ * the tree, or no item matches.
+ */
+static bool
+cbt_descend(IndexScanDesc scan, ScanDirection dir, uint32 pos)
+{
+    Relation    rel = scan->indexRelation;
+    Buffer      buf;
+    CBTStackData path[CBTREE_MAX_LEVELS];
+    CBTStack    stack;
+    OffsetNumber offnum;
+
+    stack = cbt_search(rel, pos, &buf, CBT_READ, path);
 
     if (!BufferIsValid(buf) || stack == NULL)
     {
-        PredicateLockRelation(scan->indexRelation, scan->xs_snapshot);
+        PredicateLockRelation(rel, scan->xs_snapshot);
         return false;
     }
     else
-        PredicateLockPage(scan->indexRelation, BufferGetBlockNumber(buf), scan->xs_snapshot);
+        PredicateLockPage(rel, BufferGetBlockNumber(buf), scan->xs_snapshot);
 
     offnum = stack->cbts_offset;
-    cbt_freestack(stack);
+    pos = stack->total_count + 1;
 
-    /* read data from the page and read heap tid */
-    page = BufferGetPage(buf);
-    id = PageGetItemId(page, offnum);
-    tuple = (CBTTuple) PageGetItem(page, id);
-    scan->xs_ctup.t_self = tuple->itemptr;
-    UnlockReleaseBuffer(buf);
-    so->first_scan = false;
+    if (!cbt_readpage(scan, dir, buf, offnum, pos))
+    {
+        UnlockReleaseBuffer(buf);
+        return cbt_steppage(scan, dir);
+    }
 
+    UnlockReleaseBuffer(buf);
     return true;
 }
 
 /*
- *  Recursively free the CBTStack and its parents created when searching.
+ * Copy the heap TIDs of a locked leaf into the scan position, starting
+ * from offnum which is at tree position pos and going in the direction of
+ * the scan. Stops at the end of the range. The items are kept in tree
+ * order either way; a backward scan starts from the last one. Returns
+ * true if any item was saved.
+ */
+static bool
+cbt_readpage(IndexScanDesc scan, ScanDirection dir, Buffer buf,
+             OffsetNumber offnum, uint32 pos)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+    Page        page = BufferGetPage(buf);
+    CBTPageOpaque opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
+    int         nitems = CBTPageGetNItems(page);
+    OffsetNumber start = offnum;
+    int         n = 0;
+
+    if (ScanDirectionIsForward(dir))
+    {
+        if (offnum <= nitems && pos <= so->highpos)
+            n = (int) Min((uint32) (nitems - offnum + 1), so->highpos - pos + 1);
+    }
+    else if (offnum >= P_FIRSTOFFSET && offnum <= nitems && pos >= so->lowpos)
+    {
+        n = (int) Min((uint32) (offnum - P_FIRSTOFFSET + 1), pos - so->lowpos + 1);
+        start = offnum - n + 1;
+        pos -= n - 1;
+    }
+
+    /* The entries are fixed-width, decode the whole run at once */
+    if (n > 0)
+        cbt_leaf_gettids(page, start, n, so->currPos.items);
+
+    so->currPos.currPage = BufferGetBlockNumber(buf);
+    so->currPos.firstPos = pos;
+
+    /*
+     * The sibling links only lead on from the ends of the page. A run that
+     * stopped inside the page because the scan turned around is continued
+     * by position, see cbt_steppage. There is no need to go on beyond the
+     * end of the range.
+     */
+    so->currPos.nextPage = (n == 0 || start + n - 1 == nitems) ?
+        opaque->cbto_next : InvalidBlockNumber;
+    so->currPos.prevPage = (n == 0 || start == P_FIRSTOFFSET) ?
+        opaque->cbto_prev : InvalidBlockNumber;
+    so->currPos.moreRight = (int64) pos + n <= (int64) so->highpos &&
+        !(start + n - 1 == nitems && P_RIGHTMOST(opaque));
+    so->currPos.moreLeft = pos > so->lowpos &&
+        !(start == P_FIRSTOFFSET && P_LEFTMOST(opaque));
+
+    so->currPos.firstItem = 0;
+    so->currPos.lastItem = n - 1;
+    so->currPos.itemIndex = ScanDirectionIsForward(dir) ? 0 : n - 1;
+
+    return n > 0;
+}
+
+/*
+ * Move on to the next leaf with matching items in the direction of the
+ * scan. Pages are followed along the sibling links; where the current
+ * items don't reach the end of their page, or the left sibling can't be
+ * found, the next position is found by a new descent instead. Invalidates
+ * the scan position at the end of the range.
+ */
+static bool
+cbt_steppage(IndexScanDesc scan, ScanDirection dir)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+    Relation    rel = scan->indexRelation;
+    BlockNumber blkno;
+    uint32      pos;
+
+    /* A mark set on the page being left has to be kept */
+    if (so->markItemIndex >= 0)
+    {
+        memcpy(&so->markPos, &so->currPos,
+               offsetof(CBTScanPosData, items) +
+               (so->currPos.lastItem + 1) * sizeof(ItemPointerData));
+        so->markPos.itemIndex = so->markItemIndex;
+        so->markItemIndex = -1;
+    }
+
+    if (so->arrayPos != NULL)
+        return cbt_array_readchunk(scan, dir, ScanDirectionIsForward(dir) ?
+                                   so->currPos.arrayLast + 1 :
+                                   so->currPos.arrayFirst - 1);
+
+    if (ScanDirectionIsForward(dir))
+    {
+        if (!so->currPos.moreRight)
+        {
+            CBTScanPosInvalidate(so->currPos);
+            return false;
+        }
+
+        pos = so->currPos.firstPos +
+              (so->currPos.lastItem - so->currPos.firstItem + 1);
+        blkno = so->currPos.nextPage;
+        if (blkno == InvalidBlockNumber)
+            return cbt_descend(scan, dir, pos);
+
+        while (blkno != InvalidBlockNumber)
+        {
+            Buffer      buf;
+            Page        page;
+            CBTPageOpaque opaque;
+
+            CHECK_FOR_INTERRUPTS();
+
+            buf = cbt_get_buffer(rel, blkno, CBT_READ);
+            page = BufferGetPage(buf);
+            opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
+
+            if (!P_IGNORE(opaque))
+            {
+                PredicateLockPage(rel, blkno, scan->xs_snapshot);
+                if (cbt_readpage(scan, dir, buf, P_FIRSTOFFSET, pos))
+                {
+                    UnlockReleaseBuffer(buf);
+                    return true;
+                }
+            }
+
+            blkno = opaque->cbto_next;
+            UnlockReleaseBuffer(buf);
+        }
+    }
+    else
+    {
+        BlockNumber target = so->currPos.currPage;
+
+        if (!so->currPos.moreLeft)
+        {
+            CBTScanPosInvalidate(so->currPos);
+            return false;
+        }
+
+        pos = so->currPos.firstPos - 1;
+        blkno = so->currPos.prevPage;
+        if (blkno == InvalidBlockNumber)
+            return cbt_descend(scan, dir, pos);
+
+        while (blkno != InvalidBlockNumber)
+        {
+            Buffer      buf;
+            Page        page;
+            CBTPageOpaque opaque;
+
+            CHECK_FOR_INTERRUPTS();
+
+            buf = cbt_walk_left(rel, blkno, target);
+            if (!BufferIsValid(buf))
+                return cbt_descend(scan, dir, pos);
+            page = BufferGetPage(buf);
+            opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
+
+            PredicateLockPage(rel, BufferGetBlockNumber(buf), scan->xs_snapshot);
+            if (cbt_readpage(scan, dir, buf, CBTPageGetNItems(page), pos))
+            {
+                UnlockReleaseBuffer(buf);
+                return true;
+            }
+
+            target = BufferGetBlockNumber(buf);
+            blkno = opaque->cbto_prev;
+            UnlockReleaseBuffer(buf);
+        }
+    }
+
+    CBTScanPosInvalidate(so->currPos);
+    return false;
+}
+
+/*
+ * Lock the live left sibling of leaf target for a backward step, starting
+ * from blkno, the left link target had when it was read. Pages split off
+ * the sibling since then are in between, and are passed by moving right,
+ * as nbtree does. Returns InvalidBuffer if the sibling is not found that
+ * way, for instance because it was deleted; the caller then descends by
+ * position instead.
+ */
+static Buffer
+cbt_walk_left(Relation rel, BlockNumber blkno, BlockNumber target)
+{
+    while (blkno != InvalidBlockNumber && blkno != target)
+    {
+        Buffer      buf = cbt_get_buffer(rel, blkno, CBT_READ);
+        CBTPageOpaque opaque = CBTPageGetOpaque(BufferGetPage(buf));
+
+        if (opaque->cbto_next == target && !P_IGNORE(opaque))
+            return buf;
+        if (opaque->cbto_next == target)
+            blkno = InvalidBlockNumber;
+        else
+            blkno = opaque->cbto_next;
+        UnlockReleaseBuffer(buf);
+    }
+
+    return InvalidBuffer;
+}
+
+/*
+ * Look up the tuples of the next chunk of = ANY positions in the direction
+ * of the scan, starting from arrayPos[from], and load them into the scan
+ * position. A chunk is as big as a leaf's worth of items. Positions past
+ * the end of the tree have no tuple, so a forward scan ends at a chunk
+ * without any, and a backward one goes on to the chunk before it.
+ */
+static bool
+cbt_array_readchunk(IndexScanDesc scan, ScanDirection dir, int from)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+
+    while (from >= 0 && from < so->nArrayPos)
+    {
+        int         first;
+        int         last;
+        int         n;
+
+        if (ScanDirectionIsForward(dir))
+        {
+            first = from;
+            last = Min(from + MaxCBTTuplesPerPage, so->nArrayPos) - 1;
+        }
+        else
+        {
+            first = Max(from - MaxCBTTuplesPerPage + 1, 0);
+            last = from;
+        }
+
+        n = cbt_search_many(scan->indexRelation, so->arrayPos + first,
+                            last - first + 1, so->currPos.items);
+
+        /* The items don't come from one leaf, no links are followed */
+        so->currPos.currPage = CBT_METAPAGE;
+        so->currPos.nextPage = so->currPos.prevPage = InvalidBlockNumber;
+        so->currPos.arrayFirst = first;
+        so->currPos.arrayLast = last;
+        so->currPos.firstItem = 0;
+        so->currPos.lastItem = n - 1;
+        so->currPos.itemIndex = ScanDirectionIsForward(dir) ? 0 : n - 1;
+        if (n > 0)
+            return true;
+
+        if (ScanDirectionIsForward(dir))
+            break;
+        from = first - 1;
+    }
+
+    CBTScanPosInvalidate(so->currPos);
+    return false;
+}
+
+/*
+ * Find the heap TIDs at the ntargets positions in targets, which must be
+ * sorted and distinct, and store them into tids in the same order. Returns
+ * how many were found; positions past the end of the tree are left out.
+ *
+ * The positions are resolved in one traversal. Every page is visited once
+ * for all the targets below it: the counts and downlinks of an internal
+ * page are copied and the page unlocked, then the children holding targets
+ * are searched from left to right, so the upper levels a run of targets
+ * has in common are read once. As in cbt_search only one page is locked at
+ * a time, and targets beyond a page that split meanwhile are followed to
+ * its right sibling.
+ */
+int
+cbt_search_many(Relation rel, const uint32 *targets, int ntargets, ItemPointer tids)
+{
+    Buffer      rootbuf;
+    int         nfound = 0;
+
+    if (ntargets == 0)
+        return 0;
+
+    rootbuf = cbt_getroot(rel, CBT_READ);
+    if (!BufferIsValid(rootbuf))
+        return 0;
+
+    cbt_search_many_page(rel, rootbuf, 0, targets, ntargets, tids, &nfound);
+    return nfound;
+}
+
+/*
+ * Resolve targets below the read-locked page in buf, whose first tuple is
+ * at position leftcount + 1, and release the page.
+ */
+static void
+cbt_search_many_page(Relation rel, Buffer buf, uint32 leftcount,
+                     const uint32 *targets, int ntargets,
+                     ItemPointer tids, int *nfound)
+{
+    while (ntargets > 0)
+    {
+        Page        page = BufferGetPage(buf);
+        CBTPageOpaque opaque = CBTPageGetOpaque(page);
+        BlockNumber next = opaque->cbto_next;
+        int         nitems = CBTPageGetNItems(page);
+        int         done = 0;
+        uint32      pagecount = 0;
+
+        CHECK_FOR_INTERRUPTS();
+
+        /* The counts must be exact before they are copied */
+        if (!P_ISLEAF(opaque) && !P_IGNORE(opaque) && opaque->cbto_npending > 0)
+        {
+            LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+            LockBuffer(buf, CBT_WRITE);
+            cbt_fold_pending(rel, buf);
+            continue;
+        }
+
+        /* A deleted page holds nothing, whatever is left on it */
+        if (P_IGNORE(opaque))
+            UnlockReleaseBuffer(buf);
+        else if (P_ISLEAF(opaque))
+        {
+            while (done < ntargets && targets[done] - leftcount <= (uint32) nitems)
+            {
+                cbt_leaf_gettids(page, (OffsetNumber) (targets[done] - leftcount),
+                                 1, &tids[(*nfound)++]);
+                done++;
+            }
+            pagecount = nitems;
+            UnlockReleaseBuffer(buf);
+        }
+        else
+        {
+            /* On the stack, this runs once for every internal page visited */
+            uint32      counts[CBT_INTERNAL_CAPACITY];
+            BlockNumber blocks[CBT_INTERNAL_CAPACITY];
+            int         i;
+
+            Assert(nitems <= CBT_INTERNAL_CAPACITY);
+
+            memcpy(blocks, CBTInternalBlocks(page), nitems * sizeof(BlockNumber));
+            memcpy(counts, CBTInternalCounts(page), nitems * sizeof(uint32));
+            UnlockReleaseBuffer(buf);
+
+            for (i = 0; i < nitems && done < ntargets; i++)
+            {
+                int         first = done;
+
+                while (done < ntargets &&
+                       targets[done] - leftcount <= pagecount + counts[i])
+                    done++;
+                if (done > first)
+                    cbt_search_many_page(rel, cbt_get_buffer(rel, blocks[i], CBT_READ),
+                                         leftcount + pagecount, targets + first,
+                                         done - first, tids, nfound);
+                pagecount += counts[i];
+            }
+        }
+
+        targets += done;
+        ntargets -= done;
+        if (ntargets == 0 || next == InvalidBlockNumber)
+            return;
+
+        /* The rest is beyond this page, move right past its tuples */
+        leftcount += pagecount;
+        buf = cbt_get_buffer(rel, next, CBT_READ);
+    }
+
+    UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Look for the heap TIDs in tids, sorted with cbt_tid_cmp, among the items
+ * of the index. Returns the first one found, or NULL if none of them is
+ * indexed. The leaves are read left to right along cbto_next, so a split
+ * can only move items the walk has yet to see further right; merges and
+ * cuts must be kept out by the caller. This reads the whole index.
+ */
+ItemPointer
+cbt_find_indexed(Relation rel, ItemPointer tids, int ntids)
+{
+    ItemPointer htids;
+    ItemPointer found = NULL;
+    Buffer      buf;
+
+    buf = cbt_leftmost_leaf(rel);
+    if (!BufferIsValid(buf))
+        return NULL;
+
+    htids = (ItemPointer) palloc(MaxCBTTuplesPerPage * sizeof(ItemPointerData));
+
+    for (;;)
+    {
+        Page        page = BufferGetPage(buf);
+        CBTPageOpaque opaque = CBTPageGetOpaque(page);
+        BlockNumber next = opaque->cbto_next;
+        int         nitems = CBTPageGetNItems(page);
+        int         i;
+
+        CHECK_FOR_INTERRUPTS();
+
+        if (!P_IGNORE(opaque) && nitems > 0)
+        {
+            cbt_leaf_gettids(page, P_FIRSTOFFSET, nitems, htids);
+            for (i = 0; i < nitems && found == NULL; i++)
+                found = (ItemPointer) bsearch(&htids[i], tids, ntids,
+                                              sizeof(ItemPointerData),
+                                              cbt_tid_cmp);
+        }
+        UnlockReleaseBuffer(buf);
+
+        if (found != NULL || next == InvalidBlockNumber)
+            break;
+        buf = cbt_get_buffer(rel, next, CBT_READ);
+    }
+
+    pfree(htids);
+    return found;
+}
+
+/*
+ * Read-lock the first leaf of the tree, following the first downlink of
+ * each level down from the root. Returns InvalidBuffer for an empty index.
+ */
+static Buffer
+cbt_leftmost_leaf(Relation rel)
+{
+    Buffer      buf = cbt_getroot(rel, CBT_READ);
+
+    while (BufferIsValid(buf))
+    {
+        Page        page = BufferGetPage(buf);
+        CBTPageOpaque opaque = CBTPageGetOpaque(page);
+        BlockNumber blkno;
+
+        if (P_ISLEAF(opaque))
+            break;
+
+        /* A page deleted since its downlink was read passed its items right */
+        if (P_IGNORE(opaque))
+            blkno = opaque->cbto_next;
+        else
+            blkno = CBTInternalGetBlock(page, P_FIRSTOFFSET);
+        UnlockReleaseBuffer(buf);
+        buf = cbt_get_buffer(rel, blkno, CBT_READ);
+    }
+
+    return buf;
+}
+
+/*
+ * Remember the current item of the scan. The items of the page are only
+ * copied aside if the scan leaves the page, see cbt_steppage.
  */
 void
-cbt_freestack(CBTStack stack)
+cbtmarkpos(IndexScanDesc scan)
 {
-    CBTStack parent;
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
 
-    if(stack == NULL)
-        return;
+    CBTScanPosInvalidate(so->markPos);
+    if (CBTScanPosIsValid(so->currPos))
+        so->markItemIndex = so->currPos.itemIndex;
+    else
+        so->markItemIndex = -1;
+}
 
-    parent = stack->cbts_parent;
-    pfree(stack);
-    cbt_freestack(parent);
-}
\ No newline at end of file
+/*
+ * Go back to the item remembered by cbtmarkpos.
+ */
+void
+cbtrestrpos(IndexScanDesc scan)
+{
+    CBTScanOpaque so = (CBTScanOpaque) scan->opaque;
+
+    if (so->markItemIndex >= 0)
+    {
+        /* The mark is on the page the scan is still on */
+        so->currPos.itemIndex = so->markItemIndex;
+    }
+    else if (CBTScanPosIsValid(so->markPos))
+        memcpy(&so->currPos, &so->markPos,
+               offsetof(CBTScanPosData, items) +
+               (so->markPos.lastItem + 1) * sizeof(ItemPointerData));
+    else
+        CBTScanPosInvalidate(so->currPos);
+}
@@ -1,6 +1,8 @@
 #include "postgres.h"
 
 #include "access/genam.h"
+#include "access/generic_xlog.h"
+#include "access/transam.h"
 #include "storage/ipc.h"
 #include "storage/lmgr.h"
 #include "storage/indexfsm.h"
@@ -20,17 +22,38 @@ typedef struct
     BlockNumber lastBlockLocked;	/* highest blkno we've cleanup-locked */
     BlockNumber totFreePages;	/* true total # of free pages */
     MemoryContext pagedelcontext;
+
+    /* Leaf workspace */
+    ItemPointer htids;          /* heap TIDs of the leaf */
+    OffsetNumber *deletable;    /* offsets of the dead ones */
 } CBTVacState;
 
+/* Working state of cbt_delete_range */
+typedef struct
+{
+    BlockNumber leftpath[CBTREE_MAX_LEVELS + 1];	/* page of from - 1, by level */
+    BlockNumber rightpath[CBTREE_MAX_LEVELS + 1];	/* page of to + 1, by level */
+    uint32      rootlevel;
+    int         nleaves;        /* # of leaves deleted */
+} CBTCutState;
+
 static void cbtvacuumpage(CBTVacState *vstate, BlockNumber blkno);
 static void cbtvacuumscan(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
               IndexBulkDeleteCallback callback, void *callback_state);
 static void cbt_delitem_vacuum(Relation rel, Buffer buf, OffsetNumber itemindex, CBTVacState *vstate);
-static void cbt_reduce_parent(Relation rel, ItemPointer parent, int change);
 static void cbt_delpage_vacuum(Relation rel, Buffer buf, CBTVacState *vstate);
+static void cbt_vacuum_leaf(CBTVacState *vstate, Buffer buf, int ndeletable);
+static void cbt_merge_right(CBTVacState *vstate, Buffer buf);
+static bool cbt_merge_fill(Page newpage, Page page, OffsetNumber first, Page rpage);
+static void cbt_unlink_page(Relation rel, BlockNumber blkno);
 void cbt_start_vacuum(Relation rel);
 void cbt_end_vacuum(Relation rel);
 void cbt_end_vacuum_callback(int code, Datum arg);
+static void cbt_cut_path(Relation rel, uint32 pos, BlockNumber *path);
+static uint32 cbt_cut_page(Relation rel, Buffer buf, uint32 from, uint32 to,
+                           CBTCutState *cut);
+static void cbt_cut_subtree(Relation rel, BlockNumber blkno, CBTCutState *cut);
+static void cbt_cut_relink(Relation rel, BlockNumber left, BlockNumber right);
 
 void
 cbt_end_vacuum(Relation rel)
@@ -87,6 +110,7 @@ cbtvacuumcleanup(IndexVacuumInfo *info,
     BlockNumber npages,
                 blkno;
     Relation	index = info->index;
+    bool		needLock;
 
     /* No-op in ANALYZE ONLY mode */
     if (info->analyze_only)
@@ -95,7 +119,17 @@ cbtvacuumcleanup(IndexVacuumInfo *info,
     if (stats == NULL)
         stats = (IndexBulkDeleteResult *) palloc0(sizeof(IndexBulkDeleteResult));
 
+    /*
+     * Read the length under the relation-extension lock, as cbtvacuumscan
+     * does, so that a page just added by cbt_get_buffer is either left out
+     * or already write-locked, and isn't taken for a free all-zero page.
+     */
+    needLock = !RELATION_IS_LOCAL(index);
+    if (needLock)
+        LockRelationForExtension(index, ExclusiveLock);
     npages = RelationGetNumberOfBlocks(index);
+    if (needLock)
+        UnlockRelationForExtension(index, ExclusiveLock);
     stats->num_pages = npages;
     stats->pages_free = 0;
     stats->num_index_tuples = 0;
@@ -112,14 +146,25 @@ cbtvacuumcleanup(IndexVacuumInfo *info,
         LockBuffer(buffer, BUFFER_LOCK_SHARE);
         page = (Page) BufferGetPage(buffer);
 
-        if (PageIsNew(page) || CBTPageIsDeleted(page))
+        if (cbt_page_recyclable(page))
         {
             RecordFreeIndexPage(index, blkno);
             stats->pages_free++;
         }
-        else
+        else if (CBTPageIsDeleted(page))
         {
-            stats->num_index_tuples += PageGetMaxOffsetNumber(page);
+            /* Unlinked now, it can be reused by a later vacuum */
+            if (!P_ISUNLINKED(CBTPageGetOpaque(page)) ||
+                !TransactionIdIsValid(CBTPageGetOpaque(page)->cbto_xact))
+            {
+                UnlockReleaseBuffer(buffer);
+                cbt_unlink_page(index, blkno);
+                continue;
+            }
+        }
+        else if (P_ISLEAF(CBTPageGetOpaque(page)))
+        {
+            stats->num_index_tuples += CBTPageGetNItems(page);
         }
 
         UnlockReleaseBuffer(buffer);
@@ -131,6 +176,82 @@ cbtvacuumcleanup(IndexVacuumInfo *info,
     return stats;
 }
 
+/*
+ * Take the deleted page blkno out of the sibling chain, and note the next
+ * transaction ID in it: no transaction that starts later can get to the
+ * page. The left sibling is found by moving right from the one the page
+ * links to, as it may have split. If the page cannot be found that way,
+ * nothing links to it, as for the pages cut out by cbt_delete_range, and
+ * it is only stamped.
+ */
+static void
+cbt_unlink_page(Relation rel, BlockNumber blkno)
+{
+    Buffer          buf;
+    Buffer          lbuf = InvalidBuffer;
+    Buffer          rbuf = InvalidBuffer;
+    Page            page;
+    CBTPageOpaque   opaque;
+    BlockNumber     leftsib;
+    bool            linked;
+    GenericXLogState *state;
+
+    buf = cbt_get_buffer(rel, blkno, CBT_READ);
+    opaque = CBTPageGetOpaque(BufferGetPage(buf));
+    linked = !P_ISUNLINKED(opaque);
+    leftsib = linked ? opaque->cbto_prev : InvalidBlockNumber;
+    UnlockReleaseBuffer(buf);
+
+    while (leftsib != InvalidBlockNumber)
+    {
+        CBTPageOpaque lopaque;
+
+        lbuf = cbt_get_buffer(rel, leftsib, CBT_WRITE);
+        lopaque = CBTPageGetOpaque(BufferGetPage(lbuf));
+        if (lopaque->cbto_next == blkno)
+            break;
+        leftsib = lopaque->cbto_next;
+        UnlockReleaseBuffer(lbuf);
+        lbuf = InvalidBuffer;
+
+        /* Fell off the right end, so nothing on the left links to it */
+        if (leftsib == InvalidBlockNumber)
+            linked = false;
+    }
+
+    /* Only vacuum changes a deleted page, so it is still as seen above */
+    buf = cbt_get_buffer(rel, blkno, CBT_WRITE);
+    page = BufferGetPage(buf);
+    opaque = CBTPageGetOpaque(page);
+    if (linked && opaque->cbto_next != InvalidBlockNumber)
+    {
+        rbuf = cbt_get_buffer(rel, opaque->cbto_next, CBT_WRITE);
+        if (CBTPageGetOpaque(BufferGetPage(rbuf))->cbto_prev != blkno)
+        {
+            UnlockReleaseBuffer(rbuf);
+            rbuf = InvalidBuffer;
+        }
+    }
+
+    state = GenericXLogStart(rel);
+    if (BufferIsValid(lbuf))
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, lbuf, 0))->cbto_next =
+            opaque->cbto_next;
+    if (BufferIsValid(rbuf))
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, rbuf, 0))->cbto_prev =
+            BufferIsValid(lbuf) ? BufferGetBlockNumber(lbuf) : InvalidBlockNumber;
+    opaque = CBTPageGetOpaque(GenericXLogRegisterBuffer(state, buf, 0));
+    opaque->cbto_flags |= CBT_UNLINKED;
+    opaque->cbto_xact = ReadNewTransactionId();
+    GenericXLogFinish(state);
+
+    if (BufferIsValid(rbuf))
+        UnlockReleaseBuffer(rbuf);
+    UnlockReleaseBuffer(buf);
+    if (BufferIsValid(lbuf))
+        UnlockReleaseBuffer(lbuf);
+}
+
 /*
  * cbtvacuumscan --- scan the index for VACUUMing purposes
  *
@@ -170,6 +291,9 @@ cbtvacuumscan(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
     vstate.lastBlockLocked = CBT_METAPAGE;
     vstate.totFreePages = 0;
 
+    vstate.htids = (ItemPointer) palloc(MaxCBTTuplesPerPage * sizeof(ItemPointerData));
+    vstate.deletable = (OffsetNumber *) palloc(MaxCBTTuplesPerPage * sizeof(OffsetNumber));
+
     /* Create a temporary memory context to run _bt_pagedel in */
     vstate.pagedelcontext = AllocSetContextCreate(CurrentMemoryContext,
                                                   "_bt_pagedel",
@@ -198,12 +322,17 @@ cbtvacuumscan(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
      * We can skip locking for new or temp relations, however, since no one
      * else could be accessing them.
      */
+    needLock = !RELATION_IS_LOCAL(rel);
 
     blkno = CBT_METAPAGE + 1;
     for (;;)
     {
         /* Get the current relation length */
+        if (needLock)
+            LockRelationForExtension(rel, ExclusiveLock);
         num_pages = RelationGetNumberOfBlocks(rel);
+        if (needLock)
+            UnlockRelationForExtension(rel, ExclusiveLock);
 
         /* Quit if we've scanned the whole relation */
         if (blkno >= num_pages)
@@ -216,6 +345,8 @@ cbtvacuumscan(IndexVacuumInfo *info, IndexBulkDeleteResult *stats,
     }
 
     MemoryContextDelete(vstate.pagedelcontext);
+    pfree(vstate.htids);
+    pfree(vstate.deletable);
 
     /* update statistics */
     stats->num_pages = num_pages;
@@ -236,12 +367,11 @@ cbtvacuumpage(CBTVacState *vstate, BlockNumber blkno)
     page = BufferGetPage(buf);
     opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
 
-    if (P_ISLEAF(opaque))
+    if (P_ISLEAF(opaque) && !P_IGNORE(opaque))
     {
         OffsetNumber offnum,
-                minoff,
-                maxoff,
-                tupledeleted;
+                maxoff;
+        int         ndeletable = 0;
 
 
         /*
@@ -255,94 +385,308 @@ cbtvacuumpage(CBTVacState *vstate, BlockNumber blkno)
 
         /*
          * Scan over all items to see which ones need deleted according to the
-         * callback function.
+         * callback function. The entries are decoded at once.
          */
-        minoff = P_FIRSTOFFSET;
-        maxoff = PageGetMaxOffsetNumber(page);
-        tupledeleted = 0;
-        if (callback)
+        maxoff = CBTPageGetNItems(page);
+        if (callback && !P_IGNORE(opaque) && maxoff >= P_FIRSTOFFSET)
         {
-            for (offnum = minoff;
+            cbt_leaf_gettids(page, P_FIRSTOFFSET, maxoff, vstate->htids);
+            for (offnum = P_FIRSTOFFSET;
                  offnum <= maxoff;
                  offnum = OffsetNumberNext(offnum))
             {
-                CBTTuple	itup;
-                ItemPointer htup;
-
-                itup = (CBTTuple) PageGetItem(page,
-                                                PageGetItemId(page, offnum - tupledeleted));
-                htup = &(itup->itemptr);
-                if (callback(htup, callback_state)) {
-                    cbt_delitem_vacuum(rel, buf, offnum - tupledeleted, vstate);
-                    tupledeleted++;
-                }
+                if (callback(&vstate->htids[offnum - P_FIRSTOFFSET], callback_state))
+                    vstate->deletable[ndeletable++] = offnum;
             }
         }
+
+        if (ndeletable > 0)
+            cbt_vacuum_leaf(vstate, buf, ndeletable);
+        else if (P_INCOMPLETE_COUNT(opaque))
+        {
+            /* An insert that failed half way left its count to carry up */
+            cbt_finish_count(rel, buf, NULL);
+        }
+
+        if (ndeletable > 0 && ndeletable == maxoff)
+        {
+            MemoryContext oldcontext;
+
+            /* The leaf is emptied and goes away */
+
+            /* Run pagedel in a temp context to avoid memory leakage */
+            MemoryContextReset(vstate->pagedelcontext);
+            oldcontext = MemoryContextSwitchTo(vstate->pagedelcontext);
+
+            cbt_delpage_vacuum(rel, buf, vstate);
+
+            MemoryContextSwitchTo(oldcontext);
+        }
+
+        cbt_merge_right(vstate, buf);
+    }
+    else if (!PageIsNew(page) && !P_IGNORE(opaque) && P_INCOMPLETE_COUNT(opaque))
+    {
+        LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+        LockBuffer(buf, CBT_WRITE);
+
+        /* A count change left half way up by an error or crash goes on */
+        if (!P_IGNORE(opaque))
+            cbt_finish_count(rel, buf, NULL);
     }
 
     UnlockReleaseBuffer(buf);
 }
 
-void
-cbt_delitem_vacuum(Relation rel, Buffer buf, OffsetNumber itemindex, CBTVacState *vstate)
+/*
+ * Merge the write-locked leaf in buf into its right sibling if both fit on
+ * one page and either is filled below cbtree.merge_threshold. Otherwise, if
+ * only the sibling is filled below it, move items from the end of the page
+ * to the sibling until the two hold about as many.
+ *
+ * Items only move right, to the front of the sibling. A reader that comes
+ * to the page late finds them by moving right, as after a split. The two
+ * pages must hang under the same parent, so that only two counts of the
+ * parent change and nothing above it does. A page that keeps a change
+ * pending or not carried up yet is not merged away.
+ *
+ * Internal pages are left alone: the children moved would keep parent
+ * hints to a page that may be deleted and reused meanwhile.
+ */
+static void
+cbt_merge_right(CBTVacState *vstate, Buffer buf)
 {
-    Page		page = BufferGetPage(buf);
-    CBTPageOpaque opaque = (CBTPageOpaque )PageGetSpecialPointer(page);
+    Relation        rel = vstate->info->index;
+    Page            page = BufferGetPage(buf);
+    CBTPageOpaque   opaque = CBTPageGetOpaque(page);
+    BlockNumber     blkno = BufferGetBlockNumber(buf);
+    BlockNumber     rblkno = opaque->cbto_next;
+    int             nitems = CBTPageGetNItems(page);
+    Buffer          rbuf;
+    Buffer          pbuf;
+    Page            rpage;
+    Page            ppage;
+    Page            newpage;
+    CBTPageOpaque   ropaque;
+    CBTStackData    pstack;
+    GenericXLogState *state;
+    OffsetNumber    first = P_FIRSTOFFSET;
+    uint32          moved;
+    bool            merge;
+
+    if (cbt_merge_threshold == 0 || nitems == 0 || !P_ISLEAF(opaque) ||
+        P_RIGHTMOST(opaque) ||
+        P_ISROOT(opaque) || P_IGNORE(opaque) || P_INCOMPLETE_SPLIT(opaque) ||
+        !ItemPointerIsValid(&opaque->cbto_parent))
+        return;
 
-    cbt_reduce_parent(rel, &opaque->cbto_parent, -1);
+    rbuf = cbt_get_buffer(rel, rblkno, CBT_WRITE);
+    rpage = BufferGetPage(rbuf);
+    ropaque = CBTPageGetOpaque(rpage);
+    if (P_IGNORE(ropaque) || P_INCOMPLETE_SPLIT(ropaque) || !P_ISLEAF(ropaque))
+    {
+        UnlockReleaseBuffer(rbuf);
+        return;
+    }
 
-    START_CRIT_SECTION();
+    newpage = PageGetTempPage(rpage);
+    merge = (cbt_page_fill(page) < cbt_merge_threshold ||
+             cbt_page_fill(rpage) < cbt_merge_threshold) &&
+            opaque->cbto_pending == 0 && opaque->cbto_incomplete == 0 &&
+            cbt_merge_fill(newpage, page, P_FIRSTOFFSET, rpage);
+    if (!merge)
+    {
+        first = (OffsetNumber) (nitems - (nitems - CBTPageGetNItems(rpage)) / 2 + 1);
+        if (cbt_page_fill(rpage) >= cbt_merge_threshold || first > nitems ||
+            !cbt_merge_fill(newpage, page, first, rpage))
+        {
+            pfree(newpage);
+            UnlockReleaseBuffer(rbuf);
+            return;
+        }
+    }
 
-    PageIndexTupleDelete(page, itemindex);
-    vstate->stats->tuples_removed++;
+    moved = (uint32) (nitems - first + 1);
 
-    MarkBufferDirty(buf);
+    pstack.cbts_blkno = ItemPointerGetBlockNumber(&opaque->cbto_parent);
+    pstack.cbts_offset = ItemPointerGetOffsetNumber(&opaque->cbto_parent);
+    pstack.total_count = 0;
+    pstack.cbts_parent = NULL;
 
-    END_CRIT_SECTION();
+    pbuf = cbt_getstackbuf(rel, &pstack, blkno);
+    if (!BufferIsValid(pbuf) ||
+        pstack.cbts_offset >= CBTPageGetNItems(BufferGetPage(pbuf)) ||
+        CBTInternalGetBlock(BufferGetPage(pbuf), pstack.cbts_offset + 1) != rblkno)
+    {
+        if (BufferIsValid(pbuf))
+            UnlockReleaseBuffer(pbuf);
+        pfree(newpage);
+        UnlockReleaseBuffer(rbuf);
+        return;
+    }
+
+    state = GenericXLogStart(rel);
+    ppage = GenericXLogRegisterBuffer(state, pbuf, 0);
+    CBTInternalGetCount(ppage, pstack.cbts_offset + 1) += moved;
+    if (merge)
+        cbt_page_delitem(ppage, pstack.cbts_offset);
+    else
+        CBTInternalGetCount(ppage, pstack.cbts_offset) -= moved;
+    memcpy(GenericXLogRegisterBuffer(state, rbuf, 0), newpage, BLCKSZ);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    if (merge)
+        CBTPageGetOpaque(page)->cbto_flags |= CBT_DELETED;
+    else
+        cbt_page_delitems(page, first, nitems - first + 1);
+    GenericXLogFinish(state);
 
-    if (PageGetMaxOffsetNumber(page) == 0)
+    pfree(newpage);
+    UnlockReleaseBuffer(pbuf);
+    UnlockReleaseBuffer(rbuf);
+
+    if (merge)
     {
-        MemoryContext oldcontext;
-        int			ndel;
+        cbt_update_meta(rel, -1);
+        vstate->stats->pages_deleted++;
+    }
+}
 
-        /* Run pagedel in a temp context to avoid memory leakage */
-        MemoryContextReset(vstate->pagedelcontext);
-        oldcontext = MemoryContextSwitchTo(vstate->pagedelcontext);
+/*
+ * Fill newpage with the items of page from first on, followed by those of
+ * its right sibling rpage, keeping the links of rpage. Returns false if
+ * they do not fit.
+ */
+static bool
+cbt_merge_fill(Page newpage, Page page, OffsetNumber first, Page rpage)
+{
+    CBTPageOpaque   ropaque = CBTPageGetOpaque(rpage);
+    CBTPageOpaque   nopaque;
+    CBTTupleData    item;
+    OffsetNumber    off;
+
+    CBTInitPage(newpage, ropaque->cbto_flags);
+    PageSetLSN(newpage, PageGetLSN(rpage));
+    nopaque = CBTPageGetOpaque(newpage);
+    nopaque->cbto_prev = ropaque->cbto_prev;
+    nopaque->cbto_next = ropaque->cbto_next;
+    nopaque->cbto_parent = ropaque->cbto_parent;
+    nopaque->cbto_pending = ropaque->cbto_pending;
+    nopaque->cbto_incomplete = ropaque->cbto_incomplete;
+    nopaque->level = ropaque->level;
+
+    for (off = first; off <= CBTPageGetNItems(page); off++)
+    {
+        cbt_page_getitem(page, off, &item);
+        if (!cbt_page_additem(newpage, CBTPageGetNItems(newpage) + 1, &item))
+            return false;
+    }
+    for (off = P_FIRSTOFFSET; off <= CBTPageGetNItems(rpage); off++)
+    {
+        cbt_page_getitem(rpage, off, &item);
+        if (!cbt_page_additem(newpage, CBTPageGetNItems(newpage) + 1, &item))
+            return false;
+    }
 
-        cbt_delpage_vacuum(rel, buf, vstate);
+    return true;
+}
 
-        MemoryContextSwitchTo(oldcontext);
+/*
+ * Remove the ndeletable entries gathered in vstate->deletable from the leaf
+ * in buf, which is cleanup-locked. The count of the leaf's downlink is
+ * reduced in the same WAL record, with the parent locked after the leaf,
+ * and the parent takes the change into its incomplete count, to be carried
+ * on above it before the leaf is unlocked. So the counts of the ancestors
+ * never cover tuples another reader could see gone. A leaf whose parent
+ * can't be found from its hint keeps the change in its own incomplete
+ * count instead.
+ */
+static void
+cbt_vacuum_leaf(CBTVacState *vstate, Buffer buf, int ndeletable)
+{
+    Relation        rel = vstate->info->index;
+    CBTPageOpaque   opaque = CBTPageGetOpaque(BufferGetPage(buf));
+    GenericXLogState *state;
+    CBTStackData    pstack;
+    Buffer          pbuf = InvalidBuffer;
+    Page            page;
+    Page            ppage;
+
+    if (ItemPointerIsValid(&opaque->cbto_parent) && !P_ISROOT(opaque))
+    {
+        pstack.cbts_blkno = ItemPointerGetBlockNumber(&opaque->cbto_parent);
+        pstack.cbts_offset = ItemPointerGetOffsetNumber(&opaque->cbto_parent);
+        pstack.total_count = 0;
+        pstack.cbts_parent = NULL;
+        pbuf = cbt_getstackbuf(rel, &pstack, BufferGetBlockNumber(buf));
+    }
+
+    state = GenericXLogStart(rel);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    cbt_page_multidelete(page, vstate->deletable, ndeletable);
+    if (BufferIsValid(pbuf))
+    {
+        ppage = GenericXLogRegisterBuffer(state, pbuf, 0);
+        CBTInternalGetCount(ppage, pstack.cbts_offset) -= ndeletable;
+        if (!P_ISROOT(CBTPageGetOpaque(ppage)))
+            CBTPageGetOpaque(ppage)->cbto_incomplete -= ndeletable;
     }
+    else if (!P_ISROOT(opaque))
+        CBTPageGetOpaque(page)->cbto_incomplete -= ndeletable;
+    GenericXLogFinish(state);
+    vstate->stats->tuples_removed += ndeletable;
 
+    if (BufferIsValid(pbuf))
+    {
+        cbt_finish_count(rel, pbuf, NULL);
+        UnlockReleaseBuffer(pbuf);
+    }
+
+    /* Also what the leaf had left over, if anything */
+    cbt_finish_count(rel, buf, NULL);
 }
 
+/*
+ * Remove the item at itemindex from the page in buf. The count of a
+ * deleted downlink goes into the incomplete count of the page, in the same
+ * WAL record, and is then carried up; a downlink of an emptied page counts
+ * nothing anymore.
+ */
 void
-cbt_reduce_parent(Relation rel, ItemPointer parent, int change)
+cbt_delitem_vacuum(Relation rel, Buffer buf, OffsetNumber itemindex, CBTVacState *vstate)
 {
-    ItemId      itemid;
-    Buffer      buf;
-    Page        page;
-    CBTTuple    tuple;
-    CBTPageOpaque opaque;
+    Page		page = BufferGetPage(buf);
+    CBTPageOpaque opaque = (CBTPageOpaque )PageGetSpecialPointer(page);
+    CBTTupleData tuple;
+    GenericXLogState *state;
+    Page        xpage;
 
-    if (!ItemPointerIsValid(parent))
-        return;
+    cbt_page_getitem(page, itemindex, &tuple);
 
-    buf = cbt_get_buffer(rel, ItemPointerGetBlockNumber(parent), CBT_WRITE);
-    page = BufferGetPage(buf);
-    opaque = (CBTPageOpaque) PageGetSpecialPointer(page);
-    itemid = PageGetItemId(page, ItemPointerGetOffsetNumber(parent));
-    tuple = (CBTTuple )PageGetItem(page, itemid);
+    state = GenericXLogStart(rel);
+    xpage = GenericXLogRegisterBuffer(state, buf, 0);
+    cbt_page_delitem(xpage, itemindex);
+    if (!P_ISROOT(opaque))
+        CBTPageGetOpaque(xpage)->cbto_incomplete -= (int32) tuple.childcnt;
+    GenericXLogFinish(state);
 
-    START_CRIT_SECTION();
+    if (P_ISLEAF(opaque))
+        vstate->stats->tuples_removed++;
 
-    tuple->childcnt += change;
-    MarkBufferDirty(buf);
+    cbt_finish_count(rel, buf, NULL);
 
-    END_CRIT_SECTION();
+    if (cbt_page_nitems(page) == 0)
+    {
+        MemoryContext oldcontext;
+
+        /* Run pagedel in a temp context to avoid memory leakage */
+        MemoryContextReset(vstate->pagedelcontext);
+        oldcontext = MemoryContextSwitchTo(vstate->pagedelcontext);
+
+        cbt_delpage_vacuum(rel, buf, vstate);
+
+        MemoryContextSwitchTo(oldcontext);
+    }
 
-    UnlockReleaseBuffer(buf);
-    cbt_reduce_parent(rel, &opaque->cbto_parent, change);
 }
 
 
@@ -353,43 +697,387 @@ cbt_delpage_vacuum(Relation rel, Buffer buf, CBTVacState *vstate)
     CBTPageOpaque       opaque = (CBTPageOpaque )PageGetSpecialPointer(page);
     ItemPointerData     parentptr = opaque->cbto_parent;
     Buffer              parentbuf;
+    GenericXLogState   *state;
 
-    if (! ItemPointerIsValid(&parentptr))
+    if (P_ISROOT(opaque))
     {
         Buffer              metabuf;
-        Page                metapg;
         CBTMetaPageData     *metad;
 
         /* The root is empty, update meta page */
-        metabuf = cbt_get_buffer(rel, CBT_METAPAGE, CBT_READ);
-        metapg = BufferGetPage(metabuf);
-        metad = CBTPageGetMeta(metapg);
-
-        Assert(metad->cbtm_root == BufferGetBlockNumber(buf));
+        metabuf = cbt_get_buffer(rel, CBT_METAPAGE, CBT_WRITE);
 
-        START_CRIT_SECTION();
+        Assert(CBTPageGetMeta(BufferGetPage(metabuf))->cbtm_root ==
+               BufferGetBlockNumber(buf));
 
+        state = GenericXLogStart(rel);
+        metad = CBTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
         metad->cbtm_root = InvalidBlockNumber;
-        MarkBufferDirty(metabuf);
-
-        END_CRIT_SECTION();
+        metad->cbtm_level = 0;
+        if (P_ISLEAF(opaque))
+            metad->cbtm_nleaves--;
+        GenericXLogFinish(state);
 
         UnlockReleaseBuffer(metabuf);
     }
     else
     {
-        parentbuf = cbt_get_buffer(rel, ItemPointerGetBlockNumber(&parentptr), CBT_WRITE);
-        cbt_delitem_vacuum(rel, parentbuf, ItemPointerGetOffsetNumber(&parentptr), vstate);
+        CBTStackData        stack;
+
+        /* What the page has not carried up yet goes first */
+        cbt_finish_count(rel, buf, NULL);
+
+        stack.cbts_blkno = ItemPointerGetBlockNumber(&parentptr);
+        stack.cbts_offset = ItemPointerGetOffsetNumber(&parentptr);
+        stack.total_count = 0;
+        stack.cbts_parent = NULL;
+
+        parentbuf = ItemPointerIsValid(&parentptr) ?
+            cbt_getstackbuf(rel, &stack, BufferGetBlockNumber(buf)) : InvalidBuffer;
+        if (!BufferIsValid(parentbuf))
+            elog(ERROR, "failed to re-find parent of block %u in index \"%s\"",
+                 BufferGetBlockNumber(buf), RelationGetRelationName(rel));
+
+        /*
+         * What the page still keeps pending is all its downlink counts now,
+         * settle it so that the downlink goes away counting nothing.
+         */
+        if (opaque->cbto_pending != 0)
+        {
+            Page        parentpage;
+
+            state = GenericXLogStart(rel);
+            parentpage = GenericXLogRegisterBuffer(state, parentbuf, 0);
+            CBTInternalGetCount(parentpage, stack.cbts_offset) += opaque->cbto_pending;
+            cbt_pending_forget(parentpage, BufferGetBlockNumber(buf));
+            CBTPageGetOpaque(GenericXLogRegisterBuffer(state, buf, 0))->cbto_pending = 0;
+            GenericXLogFinish(state);
+        }
+
+        cbt_delitem_vacuum(rel, parentbuf, stack.cbts_offset, vstate);
         UnlockReleaseBuffer(parentbuf);
+
+        if (P_ISLEAF(opaque))
+            cbt_update_meta(rel, -1);
+    }
+
+    state = GenericXLogStart(rel);
+    CBTPageGetOpaque(GenericXLogRegisterBuffer(state, buf, 0))->cbto_flags |= CBT_DELETED;
+    GenericXLogFinish(state);
+
+    vstate->stats->pages_deleted++;
+}
+
+/*
+ * Remove the tuples at positions from to to, inclusive, from the index and
+ * return how many there were. Only the index is changed.
+ *
+ * The cut touches the two boundary paths, those of the positions right
+ * before and after the range, and whatever lies between them. A subtree
+ * entirely within the range loses its downlink and has its pages marked
+ * deleted without its tuples being looked at; only the pages on the
+ * boundary paths lose some of their items and have their counts reduced,
+ * once each. Each level is then linked around its deleted pages. Readers
+ * run concurrently and skip deleted pages as usual, but the caller must
+ * keep other writers out, e.g. with an ExclusiveLock on the table.
+ */
+uint32
+cbt_delete_range(Relation index, uint32 from, uint32 to)
+{
+    CBTCutState cut;
+    uint32      total;
+    uint32      removed;
+    uint32      level;
+    Buffer      rootbuf;
+
+    total = cbt_find_totalcnt(index);
+    if (from < 1)
+        from = 1;
+    if (to > total)
+        to = total;
+    if (from > to)
+        return 0;
+
+    memset(&cut, 0, sizeof(cut));
+    for (level = 0; level <= CBTREE_MAX_LEVELS; level++)
+        cut.leftpath[level] = cut.rightpath[level] = InvalidBlockNumber;
+
+    rootbuf = cbt_getroot(index, CBT_READ);
+    LockBuffer(rootbuf, BUFFER_LOCK_UNLOCK);
+    LockBuffer(rootbuf, CBT_WRITE);
+    cut.rootlevel = CBTPageGetOpaque(BufferGetPage(rootbuf))->level;
+
+    if (from == 1 && to == total)
+    {
+        Buffer          metabuf;
+        CBTMetaPageData *metad;
+        GenericXLogState *state;
+        BlockNumber     rootblkno = BufferGetBlockNumber(rootbuf);
+
+        /* Everything goes, the next insert makes a new root */
+        metabuf = cbt_get_buffer(index, CBT_METAPAGE, CBT_WRITE);
+        state = GenericXLogStart(index);
+        metad = CBTPageGetMeta(GenericXLogRegisterBuffer(state, metabuf, 0));
+        metad->cbtm_root = InvalidBlockNumber;
+        metad->cbtm_level = 0;
+        metad->cbtm_nleaves = 0;
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(metabuf);
+        UnlockReleaseBuffer(rootbuf);
+
+        if (index->rd_amcache != NULL)
+            pfree(index->rd_amcache);
+        index->rd_amcache = NULL;
+
+        cbt_cut_subtree(index, rootblkno, &cut);
+        return total;
     }
 
-    START_CRIT_SECTION();
+    /* The counts of the root must not have changes pending below them */
+    cbt_fold_pending(index, rootbuf);
+    LockBuffer(rootbuf, BUFFER_LOCK_UNLOCK);
 
-    opaque->cbto_flags |= CBT_DELETED;
-    MarkBufferDirty(buf);
+    if (from > 1)
+        cbt_cut_path(index, from - 1, cut.leftpath);
+    if (to < total)
+        cbt_cut_path(index, to + 1, cut.rightpath);
 
-    END_CRIT_SECTION();
+    LockBuffer(rootbuf, CBT_WRITE);
+    removed = cbt_cut_page(index, rootbuf, from, to, &cut);
+    UnlockReleaseBuffer(rootbuf);
 
-    vstate->stats->pages_deleted++;
+    for (level = CBT_LEAF_LEVEL; level < cut.rootlevel; level++)
+    {
+        if (cut.leftpath[level] != cut.rightpath[level])
+            cbt_cut_relink(index, cut.leftpath[level], cut.rightpath[level]);
+    }
+
+    cbt_update_meta(index, -cut.nleaves);
+
+    return removed;
 }
 
+/*
+ * Descend to position pos and note the page of every level on the way in
+ * path, by level. The counts are exact as writers are kept out, so moving
+ * right would only be needed past the right half of a split that has no
+ * downlink yet. Unfinished splits on the path are refused before anything
+ * is changed: the pages partly in the range are all on the boundary paths,
+ * and the count of such a page would cover its right half too.
+ */
+static void
+cbt_cut_path(Relation rel, uint32 pos, BlockNumber *path)
+{
+    Buffer      buf = cbt_getroot(rel, CBT_READ);
+    uint32      leftcount = 0;
+
+    for (;;)
+    {
+        Page            page = BufferGetPage(buf);
+        CBTPageOpaque   opaque = CBTPageGetOpaque(page);
+        OffsetNumber    offnum;
+        uint32          pageleft;
+
+        offnum = cbt_search_page(rel, page, pos - leftcount, &pageleft);
+        if (offnum == InvalidOffsetNumber || P_INCOMPLETE_SPLIT(opaque))
+            ereport(ERROR,
+                    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                     errmsg("index \"%s\" has an unfinished split at block %u",
+                            RelationGetRelationName(rel), BufferGetBlockNumber(buf)),
+                     errhint("An insert at position %u finishes it.", pos)));
+
+        path[opaque->level] = BufferGetBlockNumber(buf);
+        leftcount += pageleft;
+
+        if (P_ISLEAF(opaque))
+            break;
+
+        LockBuffer(buf, BUFFER_LOCK_UNLOCK);
+        buf = ReleaseAndReadBuffer(buf, rel, CBTInternalGetBlock(page, offnum));
+        LockBuffer(buf, CBT_READ);
+    }
+
+    UnlockReleaseBuffer(buf);
+}
+
+/*
+ * Cut positions from to to, counted within the page in buf, out of the
+ * page and the subtree below it. The page is write-locked and not entirely
+ * covered by the range. Children partly in the range are cut first, then
+ * the page loses the downlinks of the children wholly in it, which are
+ * consecutive, and has its other counts reduced, all in one WAL record.
+ * Children with no tuples at the ends of the range go too, as they lie
+ * between the boundary paths. Returns the number of tuples removed.
+ *
+ * Each page records what it lost in its incomplete count in its own
+ * record, and the record of the parent that reduces the downlink takes it
+ * back, so a crash in between leaves a change for vacuum to carry up. The
+ * children cut partly stay locked until then.
+ */
+static uint32
+cbt_cut_page(Relation rel, Buffer buf, uint32 from, uint32 to, CBTCutState *cut)
+{
+    Page            page = BufferGetPage(buf);
+    CBTPageOpaque   opaque = CBTPageGetOpaque(page);
+    GenericXLogState *state;
+    OffsetNumber    nitems = CBTPageGetNItems(page);
+    OffsetNumber    off;
+    OffsetNumber    firstcut = InvalidOffsetNumber;
+    OffsetNumber    partoff[2];
+    uint32          partcut[2];
+    Buffer          partbuf[2];
+    int             npart = 0;
+    int             ncut = 0;
+    BlockNumber    *cutblocks;
+    uint32          left = 0;
+    uint32          removed = 0;
+    int             i;
+
+    if (P_ISLEAF(opaque))
+    {
+        state = GenericXLogStart(rel);
+        page = GenericXLogRegisterBuffer(state, buf, 0);
+        cbt_page_delitems(page, (OffsetNumber) from, (int) (to - from + 1));
+        if (!P_ISROOT(opaque))
+            CBTPageGetOpaque(page)->cbto_incomplete -= (int32) (to - from + 1);
+        GenericXLogFinish(state);
+        return to - from + 1;
+    }
+
+    cutblocks = (BlockNumber *) palloc(nitems * sizeof(BlockNumber));
+
+    for (off = P_FIRSTOFFSET; off <= nitems && left <= to; off = OffsetNumberNext(off))
+    {
+        uint32      count = CBTInternalGetCount(page, off);
+        uint32      lo = Max(from, left + 1);
+        uint32      hi = Min(to, left + count);
+
+        if (left + 1 >= from && left + count <= to)
+        {
+            /* Wholly in the range */
+            if (ncut == 0)
+                firstcut = off;
+            cutblocks[ncut++] = CBTInternalGetBlock(page, off);
+            removed += count;
+        }
+        else if (lo <= hi)
+        {
+            /* Partly in the range, a page on one of the boundary paths */
+            Assert(npart < 2);
+            partbuf[npart] = cbt_get_buffer(rel, CBTInternalGetBlock(page, off), CBT_WRITE);
+            partoff[npart] = off;
+            partcut[npart] = cbt_cut_page(rel, partbuf[npart], lo - left, hi - left, cut);
+            removed += partcut[npart++];
+        }
+
+        left += count;
+    }
+
+    state = GenericXLogStart(rel);
+    page = GenericXLogRegisterBuffer(state, buf, 0);
+    for (i = 0; i < npart; i++)
+    {
+        CBTInternalGetCount(page, partoff[i]) -= partcut[i];
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, partbuf[i], 0))->cbto_incomplete +=
+            (int32) partcut[i];
+    }
+    if (ncut > 0)
+        cbt_page_delitems(page, firstcut, ncut);
+    if (!P_ISROOT(opaque))
+        CBTPageGetOpaque(page)->cbto_incomplete -= (int32) removed;
+    GenericXLogFinish(state);
+
+    for (i = 0; i < npart; i++)
+        UnlockReleaseBuffer(partbuf[i]);
+
+    /* Nothing leads to the cut subtrees anymore */
+    for (i = 0; i < ncut; i++)
+        cbt_cut_subtree(rel, cutblocks[i], cut);
+    pfree(cutblocks);
+
+    return removed;
+}
+
+/*
+ * Mark the page blkno and every page below it deleted. The right half of
+ * an unfinished split is counted in the downlink of the left one, so it
+ * goes along with it.
+ */
+static void
+cbt_cut_subtree(Relation rel, BlockNumber blkno, CBTCutState *cut)
+{
+    while (blkno != InvalidBlockNumber)
+    {
+        Buffer          buf = cbt_get_buffer(rel, blkno, CBT_WRITE);
+        Page            page = BufferGetPage(buf);
+        CBTPageOpaque   opaque = CBTPageGetOpaque(page);
+        GenericXLogState *state;
+        BlockNumber    *children = NULL;
+        int             nchildren = 0;
+        int             i;
+
+        if (!P_ISLEAF(opaque))
+        {
+            nchildren = CBTPageGetNItems(page);
+            children = (BlockNumber *) palloc(Max(nchildren, 1) * sizeof(BlockNumber));
+            memcpy(children, CBTInternalBlocks(page), nchildren * sizeof(BlockNumber));
+        }
+        else if (!P_IGNORE(opaque))
+            cut->nleaves++;
+
+        state = GenericXLogStart(rel);
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, buf, 0))->cbto_flags |=
+            CBT_DELETED | CBT_UNLINKED;
+        GenericXLogFinish(state);
+
+        blkno = P_INCOMPLETE_SPLIT(opaque) ? opaque->cbto_next : InvalidBlockNumber;
+        UnlockReleaseBuffer(buf);
+
+        for (i = 0; i < nchildren; i++)
+            cbt_cut_subtree(rel, children[i], cut);
+        if (children != NULL)
+            pfree(children);
+    }
+}
+
+/*
+ * Link left and right, the pages of a level on either side of the cut, to
+ * each other. Either may be invalid if the cut reached the end of the
+ * level. The left page is locked first, as in a split.
+ */
+static void
+cbt_cut_relink(Relation rel, BlockNumber left, BlockNumber right)
+{
+    Buffer          lbuf = InvalidBuffer;
+    Buffer          rbuf = InvalidBuffer;
+    GenericXLogState *state;
+    bool            changed = false;
+
+    if (left != InvalidBlockNumber)
+        lbuf = cbt_get_buffer(rel, left, CBT_WRITE);
+    if (right != InvalidBlockNumber)
+        rbuf = cbt_get_buffer(rel, right, CBT_WRITE);
+
+    state = GenericXLogStart(rel);
+    if (BufferIsValid(lbuf) &&
+        CBTPageGetOpaque(BufferGetPage(lbuf))->cbto_next != right)
+    {
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, lbuf, 0))->cbto_next = right;
+        changed = true;
+    }
+    if (BufferIsValid(rbuf) &&
+        CBTPageGetOpaque(BufferGetPage(rbuf))->cbto_prev != left)
+    {
+        CBTPageGetOpaque(GenericXLogRegisterBuffer(state, rbuf, 0))->cbto_prev = left;
+        changed = true;
+    }
+    if (changed)
+        GenericXLogFinish(state);
+    else
+        GenericXLogAbort(state);
+
+    if (BufferIsValid(rbuf))
+        UnlockReleaseBuffer(rbuf);
+    if (BufferIsValid(lbuf))
+        UnlockReleaseBuffer(lbuf);
+}
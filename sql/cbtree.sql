@@ -0,0 +1,170 @@
+CREATE EXTENSION cbtree;
+
+-- A cbtree scan must never be replaced by one on the values of the column
+SET enable_seqscan = off;
+SET enable_bitmapscan = off;
+
+--
+-- Positions after inserts, vacuum merges, cuts and splices. The sequence
+-- the index should hold is kept in ref as an array of the data column.
+--
+CREATE TABLE demo (data int, pos int);
+CREATE TABLE ref (seqs int[]);
+INSERT INTO demo SELECT i, 0 FROM generate_series(1, 20000) i;
+INSERT INTO ref SELECT array_agg(i ORDER BY i) FROM generate_series(1, 20000) i;
+CREATE INDEX demo_idx ON demo USING cbtree (pos) WITH (fillfactor = 10);
+
+-- Differences between demo_idx and ref, by a range scan, by lookups of
+-- each position and in the total count
+CREATE FUNCTION check_demo(OUT scan bigint, OUT lookup bigint, OUT count_diff bigint)
+LANGUAGE sql AS $$
+    SELECT
+        (SELECT count(*)
+         FROM (SELECT data, row_number() OVER () AS rn
+               FROM (SELECT data FROM demo WHERE pos >= 1) s) a
+         FULL JOIN (SELECT u.data, u.rn
+                    FROM ref, unnest(seqs) WITH ORDINALITY AS u(data, rn)) e
+              ON e.rn = a.rn
+         WHERE a.data IS DISTINCT FROM e.data),
+        (SELECT count(*)
+         FROM ref, unnest(seqs) WITH ORDINALITY AS u(data, rn)
+         WHERE (SELECT data FROM demo WHERE pos = u.rn::int) IS DISTINCT FROM u.data),
+        cbt_count('demo_idx') - (SELECT cardinality(seqs) FROM ref)
+$$;
+
+SELECT * FROM check_demo();
+
+-- Appends, inserts at the front and inserts at scattered positions
+DO $$
+DECLARE
+    a int[];
+    p int;
+BEGIN
+    SELECT seqs INTO a FROM ref;
+    FOR i IN 1..500 LOOP
+        p := cardinality(a) + 1;
+        INSERT INTO demo VALUES (100000 + i, p);
+        a := a || (100000 + i);
+    END LOOP;
+    FOR i IN 1..500 LOOP
+        INSERT INTO demo VALUES (200000 + i, 1);
+        a := (200000 + i) || a;
+    END LOOP;
+    FOR i IN 1..1000 LOOP
+        p := (i * 7919) % cardinality(a) + 1;
+        INSERT INTO demo VALUES (300000 + i, p);
+        a := a[1:p - 1] || (300000 + i) || a[p:cardinality(a)];
+    END LOOP;
+    UPDATE ref SET seqs = a;
+END
+$$;
+
+SELECT * FROM check_demo();
+
+-- A position past the end appends
+INSERT INTO demo VALUES (400001, 1000000);
+UPDATE ref SET seqs = seqs || 400001;
+
+SELECT * FROM check_demo();
+
+-- Emptying most leaves makes vacuum merge them into their neighbours
+DELETE FROM demo WHERE data % 10 <> 0;
+VACUUM demo;
+UPDATE ref SET seqs = ARRAY(SELECT x FROM ref, unnest(seqs) WITH ORDINALITY AS u(x, n)
+                            WHERE x % 10 = 0 ORDER BY n);
+
+SELECT * FROM check_demo();
+
+-- Cut positions 10 to 59, and splice the rows back in reverse order at 5
+CREATE TABLE cut AS
+    SELECT u.data, u.n FROM ref, unnest(seqs[10:59]) WITH ORDINALITY AS u(data, n);
+
+SELECT cbt_delete_range('demo_idx', 10, 59) AS removed;
+UPDATE ref SET seqs = seqs[1:9] || seqs[60:cardinality(seqs)];
+
+SELECT * FROM check_demo();
+
+DO $$
+BEGIN
+    PERFORM cbt_insert_many('demo_idx', 5,
+                            (SELECT array_agg(d.ctid ORDER BY c.n DESC)
+                             FROM demo d JOIN cut c ON c.data = d.data));
+END
+$$;
+UPDATE ref SET seqs = seqs[1:4] || ARRAY(SELECT data FROM cut ORDER BY n DESC) ||
+                      seqs[5:cardinality(seqs)];
+
+SELECT * FROM check_demo();
+
+SELECT cbt_insert_many('demo_idx', 0, '{}');
+SELECT cbt_delete_range('demo_idx', 1000000, 1000010) AS removed;
+
+-- More inserts and another vacuum on the spliced tree
+DO $$
+DECLARE
+    a int[];
+    p int;
+BEGIN
+    SELECT seqs INTO a FROM ref;
+    FOR i IN 1..500 LOOP
+        p := (i * 104729) % (cardinality(a) + 1) + 1;
+        INSERT INTO demo VALUES (500000 + i, p);
+        a := a[1:p - 1] || (500000 + i) || a[p:cardinality(a)];
+    END LOOP;
+    UPDATE ref SET seqs = a;
+END
+$$;
+DELETE FROM demo WHERE data % 3 = 0;
+VACUUM demo;
+UPDATE ref SET seqs = ARRAY(SELECT x FROM ref, unnest(seqs) WITH ORDINALITY AS u(x, n)
+                            WHERE x % 3 <> 0 ORDER BY n);
+
+SELECT * FROM check_demo();
+
+--
+-- Builds. Each table is filled so that position k should hold data
+-- (k - 1) * step + 1.
+--
+CREATE FUNCTION check_build(tab regclass, step int,
+                            OUT mismatches bigint, OUT positions bigint, OUT counted bigint)
+LANGUAGE plpgsql AS $$
+BEGIN
+    EXECUTE format('SELECT count(*) FILTER (WHERE data <> (rn - 1) * %s + 1), count(*)
+                    FROM (SELECT data, row_number() OVER () AS rn
+                          FROM (SELECT data FROM %s WHERE pos >= 1) s) a', step, tab)
+        INTO mismatches, positions;
+    SELECT cbt_count(i.indexrelid) INTO counted FROM pg_index i WHERE i.indrelid = tab;
+END
+$$;
+
+-- Serial build, in the physical order of the table
+CREATE TABLE built_serial (data int, pos int);
+INSERT INTO built_serial SELECT i, 0 FROM generate_series(1, 50000) i;
+CREATE INDEX built_serial_idx ON built_serial USING cbtree (pos) WITH (fillfactor = 10);
+
+SELECT * FROM check_build('built_serial', 1);
+
+-- build_order, on a table filled out of order
+CREATE TABLE built_ordered (data int, pos int, k int);
+INSERT INTO built_ordered SELECT i, 0, -i FROM generate_series(1, 50000) i ORDER BY (i * 7919) % 50000;
+CREATE INDEX built_ordered_idx ON built_ordered USING cbtree (pos) WITH (fillfactor = 10, build_order = 'k DESC');
+
+SELECT * FROM check_build('built_ordered', 1);
+
+-- Parallel build, with a table big enough for two workers
+SET cbtree.parallel_build_workers = 2;
+CREATE TABLE built_parallel (data int, pos int);
+INSERT INTO built_parallel SELECT i, 0 FROM generate_series(1, 500000) i;
+SELECT pg_relation_size('built_parallel') / current_setting('block_size')::int >= 2048 AS big_enough;
+CREATE INDEX built_parallel_idx ON built_parallel USING cbtree (pos) WITH (fillfactor = 10);
+
+SELECT * FROM check_build('built_parallel', 1);
+SELECT count(*) AS mismatches FROM generate_series(1, 500000, 997) g(k)
+WHERE (SELECT data FROM built_parallel WHERE pos = g.k) IS DISTINCT FROM g.k;
+
+-- Vacuum follows the sibling links and parent hints the
+-- parallel build left
+DELETE FROM built_parallel WHERE data % 2 = 0;
+VACUUM built_parallel;
+
+SELECT * FROM check_build('built_parallel', 2);